@@ -1,8 +1,13 @@
+//For semtimedop.
+#define _GNU_SOURCE
 #include "shmht.h"
 #include "shmht_sem.h"
 #include "shmht_private.h"
 #include "shmht_debug.h"
+#include "shmht_lz.h"
+#include "shmht_probes.h"
 #include <limits.h>
+#include <sched.h>
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -12,8 +17,14 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <sys/time.h>
+#include <time.h>
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 /*
 Credit for primes table: Aaron Krowne
@@ -43,6 +54,175 @@ union semun
 };
 
 
+/****************************************************/
+//Calcules the size classes of the slab allocator and the size of its pages.
+//If pool_size is 0, it's calculed to store number values of the max size.
+static void
+slab_init (struct slab_pool *pool, unsigned int number,
+		   size_t register_size, size_t pool_size)
+{
+	unsigned int max_chunk =
+		(sizeof (struct bucket) + register_size + 7) & ~7;
+	unsigned int chunk = SLAB_MIN_CHUNK;
+	unsigned int i = 0;
+
+	bzero (pool, sizeof (struct slab_pool));
+	while (chunk < max_chunk && i < SLAB_MAX_CLASSES - 1) {
+		pool->classes[i++].chunk_size = chunk;
+		chunk = ((unsigned int) (chunk * SLAB_GROWTH_FACTOR) + 7) & ~7;
+	}
+	//The last class is always the max size.
+	pool->classes[i++].chunk_size = max_chunk;
+	pool->nclasses = i;
+
+	if (pool_size == 0)
+		pool_size = (unsigned long) number *max_chunk;
+	//Big pages for big pools, but a small pool must be splitted between
+	//the classes.
+	pool->page_size = pool_size / SLAB_MIN_PAGES;
+	if (pool->page_size > SLAB_PAGE_SIZE)
+		pool->page_size = SLAB_PAGE_SIZE;
+	if (pool->page_size < max_chunk)
+		pool->page_size = max_chunk;
+	pool->page_size = (pool->page_size + 7) & ~7;
+	//Leave space for the waste at the end of the last page.
+	pool->size = pool_size + pool->page_size;
+	shmht_debug (("slab_init: %u classes, page size %lu, pool size %lu\n",
+				  pool->nclasses, pool->page_size, pool->size));
+}								// slab_init
+
+/****************************************************/
+//Free all the chunks (and pages) of the pool.
+static void
+slab_reset (struct slab_pool *pool)
+{
+	unsigned int i;
+	pool->next_page = 0;
+	for (i = 0; i < pool->nclasses; i++) {
+		pool->classes[i].free = SLAB_NONE;
+		pool->classes[i].used = 0;
+	}
+}								// slab_reset
+
+/****************************************************/
+//The length of a table of number entries (a prime), and its index in primes.
+static unsigned int
+table_length (unsigned int number, unsigned int *pindex)
+{
+	unsigned int size = primes[0];
+
+	for (*pindex = 0; *pindex < prime_table_length; (*pindex)++) {
+		if (primes[*pindex] > number) {
+			size = primes[*pindex];
+			break;
+		}
+	}
+	return size;
+}								// table_length
+
+/****************************************************/
+//Sets the pointers of h to the regions of the shared memory from base, and
+//returns the size of all of them. With base NULL, it only calcules the size.
+//The structure:
+//-------------------------------------------------------------------------
+//| internal_hashtable | entries | colision entries | stats | lock profile |
+//-------------------------------------------------------------------------
+//| versions | tag index | eviction heap | filter | changelog | slab pool |
+//-------------------------------------------------------------------------
+//| buckets |
+//-----------
+static size_t
+shmht_layout (struct shmht *h, void *base, unsigned int size,
+			  unsigned long pool_size, unsigned long filter_size,
+			  unsigned long changelog_size)
+{
+	size_t offset = 0;
+
+	//Entries point, use the void* to do the pointer arithmetic:
+	h->internal_ht = base;
+	offset += sizeof (struct internal_hashtable);
+	h->entrypoint = base + offset;
+	//Collision entries:
+	offset += sizeof (struct entry) * size;
+	h->collisionentries = base + offset;
+	offset += sizeof (struct entry) * size;
+	//Stats, each slot in its own cache lines:
+	offset = CACHE_LINE_ALIGN (offset);
+	h->stats = base + offset;
+	offset += sizeof (struct stats_slot) * STATS_SLOTS;
+	//Lock profile:
+	h->lock_profile = base + offset;
+	offset += sizeof (struct lock_profile);
+	//Versions of the stripes for the near caches:
+	offset = CACHE_LINE_ALIGN (offset);
+	h->versions = base + offset;
+	offset += sizeof (unsigned int) * NEAR_STRIPES;
+	//Heads of the lists of the entries with tags:
+	h->tags = base + offset;
+	offset += sizeof (struct tag_head) * size;
+	//Eviction heap:
+	h->heap = base + offset;
+	offset += sizeof (unsigned int) * size;
+	//Negative lookup filter, in blocks of a cache line:
+	offset = CACHE_LINE_ALIGN (offset);
+	h->filter = base + offset;
+	offset += filter_size;
+	//Changelog, its header and the ring:
+	h->changelog = changelog_size ? base + offset : NULL;
+	if (changelog_size)
+		offset += sizeof (struct changelog) + changelog_size;
+	//Slab allocator:
+	h->slab = base + offset;
+	offset += sizeof (struct slab_pool);
+	//Bucket entries:
+	h->bucketmarket = base + offset;
+	offset += pool_size;
+
+	return offset;
+}								// shmht_layout
+
+/****************************************************/
+//Sets the pointers of h to the regions of an existing table at base, with
+//the layout stored in it, and returns the size of the layout. The size of
+//the pool is in the slab pool header, after the entries, so it's only read
+//if the header is in the layout.
+static size_t
+table_map (struct shmht *h, void *base)
+{
+	struct internal_hashtable *iht = base;
+	size_t size = shmht_layout (h, base, iht->tablelength, 0,
+								iht->filter_size, iht->changelog_size);
+	if (size > iht->layout_size)
+		return size;
+	return shmht_layout (h, base, iht->tablelength,
+						 ((struct slab_pool *) h->slab)->size,
+						 iht->filter_size, iht->changelog_size);
+}								// table_map
+
+/****************************************************/
+//The bulk loads build the next generation of a table in the shared memory of
+//its other key, and publish it marking the current one as replaced. So the
+//current generation is the one of the bulk key if it has been published and
+//it has not been replaced, and else the one of the key of create_shmht.
+
+//The id of the current generation in the bulk key, -1 if it's not there.
+static int
+bulk_generation (key_t bulk_key)
+{
+	struct internal_hashtable *iht;
+	int id, current;
+
+	if (bulk_key == -1 || (id = shmget (bulk_key, 0, 0)) < 0)
+		return -1;
+	iht = shmat (id, NULL, SHM_RDONLY);
+	if (iht == (void *) -1)
+		return -1;
+	current = iht->magic == SHMHT_MAGIC
+		&& !__atomic_load_n (&iht->replaced, __ATOMIC_ACQUIRE);
+	shmdt (iht);
+	return current ? id : -1;
+}								// bulk_generation
+
 /****************************************************/
 struct shmht *
 create_shmht (char *name,
@@ -50,19 +230,64 @@ create_shmht (char *name,
 				  size_t register_size,
 				  unsigned int (*hashf) (void *), int (*eqf) (void *, void *))
 {
+	return create_shmht_ext (name, number, register_size, hashf, eqf, NULL);
+}								//create_shmht
+
+/****************************************************/
+struct shmht *
+create_shmht_ext (char *name,
+				  unsigned int number,
+				  size_t register_size,
+				  unsigned int (*hashf) (void *), int (*eqf) (void *, void *),
+				  const struct shmht_options *opts)
+{
+	return __shmht_create__ (name, 1, -1, number, register_size, hashf, eqf,
+							 opts);
+}								//create_shmht_ext
+
+/****************************************************/
+//Binds the memory of the new shared memory to the NUMA node, before it's
+//touched. The policy stays in the shared memory, so it's the same for all
+//the processes. Without libnuma, it's only a system call.
+static void
+bind_to_node (void *addr, size_t size, int node)
+{
+	unsigned long nodemask[NUMA_MAX_NODES / (8 * sizeof (unsigned long))];
+
+	if (node < 0 || node >= NUMA_MAX_NODES)
+		return;
+	memset (nodemask, 0, sizeof (nodemask));
+	nodemask[node / (8 * sizeof (unsigned long))] =
+		1UL << (node % (8 * sizeof (unsigned long)));
+	//The shmat address is page aligned.
+	if (syscall (SYS_mbind, addr, size, MPOL_BIND, nodemask,
+				 (unsigned long) NUMA_MAX_NODES, 0) < 0)
+		perror ("mbind: ");
+}								// bind_to_node
+
+/****************************************************/
+struct shmht *
+__shmht_create__ (char *name, int proj, int node,
+				  unsigned int number,
+				  size_t register_size,
+				  unsigned int (*hashf) (void *), int (*eqf) (void *, void *),
+				  const struct shmht_options *opts)
+{
 
 	void *primary_pointer;
+	struct slab_pool pool;
+	struct shmht layout;
 	struct shmht *h;
 	int semaphore;
 	int created = 0;
-	unsigned int pindex, size = primes[0];
+	unsigned int pindex, size;
 	//Stuff for the semaphore.
 	union semun arg;
 	arg.val = 0;
 
 	//First create the key for shmget and semget.
 	//Be careful the file must exist.
-	key_t shm_sem_key = ftok (name, 1);
+	key_t shm_sem_key = ftok (name, proj);
 	if (shm_sem_key < 0) {
 		perror ("ftok: ");
 		return NULL;
@@ -72,23 +297,24 @@ create_shmht (char *name,
 	if (number > (1u << 30))
 		return NULL;
 	/* Enforce size as prime */
+	size = table_length (number, &pindex);
 
-	for (pindex = 0; pindex < prime_table_length; pindex++) {
-		if (primes[pindex] > number) {
-			size = primes[pindex];
-			break;
-		}
-	}
 
+	slab_init (&pool, size, register_size, opts ? opts->pool_size : 0);
+	unsigned long filter_size = opts ?
+		(opts->filter_size + FILTER_BLOCK - 1) & ~(FILTER_BLOCK - 1) : 0;
+	unsigned long changelog_size = opts ?
+		CHANGELOG_ALIGN (opts->changelog_size) : 0;
 
 	/*Calcule the necessary size for the hash table */
-	//hashtable structure + 2* entry size + buckets.
-	int all_ht_size =
-		sizeof (struct internal_hashtable) +
-		2 * sizeof (struct entry) * size + (sizeof (struct bucket) +
-											register_size) * size;
-
-	int id = shmget (shm_sem_key, all_ht_size, 0666);
+	size_t all_ht_size = shmht_layout (&layout, NULL, size, pool.size,
+									   filter_size, changelog_size);
+
+	//The plain tables could have the current generation in the bulk key.
+	key_t bulk_key = proj == 1 ? ftok (name, BULK_PROJ) : -1;
+	int id = bulk_generation (bulk_key);
+	if (id < 0)
+		id = shmget (shm_sem_key, all_ht_size, 0666);
 	if (id < 0) {
 		id = shmget (shm_sem_key, all_ht_size, IPC_CREAT | 0666);
 		created = 1;
@@ -98,7 +324,7 @@ create_shmht (char *name,
 		return NULL;
 	}
 
-	shmht_debug (("create_shmht: The shmem id is: %d\n The size is %d \n",
+	shmht_debug (("create_shmht: The shmem id is: %d\n The size is %zu \n",
 				  id, all_ht_size));
 
 	primary_pointer = shmat (id, NULL, 0);
@@ -106,6 +332,7 @@ create_shmht (char *name,
 
 	if (created) {
 		shmht_debug (("create_shmht: As created, clean all the shm!\n"));
+		bind_to_node (primary_pointer, all_ht_size, node);
 		bzero (primary_pointer, all_ht_size);
 	}
 
@@ -136,18 +363,36 @@ create_shmht (char *name,
 	shmht_debug (("create_shmht: The id of the semaphore is: %d\n",
 				  semaphore));
 
-	//The created structure:
-	//------------------------------------------------------------
-	//| internal_hashtable | entries | colision entries | buckets |
-	//------------------------------------------------------------
-	//Entries point, use the void* to do the pointer arithmetic:
-	h->internal_ht = primary_pointer;
-	h->entrypoint = h->internal_ht + sizeof (struct internal_hashtable);
-	//Collision entries:
-	h->collisionentries = h->entrypoint + sizeof (struct entry) * size;
-	//Bucket entries:
-	h->bucketmarket = h->entrypoint + 2 * sizeof (struct entry) * size;
+	//An existing table has its own layout, the options of this process
+	//could be different (and the number, if it has been bulk loaded).
+	if (!created
+		&& ((struct internal_hashtable *) primary_pointer)->magic ==
+		SHMHT_MAGIC) {
+		size = ((struct internal_hashtable *) primary_pointer)->tablelength;
+		pindex = ((struct internal_hashtable *) primary_pointer)->primeindex;
+		filter_size =
+			((struct internal_hashtable *) primary_pointer)->filter_size;
+		changelog_size =
+			((struct internal_hashtable *) primary_pointer)->changelog_size;
+		shmht_layout (h, primary_pointer, size, 0, filter_size,
+					  changelog_size);
+		pool.size = ((struct slab_pool *) h->slab)->size;
+	}
+	shmht_layout (h, primary_pointer, size, pool.size, filter_size,
+				  changelog_size);
+	//Each process updates its own slot of stats (or shares it with a few).
+	h->stats_slot = (struct stats_slot *) h->stats + getpid () % STATS_SLOTS;
+	h->near = NULL;
+	h->threads = 1;
+	h->pool_semaphore = -1;
+	h->readonly = 0;
+	h->key = shm_sem_key;
+	h->bulk_key = bulk_key;
 
+	if (created) {
+		memcpy (h->slab, &pool, sizeof (struct slab_pool));
+		slab_reset (h->slab);
+	}
 
 	//Store the necessary values:
 	struct internal_hashtable *iht = h->internal_ht;
@@ -155,41 +400,113 @@ create_shmht (char *name,
 	if (created) {
 		iht->semaphore = semaphore;
 		iht->shmid = id;
+		iht->key = shm_sem_key;
+		iht->layout_size = all_ht_size;
+		iht->filter_size = filter_size;
+		iht->changelog_size = changelog_size;
+		if (changelog_size)
+			h->changelog->size = changelog_size;
 	}
 
-	//The register_size
-	if (!created)
-		assert
-			("Logical Error: initiated with different length the hash table"
-			 || iht->registry_max_size != register_size);
-
-	iht->registry_max_size = register_size;
-	//The number of registers
-	if (!created)
-		assert
-			("Logical Error: initiated with different length the hash table"
-			 || iht->tablelength != size);
-	iht->tablelength = size;
-	//Index in the prime array.
-	iht->primeindex = pindex;
-	//Number of entries.
-	if (created)
+	//The register_size, the number of registers and the index in the prime
+	//array. The processes that attach to an existing table use the ones of
+	//the table, not the ones they pass.
+	if (created) {
+		iht->registry_max_size = register_size;
+		iht->tablelength = size;
+		iht->primeindex = pindex;
+		//Number of entries.
 		iht->entrycount = 0;
+	}
+	if (created && opts != NULL) {
+		iht->compress_threshold = opts->compress_threshold;
+		iht->eviction = opts->eviction;
+	}
+	//Now the table is ready for the tools.
+	if (created)
+		iht->magic = SHMHT_MAGIC;
 	//Its possible to update in runtime the hash functions of the HT.
 	//hash function.
 	h->hashfn = hashf;
 	//equal funcion.
 	h->eqfn = eqf;
 	return h;
-}								//create_shmht
+}								// __shmht_create__
 
 /*****************************************************************************/
-static unsigned int
-hash (struct shmht *h, void *k)
+//The stats of the read only handles of the process, they are not in the
+//table.
+static struct stats_slot readonly_stats;
+
+struct shmht *
+__shmht_attach__ (char *name, int shmflg)
+{
+	struct shmid_ds ds;
+	key_t shm_sem_key = ftok (name, 1);
+	if (shm_sem_key < 0) {
+		perror ("ftok: ");
+		return NULL;
+	}
+
+	key_t bulk_key = ftok (name, BULK_PROJ);
+	int id = bulk_generation (bulk_key);
+	if (id < 0)
+		id = shmget (shm_sem_key, 0, 0);
+	if (id < 0 || shmctl (id, IPC_STAT, &ds) < 0) {
+		perror ("shmget: ");
+		return NULL;
+	}
+	void *primary_pointer = shmat (id, NULL, shmflg);
+	if (primary_pointer == (void *) -1) {
+		perror ("shmat: ");
+		return NULL;
+	}
+
+	//Check that it's a hashtable, and that the layout fits in the memory
+	//and it's the one stored in the table.
+	struct internal_hashtable *iht = primary_pointer;
+	struct shmht *h = malloc (sizeof (struct shmht));
+	if (h == NULL || iht->magic != SHMHT_MAGIC
+		|| iht->layout_size > ds.shm_segsz
+		|| table_map (h, primary_pointer) != iht->layout_size) {
+		shmdt (primary_pointer);
+		free (h);
+		return NULL;
+	}
+
+	h->readonly = (shmflg & SHM_RDONLY) != 0;
+	//The read only memory can't have the stats of the process.
+	h->stats_slot = h->readonly ? &readonly_stats :
+		(struct stats_slot *) h->stats + getpid () % STATS_SLOTS;
+	h->near = NULL;
+	h->threads = 1;
+	h->pool_semaphore = -1;
+	h->key = shm_sem_key;
+	h->bulk_key = bulk_key;
+	h->hashfn = NULL;
+	h->eqfn = NULL;
+	return h;
+}								// __shmht_attach__
+
+/*****************************************************************************/
+struct shmht *
+shmht_attach_ro (char *name, unsigned int (*hashf) (void *),
+				 int (*eqf) (void *, void *))
+{
+	struct shmht *h = __shmht_attach__ (name, SHM_RDONLY);
+	if (h == NULL)
+		return NULL;
+	h->hashfn = hashf;
+	h->eqfn = eqf;
+	return h;
+}								// shmht_attach_ro
+
+/*****************************************************************************/
+static inline unsigned int
+hash_mix (unsigned int i)
 {
 	/* Aim to protect against poor hash functions by adding logic here
 	 * - logic taken from java 1.4 hashtable source */
-	unsigned int i = h->hashfn (k);
 	i += ~(i << 9);
 	i ^= ((i >> 14) | (i << 18));	/* >>> */
 	i += (i << 4);
@@ -198,15 +515,603 @@ hash (struct shmht *h, void *k)
 }
 
 
+/*****************************************************************************/
+//The locks of the operations. With SHMHT_LOCK_PROFILE, they record in the
+//shared memory how long the process has waited for the lock and how long it
+//has held it.
+
+#ifdef SHMHT_LOCK_PROFILE
+static inline unsigned long
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void
+lock_histogram_add (struct shmht_lock_histogram *hist, unsigned long ns)
+{
+	int b = ns ? 63 - __builtin_clzl (ns) : 0;
+	if (b >= SHMHT_LOCK_HIST_BUCKETS)
+		b = SHMHT_LOCK_HIST_BUCKETS - 1;
+	__atomic_fetch_add (&hist->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&hist->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&hist->buckets[b], 1, __ATOMIC_RELAXED);
+}
+#endif
+
+//The holder of the write lock makes the write_seq odd, so the lock-free
+//readers (of shmht_attach_ro) wait for it, and even again when it unlocks,
+//so they know that they have to search again.
+static inline void
+write_seq_begin (struct internal_hashtable *iht)
+{
+	__atomic_store_n (&iht->write_seq, iht->write_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+}								// write_seq_begin
+
+static inline void
+write_seq_end (struct internal_hashtable *iht)
+{
+	__atomic_store_n (&iht->write_seq, iht->write_seq + 1, __ATOMIC_RELEASE);
+}								// write_seq_end
+
+//The fields of the write intent are set before its operation, and the
+//operation before the changes. Only the order of the stores of the process
+//matters (the one that recovers them reads them after its death), so a
+//compiler barrier is enough.
+#define intent_barrier() __atomic_signal_fence (__ATOMIC_SEQ_CST)
+
+static inline void
+intent_begin (struct internal_hashtable *iht, unsigned int op)
+{
+	intent_barrier ();
+	iht->intent.op = op;
+	intent_barrier ();
+}								// intent_begin
+
+static inline void
+intent_end (struct internal_hashtable *iht)
+{
+	intent_barrier ();
+	iht->intent.op = INTENT_NONE;
+}								// intent_end
+
+//Returns 1 if the process that has the write lock is dead: it died in the
+//middle of a write, and the table must be recovered.
+static int
+owner_dead (struct internal_hashtable *iht)
+{
+	pid_t owner = __atomic_load_n (&iht->intent.owner, __ATOMIC_RELAXED);
+	return owner != 0 && kill (owner, 0) < 0 && errno == ESRCH;
+}								// owner_dead
+
+//The sequence before a lock-free read, when there is not a writer. It's odd
+//if the writer is dead, and then the read only handles can't search until
+//other process recovers the table.
+static inline unsigned long
+read_seq_begin (struct internal_hashtable *iht)
+{
+	unsigned long seq;
+	unsigned int spins = 0;
+	while ((seq = __atomic_load_n (&iht->write_seq, __ATOMIC_ACQUIRE)) & 1) {
+		if (++spins % 64 == 0 && owner_dead (iht))
+			break;
+		sched_yield ();
+	}
+	return seq;
+}								// read_seq_begin
+
+//Returns 1 if there has been a write since read_seq_begin, and what has been
+//read must be discarded.
+static inline int
+read_seq_retry (struct internal_hashtable *iht, unsigned long seq)
+{
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	return __atomic_load_n (&iht->write_seq, __ATOMIC_RELAXED) != seq;
+}								// read_seq_retry
+
+static void recover (struct shmht *h);
+static void table_follow (struct shmht *h);
+
+//With a timeout (relative), it waits for the lock until it expires, and
+//then returns -EAGAIN. Without timeout (NULL) it waits forever. The read
+//only handles can't take the write lock.
+//The semaphore is released by SEM_UNDO when the process that has it dies,
+//but a writer that dies leaves the write_seq odd: then the next writer
+//recovers the table, and a reader takes the write lock to recover it.
+//The generations of a bulk loaded table share the semaphore, so the lock
+//could be got after the table has been replaced (shmht_bulk_publish): then
+//it follows the new one and locks again. The callers must read
+//h->internal_ht after the lock.
+static int
+ht_lock_timed (struct shmht *h, enum shmht_op op, int write,
+			   const struct timespec *timeout)
+{
+	struct internal_hashtable *iht;
+	int ret;
+#ifdef SHMHT_LOCK_PROFILE
+	unsigned long start = now_ns ();
+#endif
+	if (write && h->readonly)
+		return -EROFS;
+	shmht_probe2 (lock__entry, op, write);
+  again:
+	iht = h->internal_ht;
+	if (timeout == NULL)
+		ret = write ? write_lock (iht->semaphore)
+			: read_lock (iht->semaphore);
+	else {
+		ret = write ? write_lock_timed (iht->semaphore, timeout)
+			: read_lock_timed (iht->semaphore, timeout);
+		if (ret < 0 && errno == EAGAIN)
+			ret = -EAGAIN;
+		else if (ret < 0)
+			perror ("semtimedop: ");
+	}
+	if (ret < 0) {
+		shmht_probe3 (lock__return, op, write, ret);
+		return ret;
+	}
+	if (__atomic_load_n (&iht->replaced, __ATOMIC_ACQUIRE)) {
+		if (write)
+			write_unlock (iht->semaphore);
+		else
+			read_unlock (iht->semaphore);
+		table_follow (h);
+		if (h->internal_ht != iht)
+			goto again;
+		shmht_probe3 (lock__return, op, write, -ECANCELED);
+		return -ECANCELED;
+	}
+	if (!write && (iht->write_seq & 1)) {
+		read_unlock (iht->semaphore);
+		ret = timeout == NULL ? write_lock (iht->semaphore)
+			: write_lock_timed (iht->semaphore, timeout);
+		if (ret < 0) {
+			ret = timeout != NULL && errno == EAGAIN ? -EAGAIN : ret;
+			shmht_probe3 (lock__return, op, write, ret);
+			return ret;
+		}
+		if (iht->write_seq & 1) {
+			recover (h);
+			write_seq_end (iht);
+		}
+		write_unlock (iht->semaphore);
+		goto again;
+	}
+	shmht_probe3 (lock__return, op, write, 0);
+	if (write) {
+		int dead = iht->write_seq & 1;
+		if (dead)
+			recover (h);
+		//The owner before the write_seq, for the lock-free readers.
+		iht->intent.owner = getpid ();
+		intent_barrier ();
+		if (!dead)
+			write_seq_begin (iht);
+	}
+	h->lock_op = op;
+	h->lock_write = write;
+#ifdef SHMHT_LOCK_PROFILE
+	struct lock_profile *profile = h->lock_profile;
+	h->lock_acquired = now_ns ();
+	lock_histogram_add (&profile->wait[op], h->lock_acquired - start);
+#endif
+	return 0;
+}								// ht_lock_timed
+
+static int
+ht_lock (struct shmht *h, enum shmht_op op, int write)
+{
+	return ht_lock_timed (h, op, write, NULL) < 0 ? -1 : 0;
+}								// ht_lock
+
+static int
+ht_unlock (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+#ifdef SHMHT_LOCK_PROFILE
+	struct lock_profile *profile = h->lock_profile;
+	lock_histogram_add (&profile->hold[h->lock_op],
+						now_ns () - h->lock_acquired);
+#endif
+	shmht_probe2 (unlock, h->lock_op, h->lock_write);
+	if (h->lock_write) {
+		iht->intent.owner = 0;
+		write_seq_end (iht);
+	}
+	return h->lock_write ? write_unlock (iht->semaphore)
+		: read_unlock (iht->semaphore);
+}								// ht_unlock
+
+#define ht_read_lock(h, op) ht_lock (h, op, 0)
+#define ht_write_lock(h, op) ht_lock (h, op, 1)
+#define ht_read_unlock(h) ht_unlock (h)
+#define ht_write_unlock(h) ht_unlock (h)
+
+//The time left to the deadline (of CLOCK_MONOTONIC), zero if it has passed.
+static void
+timeout_to (const struct timespec *deadline, struct timespec *timeout)
+{
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	timeout->tv_sec = deadline->tv_sec - now.tv_sec;
+	timeout->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+	if (timeout->tv_nsec < 0) {
+		timeout->tv_sec--;
+		timeout->tv_nsec += 1000000000L;
+	}
+	if (timeout->tv_sec < 0)
+		timeout->tv_sec = timeout->tv_nsec = 0;
+}								// timeout_to
+
+//The timeout of the try variants.
+static const struct timespec no_wait = { 0, 0 };
+
+/*****************************************************************************/
+//The negative lookup filter is a counting Bloom filter: each key has
+//FILTER_HASHES counters of a byte, all of them in the same block of a cache
+//line. The writers update it with the write lock, and the searches read it
+//without any lock, so a key that has not any counter set is not in the
+//hashtable. The counters that reach FILTER_MAX are never decremented.
+
+//The counters of the (mixed) hash.
+static void
+filter_counters (struct shmht *h, unsigned int hashvalue,
+				 unsigned char **counters)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned char *block = h->filter +
+		(hashvalue % (iht->filter_size / FILTER_BLOCK)) * FILTER_BLOCK;
+	//Other bits for the position in the block.
+	unsigned int positions = hashvalue * 0x9e3779b1;
+	int i;
+
+	for (i = 0; i < FILTER_HASHES; i++) {
+		counters[i] = block + (positions & (FILTER_BLOCK - 1));
+		positions >>= 6;
+	}
+}								// filter_counters
+
+static void
+filter_add (struct shmht *h, unsigned int hashvalue)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned char *counters[FILTER_HASHES];
+	int i;
+
+	if (iht->filter_size == 0)
+		return;
+	filter_counters (h, hashvalue, counters);
+	for (i = 0; i < FILTER_HASHES; i++) {
+		unsigned char c = __atomic_load_n (counters[i], __ATOMIC_RELAXED);
+		if (c < FILTER_MAX)
+			__atomic_store_n (counters[i], c + 1, __ATOMIC_RELAXED);
+	}
+}								// filter_add
+
+static void
+filter_del (struct shmht *h, unsigned int hashvalue)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned char *counters[FILTER_HASHES];
+	int i;
+
+	if (iht->filter_size == 0)
+		return;
+	filter_counters (h, hashvalue, counters);
+	for (i = 0; i < FILTER_HASHES; i++) {
+		unsigned char c = __atomic_load_n (counters[i], __ATOMIC_RELAXED);
+		if (c > 0 && c < FILTER_MAX)
+			__atomic_store_n (counters[i], c - 1, __ATOMIC_RELAXED);
+	}
+}								// filter_del
+
+//Returns 0 if the key of the hash is not in the hashtable. Without lock.
+static int
+filter_may_contain (struct shmht *h, unsigned int hashvalue)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned char *counters[FILTER_HASHES];
+	int i;
+
+	if (iht->filter_size == 0)
+		return 1;
+	filter_counters (h, hashvalue, counters);
+	for (i = 0; i < FILTER_HASHES; i++)
+		if (__atomic_load_n (counters[i], __ATOMIC_RELAXED) == 0) {
+			stat_add (h, misses, 1);
+			stat_add (h, filter_negatives, 1);
+			return 0;
+		}
+	return 1;
+}								// filter_may_contain
+
+/*****************************************************************************/
+//The near cache of a process keeps copies of the values, and the version of
+//the stripe of the key when they were copied. The writers increment the
+//version of the stripe of each key they insert or remove (all of them in a
+//flush), with the write lock, so the copy is valid while the version is the
+//same, and checking it is only an atomic load.
+
+static inline unsigned int *
+near_version (struct shmht *h, unsigned int hashvalue)
+{
+	return (unsigned int *) h->versions + hashvalue % NEAR_STRIPES;
+}								// near_version
+
+//Invalidates the copies of the keys of the stripe of the (mixed) hash. Must
+//be called with the write lock.
+static void
+near_invalidate (struct shmht *h, unsigned int hashvalue)
+{
+	unsigned int *version = near_version (h, hashvalue);
+	__atomic_store_n (version, *version + 1, __ATOMIC_RELEASE);
+}								// near_invalidate
+
+static void
+near_invalidate_all (struct shmht *h)
+{
+	unsigned int i;
+	for (i = 0; i < NEAR_STRIPES; i++)
+		near_invalidate (h, i);
+}								// near_invalidate_all
+
+/*****************************************************************************/
+//The processes that wait for a lease sleep in the futex of the version of
+//the stripe of the key (it changes with each insert or remove of the stripe),
+//and they are woken when the lease is removed or replaced by the value.
+
+static inline long
+now_ms (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}								// now_ms
+
+//Waits until the version of the stripe is not seen, or for ms.
+static void
+lease_wait (struct shmht *h, unsigned int hashvalue, unsigned int seen,
+			long ms)
+{
+	struct timespec timeout = { ms / 1000, (ms % 1000) * 1000000L };
+	syscall (SYS_futex, near_version (h, hashvalue), FUTEX_WAIT, seen,
+			 &timeout, NULL, 0);
+}								// lease_wait
+
+static void
+lease_wake (struct shmht *h, unsigned int hashvalue)
+{
+	syscall (SYS_futex, near_version (h, hashvalue), FUTEX_WAKE, INT_MAX,
+			 NULL, NULL, 0);
+}								// lease_wake
+
+/*****************************************************************************/
+//The changelog. The writer is the process with the write lock, it reserves
+//the space of the record, writes it and commits it. The readers copy a
+//record and check after it that the writer has not reserved its space again.
+
+static inline struct changelog_record *
+changelog_at (struct changelog *log, unsigned long pos)
+{
+	return (void *) (log + 1) + pos % log->size;
+}								// changelog_at
+
+//Reserves length bytes from pos, forgetting the oldest records.
+static void
+changelog_reserve (struct changelog *log, unsigned long pos,
+				   unsigned long length)
+{
+	__atomic_store_n (&log->reserved, pos + length, __ATOMIC_RELAXED);
+	//The readers of the old records must see the reserve before the data.
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	while (log->tail + log->size < pos + length)
+		__atomic_store_n (&log->tail,
+						  log->tail + changelog_at (log, log->tail)->length,
+						  __ATOMIC_RELAXED);
+}								// changelog_reserve
+
+//Records a change. The values are stored as they are in the table (maybe
+//compressed), unless they are too big for the ring.
+//Must be called from a locked context.
+static void
+changelog_add (struct shmht *h, unsigned int op, void *k, size_t key_size,
+			   void *v, size_t stored_size, size_t value_size,
+			   unsigned int flags)
+{
+	struct changelog *log = h->changelog;
+	struct changelog_record *r;
+
+	if (log == NULL)
+		return;
+	if (CHANGELOG_ALIGN (sizeof (struct changelog_record) + key_size +
+						 stored_size) > log->size / 4) {
+		flags |= CHANGELOG_NO_VALUE;
+		stored_size = 0;
+	}
+	unsigned long length = CHANGELOG_ALIGN (sizeof (struct changelog_record)
+											+ key_size + stored_size);
+	unsigned long pos = log->committed;
+
+	//The records are not splitted, the rest of the ring is padding.
+	unsigned long room = log->size - pos % log->size;
+	if (room < length) {
+		changelog_reserve (log, pos, room);
+		r = changelog_at (log, pos);
+		r->op = CHANGELOG_PAD;
+		r->length = room;
+		pos += room;
+		__atomic_store_n (&log->committed, pos, __ATOMIC_RELEASE);
+	}
+
+	changelog_reserve (log, pos, length);
+	r = changelog_at (log, pos);
+	r->seq = ++log->seq;
+	r->op = op;
+	r->flags = flags;
+	r->key_size = key_size;
+	r->value_size = value_size;
+	r->stored_size = stored_size;
+	r->length = length;
+	if (key_size > 0)
+		memcpy (r + 1, k, key_size);
+	if (stored_size > 0)
+		memcpy ((void *) (r + 1) + key_size, v, stored_size);
+	__atomic_store_n (&log->committed, pos + length, __ATOMIC_RELEASE);
+}								// changelog_add
+
+//The valid copy of the key, or NULL.
+static struct near_slot *
+near_lookup (struct shmht *h, unsigned int hashvalue, void *k,
+			 size_t key_size)
+{
+	struct near_cache *near = h->near;
+	struct near_slot *slot = &near->slots[hashvalue % near->nslots];
+
+	if (!slot->used || slot->hash != hashvalue || slot->key_size != key_size
+		|| slot->version != __atomic_load_n (near_version (h, hashvalue),
+											 __ATOMIC_ACQUIRE)
+		|| bcmp (slot->data, k, key_size)) {
+		near->misses++;
+		return NULL;
+	}
+	near->hits++;
+	stat_add (h, hits, 1);
+	stat_add (h, near_hits, 1);
+	return slot;
+}								// near_lookup
+
+//Keeps a copy of the value, with the version of its stripe when it was read
+//(with the lock).
+static void
+near_store (struct shmht *h, unsigned int hashvalue, void *k,
+			size_t key_size, void *v, size_t value_size,
+			unsigned int version)
+{
+	struct near_cache *near = h->near;
+	struct near_slot *slot = &near->slots[hashvalue % near->nslots];
+
+	if (value_size > near->max_value_size)
+		return;
+	if (slot->size < key_size + value_size) {
+		char *data = realloc (slot->data, key_size + value_size);
+		if (data == NULL)
+			return;
+		slot->data = data;
+		slot->size = key_size + value_size;
+	}
+	memcpy (slot->data, k, key_size);
+	memcpy (slot->data + key_size, v, value_size);
+	slot->used = 1;
+	slot->hash = hashvalue;
+	slot->key_size = key_size;
+	slot->value_size = value_size;
+	slot->version = version;
+}								// near_store
+
+static void
+near_free (struct near_cache *near)
+{
+	unsigned long i;
+	for (i = 0; i < near->nslots; i++)
+		free (near->slots[i].data);
+	free (near->slots);
+	free (near);
+}								// near_free
+
+/*****************************************************************************/
+//The processes follow the new generation of a table (shmht_bulk_publish) in
+//their next operation: they detach the old one, that is freed when the last
+//process leaves it. Its successor could have been replaced and freed too,
+//then the current generation is looked for with the keys.
+static void
+table_follow (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	int shmflg = h->readonly ? SHM_RDONLY : 0;
+	void *base = shmat (iht->successor, NULL, shmflg);
+	unsigned long i;
+
+	if (base == (void *) -1) {
+		int id = bulk_generation (h->bulk_key);
+		if (id < 0)
+			id = shmget (h->key, 0, 0);
+		if (id < 0 || (base = shmat (id, NULL, shmflg)) == (void *) -1)
+			return;
+	}
+	shmdt (h->internal_ht);
+	table_map (h, base);
+	if (!h->readonly)
+		h->stats_slot =
+			(struct stats_slot *) h->stats + getpid () % STATS_SLOTS;
+	//The versions of the copies are the ones of the old generation.
+	if (h->near != NULL)
+		for (i = 0; i < h->near->nslots; i++)
+			h->near->slots[i].used = 0;
+}								// table_follow
+
+static inline void
+table_switch (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	if (__builtin_expect
+		(__atomic_load_n (&iht->replaced, __ATOMIC_ACQUIRE), 0))
+		table_follow (h);
+}								// table_switch
+
+/*****************************************************************************/
+int
+shmht_near_cache (struct shmht *h, size_t entries, size_t max_value_size)
+{
+	struct near_cache *near = NULL;
+
+	if (entries > 0) {
+		near = calloc (1, sizeof (struct near_cache));
+		if (near == NULL)
+			return -ENOMEM;
+		near->slots = calloc (entries, sizeof (struct near_slot));
+		if (near->slots == NULL) {
+			free (near);
+			return -ENOMEM;
+		}
+		near->nslots = entries;
+		near->max_value_size = max_value_size;
+	}
+	if (h->near != NULL)
+		near_free (h->near);
+	h->near = near;
+	return 0;
+}								// shmht_near_cache
+
+/*****************************************************************************/
+int
+shmht_near_stats (struct shmht *h, unsigned long *hits, unsigned long *misses)
+{
+	struct near_cache *near = h->near;
+	if (near == NULL)
+		return -EINVAL;
+	*hits = near->hits;
+	*misses = near->misses;
+	return 0;
+}								// shmht_near_stats
+
 /*****************************************************************************/
 int
 shmht_count (struct shmht *h)
 {
+	table_switch (h);
 	int value = -1;
 	struct internal_hashtable *iht = h->internal_ht;
-	READ_LOCK (iht->semaphore);
+	if (h->readonly)
+		return __atomic_load_n (&iht->entrycount, __ATOMIC_RELAXED);
+	if (ht_read_lock (h, SHMHT_OP_COUNT) < 0)
+		return -1;
+	iht = h->internal_ht;
 	value = iht->entrycount;
-	READ_UNLOCK (iht->semaphore);
+	ht_read_unlock (h);
 	return value;
 }								// hashtable_count
 
@@ -219,96 +1124,512 @@ locate_free_colision_entry (struct shmht *h)
 {
 	int i;
 	struct internal_hashtable *iht = h->internal_ht;
+	shmht_probe0 (free__scan__entry);
 	for (i = 0; i < iht->tablelength; i++) {
 		struct entry *aux = h->collisionentries + (i * sizeof (struct entry));
-		if (!aux->used)
-			return i;
+		if (!entry_in_use (iht, aux))
+			break;
 	}
-	return -1;
+	stat_add (h, free_scans, 1);
+	stat_add (h, free_scan_length, i + 1);
+	stat_max (h, max_free_scan, i + 1);
+	shmht_probe2 (free__scan__return, i + 1,
+				  i < iht->tablelength ? i : -1);
+	return i < iht->tablelength ? i : -1;
 }								// locate_free_colision_entry
 
 
 /*****************************************************************************/
 
-//This function looks for free buckets in the shm.
+//This function looks for the smallest size class for the value.
 static int
-locate_free_bucket (struct shmht *h)
+slab_class_for (struct slab_pool *pool, size_t value_size)
 {
 	int i;
-	struct internal_hashtable *iht = h->internal_ht;
-	for (i = 0; i < iht->tablelength; i++) {
-		struct bucket *aux =
-			h->bucketmarket +
-			(i * (sizeof (struct bucket) + iht->registry_max_size));
-		if (!aux->used)
+	for (i = 0; i < pool->nclasses; i++)
+		if (pool->classes[i].chunk_size - sizeof (struct bucket) >=
+			value_size)
 			return i;
-	}
 	return -1;
-}								// locate_free_bucket
+}								// slab_class_for
 
 /*****************************************************************************/
-int
-shmht_insert (struct shmht *h, void *k, size_t key_size,
-				  void *v, size_t value_size)
+
+//This function takes a free bucket of the size class of the value. If the
+//class has no free buckets, splits a new page of the pool.
+//Returns the offset of the bucket or SLAB_NONE if the pool is full.
+static unsigned long
+slab_alloc (struct shmht *h, size_t value_size)
 {
+	struct slab_pool *pool = h->slab;
+	int c = slab_class_for (pool, value_size);
+	if (c < 0)
+		return SLAB_NONE;
+	struct slab_class *class = &pool->classes[c];
+
+	if (class->free == SLAB_NONE) {
+		unsigned long offset, page = pool->next_page;
+		if (page + pool->page_size > pool->size)
+			return SLAB_NONE;
+		shmht_debug (("slab_alloc: New page at %lu for the class %d\n",
+					  page, c));
+		//The page is taken first, so a process that dies while it links the
+		//chunks only loses the rest of the page.
+		pool->next_page += pool->page_size;
+		intent_barrier ();
+		//Link all the chunks of the page in the free list.
+		for (offset = page;
+			 offset + class->chunk_size <= page + pool->page_size;
+			 offset += class->chunk_size) {
+			struct bucket *chunk = bucket_at (h, offset);
+			chunk->used = 0;
+			chunk->slab_class = c;
+			chunk->next = class->free;
+			class->free = offset;
+		}
+	}
 
-	//first acquire the lock.
-	//If it fails return -ECANCELED.
-	struct internal_hashtable *iht = h->internal_ht;
-	if (write_lock (iht->semaphore) < 0)
-		return -ECANCELED;
+	unsigned long offset = class->free;
+	struct bucket *chunk = bucket_at (h, offset);
+	class->free = chunk->next;
+	class->used++;
+	chunk->used = 1;
+	chunk->next = SLAB_NONE;
+	return offset;
+}								// slab_alloc
 
-	int index = -1;
-	unsigned int key_hash;
-	struct timeval tv;
+/*****************************************************************************/
 
-	if (value_size > iht->registry_max_size) {
-		write_unlock (iht->semaphore);
-		return -EINVAL;
-	}
+//Returns the bucket to the free list of its class.
+static void
+slab_free (struct shmht *h, unsigned long offset)
+{
+	struct slab_pool *pool = h->slab;
+	struct bucket *chunk = bucket_at (h, offset);
+	struct slab_class *class = &pool->classes[chunk->slab_class];
 
-	if (key_size > MAX_KEY_SIZE) {
-		write_unlock (iht->semaphore);
-		return -EINVAL;
+	chunk->used = 0;
+	chunk->next = class->free;
+	class->free = offset;
+	class->used--;
+}								// slab_free
+
+/*****************************************************************************/
+
+//The tables of a container share its pool, that has its own lock (taken
+//inside the lock of the table).
+static inline void
+pool_lock (struct shmht *h)
+{
+	if (h->pool_semaphore >= 0)
+		mutex_lock (h->pool_semaphore, 0);
+}								// pool_lock
+
+static inline void
+pool_unlock (struct shmht *h)
+{
+	if (h->pool_semaphore >= 0)
+		mutex_unlock (h->pool_semaphore, 0);
+}								// pool_unlock
+
+/*****************************************************************************/
+
+//Returns all the buckets of a value to the slab, with the pool locked. The
+//free buckets are skipped, so the recovery can free again a value that could
+//be freed.
+static void
+__value_free__ (struct shmht *h, unsigned long offset)
+{
+	while (offset != SLAB_NONE && bucket_at (h, offset)->used) {
+		unsigned long next = bucket_at (h, offset)->next;
+		slab_free (h, offset);
+		offset = next;
+	}
+}								// __value_free__
+
+//The offset of the value of the entry. The leases have not value, their
+//bucket is the deadline of the lease.
+static inline unsigned long
+entry_bucket (struct entry *e)
+{
+	return (e->flags & ENTRY_LEASE) ? SLAB_NONE : e->bucket;
+}								// entry_bucket
+
+static void
+value_free (struct shmht *h, unsigned long offset)
+{
+	if (offset == SLAB_NONE)
+		return;
+	pool_lock (h);
+	__value_free__ (h, offset);
+	pool_unlock (h);
+}								// value_free
+
+/*****************************************************************************/
+
+//Stores the value in the slab. The values bigger than the max size are
+//stored in a chain of buckets of the biggest class, with the rest of the
+//value in the smallest class that fits it.
+//Returns the offset of the first bucket or SLAB_NONE if there is not memory.
+static unsigned long
+value_store (struct shmht *h, void *v, size_t value_size)
+{
+	struct slab_pool *pool = h->slab;
+	size_t chunk_data =
+		pool->classes[pool->nclasses - 1].chunk_size - sizeof (struct bucket);
+	unsigned long first = SLAB_NONE;
+	struct bucket *last = NULL;
+
+	pool_lock (h);
+	do {
+		size_t part = value_size > chunk_data ? chunk_data : value_size;
+		unsigned long offset = slab_alloc (h, part);
+		if (offset == SLAB_NONE) {
+			//Not enought memory, undo the chain.
+			__value_free__ (h, first);
+			pool_unlock (h);
+			return SLAB_NONE;
+		}
+		memcpy (h->bucketmarket + offset + sizeof (struct bucket), v, part);
+		if (last == NULL)
+			first = offset;
+		else
+			last->next = offset;
+		last = bucket_at (h, offset);
+		v += part;
+		value_size -= part;
+	} while (value_size > 0);
+	pool_unlock (h);
+
+	return first;
+}								// value_store
+
+/*****************************************************************************/
+
+//Copies size bytes of the value from the bucket of offset, following the
+//chain of buckets. The readers of shmht_attach_ro copy the values while they
+//are written, so the offsets are checked.
+static void
+value_copy_at (struct shmht *h, unsigned long offset, size_t size, void *dst)
+{
+	struct slab_pool *pool = h->slab;
+	size_t chunk_data =
+		pool->classes[pool->nclasses - 1].chunk_size - sizeof (struct bucket);
+	size_t left = size;
+
+	while (left > 0 && offset <= pool->size - sizeof (struct bucket)) {
+		size_t part = left > chunk_data ? chunk_data : left;
+		if (part > pool->size - sizeof (struct bucket) - offset)
+			break;
+		memcpy (dst, h->bucketmarket + offset + sizeof (struct bucket), part);
+		dst += part;
+		left -= part;
+		offset = bucket_at (h, offset)->next;
+	}
+}								// value_copy_at
+
+//Copies the value of the entry.
+static void
+value_copy (struct shmht *h, struct entry *e, void *dst)
+{
+	value_copy_at (h, e->bucket, e->bucket_stored_size, dst);
+}								// value_copy
+
+/*****************************************************************************/
+//The tag index: the entries with a tag are in the list of the head of the
+//tag modulo the length of the table, so shmht_invalidate_tag only walks the
+//entries of the tags of its head. The lists link the ids of the entries, 1 +
+//the slot for the entries and 1 + the length + the slot for the colisions.
+//All of them must be called with the write lock.
+
+static inline unsigned int
+entry_id (struct shmht *h, struct entry *e)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	if ((void *) e < h->collisionentries)
+		return 1 + ((void *) e - h->entrypoint) / sizeof (struct entry);
+	return 1 + iht->tablelength +
+		((void *) e - h->collisionentries) / sizeof (struct entry);
+}								// entry_id
+
+static inline struct entry *
+entry_of_id (struct shmht *h, unsigned int id)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	if (id <= iht->tablelength)
+		return h->entrypoint + (id - 1) * sizeof (struct entry);
+	return h->collisionentries +
+		(id - 1 - iht->tablelength) * sizeof (struct entry);
+}								// entry_of_id
+
+//The head of the tag, empty if it's of an old generation.
+static struct tag_head *
+tag_head (struct shmht *h, unsigned int tag)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct tag_head *head = h->tags + tag % iht->tablelength;
+	if (head->generation != iht->generation) {
+		head->generation = iht->generation;
+		head->first = 0;
+	}
+	return head;
+}								// tag_head
+
+//Links the new entry, if it has a tag.
+static void
+tag_link (struct shmht *h, struct entry *e)
+{
+	if (e->tag == 0)
+		return;
+	struct tag_head *head = tag_head (h, e->tag);
+	unsigned int id = entry_id (h, e);
+	e->tag_prev = 0;
+	e->tag_next = head->first;
+	if (head->first)
+		entry_of_id (h, head->first)->tag_prev = id;
+	head->first = id;
+}								// tag_link
+
+//Unlinks the entry that is going to be removed.
+static void
+tag_unlink (struct shmht *h, struct entry *e)
+{
+	if (e->tag == 0)
+		return;
+	if (e->tag_prev)
+		entry_of_id (h, e->tag_prev)->tag_next = e->tag_next;
+	else
+		tag_head (h, e->tag)->first = e->tag_next;
+	if (e->tag_next)
+		entry_of_id (h, e->tag_next)->tag_prev = e->tag_prev;
+}								// tag_unlink
+
+//Relinks the entry that has been copied to e from another slot.
+static void
+tag_moved (struct shmht *h, struct entry *e)
+{
+	if (e->tag == 0)
+		return;
+	unsigned int id = entry_id (h, e);
+	if (e->tag_prev)
+		entry_of_id (h, e->tag_prev)->tag_next = id;
+	else
+		tag_head (h, e->tag)->first = id;
+	if (e->tag_next)
+		entry_of_id (h, e->tag_next)->tag_prev = id;
+}								// tag_moved
+
+/*****************************************************************************/
+//The eviction heap of SHMHT_EVICT_GDS: a binary min-heap of the ids of the
+//entries by their priority, and each entry has its position in it. The
+//searches only set the touched clock of the entries they find, with their
+//read lock, and the eviction gives them their new priority when they reach
+//the top of the heap. All of them must be called with the write lock.
+
+static inline struct entry *
+heap_entry (struct shmht *h, unsigned int pos)
+{
+	return entry_of_id (h, h->heap[pos]);
+}								// heap_entry
+
+static inline void
+heap_set (struct shmht *h, unsigned int pos, unsigned int id)
+{
+	h->heap[pos] = id;
+	entry_of_id (h, id)->heap_pos = pos;
+}								// heap_set
+
+static void
+heap_up (struct shmht *h, unsigned int pos)
+{
+	unsigned int id = h->heap[pos];
+	unsigned long priority = entry_of_id (h, id)->priority;
+
+	while (pos > 0) {
+		unsigned int parent = (pos - 1) / 2;
+		if (heap_entry (h, parent)->priority <= priority)
+			break;
+		heap_set (h, pos, h->heap[parent]);
+		pos = parent;
+	}
+	heap_set (h, pos, id);
+}								// heap_up
+
+static void
+heap_down (struct shmht *h, unsigned int pos)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned int id = h->heap[pos];
+	unsigned long priority = entry_of_id (h, id)->priority;
+
+	for (;;) {
+		unsigned int child = 2 * pos + 1;
+		if (child >= iht->heap_size)
+			break;
+		if (child + 1 < iht->heap_size
+			&& heap_entry (h, child + 1)->priority <
+			heap_entry (h, child)->priority)
+			child++;
+		if (heap_entry (h, child)->priority >= priority)
+			break;
+		heap_set (h, pos, h->heap[child]);
+		pos = child;
+	}
+	heap_set (h, pos, id);
+}								// heap_down
+
+//Places the new entry, with the cost per byte of its key and value.
+static void
+gds_add (struct shmht *h, struct entry *e, unsigned int cost)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned long size = e->key_size + e->value_size;
+
+	if (iht->eviction != SHMHT_EVICT_GDS)
+		return;
+	e->credit = ((unsigned long) cost << GDS_SHIFT) / (size ? size : 1);
+	if (e->credit == 0)
+		e->credit = 1;
+	e->priority = iht->gds_clock + e->credit;
+	e->touched = 0;
+	h->heap[iht->heap_size] = entry_id (h, e);
+	e->heap_pos = iht->heap_size++;
+	heap_up (h, e->heap_pos);
+}								// gds_add
+
+//Takes out the entry that is going to be removed.
+static void
+gds_del (struct shmht *h, struct entry *e)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+
+	if (iht->eviction != SHMHT_EVICT_GDS)
+		return;
+	unsigned int pos = e->heap_pos;
+	unsigned int last = h->heap[--iht->heap_size];
+	if (pos == iht->heap_size)
+		return;
+	heap_set (h, pos, last);
+	heap_down (h, pos);
+	heap_up (h, entry_of_id (h, last)->heap_pos);
+}								// gds_del
+
+//Updates the id of the entry that has been copied to e from another slot.
+static void
+gds_moved (struct shmht *h, struct entry *e)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+
+	if (iht->eviction == SHMHT_EVICT_GDS)
+		h->heap[e->heap_pos] = entry_id (h, e);
+}								// gds_moved
+
+//The entry has been found, with the read lock.
+static inline void
+gds_touch (struct shmht *h, struct entry *e)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+
+	if (iht->eviction == SHMHT_EVICT_GDS)
+		__atomic_store_n (&e->touched, iht->gds_clock, __ATOMIC_RELAXED);
+}								// gds_touch
+
+//Places again all the entries in the heap.
+static void
+heap_rebuild (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned int i;
+
+	iht->heap_size = 0;
+	for (i = 1; i <= 2 * iht->tablelength; i++)
+		if (entry_in_use (iht, entry_of_id (h, i))
+			&& iht->heap_size < iht->tablelength)
+			heap_set (h, iht->heap_size++, i);
+	for (i = iht->heap_size / 2; i > 0; i--)
+		heap_down (h, i - 1);
+}								// heap_rebuild
+
+/*****************************************************************************/
+static struct entry *__shmht_find__ (struct shmht *h, unsigned int hashvalue,
+									 void *k, size_t key_size, int *chain);
+static int __shmht_remove__ (struct shmht *h, unsigned int hashvalue,
+							 void *k, size_t key_size);
+
+//Inserts the value as it must be stored (the compressed value, if it is),
+//with the time sec. The leases (ENTRY_LEASE) have not value.
+//Must be called from a locked context.
+static int
+__shmht_insert__ (struct shmht *h, unsigned int key_hash, void *k,
+				  size_t key_size, void *v, size_t stored_size,
+				  size_t value_size, unsigned int flags, long sec,
+				  unsigned int tag, unsigned int cost)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned long index = SLAB_NONE;
+
+	//Values bigger than the max size are chained, but they must fit in
+	//the memory of the table.
+	struct slab_pool *pool = h->slab;
+	if (stored_size > pool->size || value_size > INT_MAX) {
+		stat_add (h, insert_invalid, 1);
+		return -EINVAL;
+	}
+
+	if (key_size > MAX_KEY_SIZE) {
+		stat_add (h, insert_invalid, 1);
+		return -EINVAL;
+	}
+
+	//The value replaces the lease of the key, if there is one.
+	if (iht->leases > 0 && !(flags & ENTRY_LEASE)) {
+		struct entry *lease =
+			__shmht_find__ (h, key_hash, k, key_size, NULL);
+		if (lease != NULL && (lease->flags & ENTRY_LEASE))
+			__shmht_remove__ (h, key_hash, k, key_size);
 	}
 
 	//Test if we have reached the max size of the HT. This is FIXED.
 	if (iht->tablelength <= iht->entrycount) {
-		write_unlock (iht->semaphore);
+		stat_add (h, insert_full, 1);
 		return -1;
 	}
 
-	//By default if there is size, should be free buckets, but check is almost free.
-	index = locate_free_bucket (h);
-	if (index < 0) {
-		write_unlock (iht->semaphore);
-		return -1;
+	int entryIndex = indexFor (iht->tablelength, key_hash);
+	//If the process dies, the insert is rolled back until the entry is
+	//linked, and completed after.
+	iht->intent.slot = entryIndex;
+	iht->intent.target = 0;
+	iht->intent.linked = 0;
+	iht->intent.bucket = SLAB_NONE;
+	iht->intent.tag = tag;
+	iht->intent.hash = key_hash;
+	iht->intent.entrycount = iht->entrycount;
+	intent_begin (iht, INTENT_INSERT);
+
+	//There could be not free buckets of the size of the value.
+	if (!(flags & ENTRY_LEASE)) {
+		index = value_store (h, v, stored_size);
+		if (index == SLAB_NONE) {
+			intent_end (iht);
+			stat_add (h, insert_nomem, 1);
+			return -1;
+		}
+		iht->intent.bucket = index;
 	}
 
-	//Get the seconds from epoch:
-	gettimeofday (&tv, NULL);
-
-	//Set to used.
-	struct bucket *bucket_ptr =
-		h->bucketmarket +
-		(index * (sizeof (struct bucket) + iht->registry_max_size));
-	bucket_ptr->used = 1;
-	//Copy the value in the bucket.
-	memcpy (h->bucketmarket +
-			(index * (sizeof (struct bucket) + iht->registry_max_size)) +
-			sizeof (struct bucket)
-			, v, value_size);
-	shmht_debug (("shmht_insert: Located free bucket in %d\n", index));
-	key_hash = hash (h, k);
-	int entryIndex = indexFor (iht->tablelength, key_hash);
+	shmht_debug (("shmht_insert: Located free bucket in %lu\n", index));
 	shmht_debug (("shmht_insert: Generated Entry Index: %d \n",
 				  entryIndex));
 	struct entry *index_Entry =
 		h->entrypoint + (entryIndex * sizeof (struct entry));
 
-	if (!index_Entry->used) {
-		//!Colision
+	if (!entry_in_use (iht, index_Entry)) {
+		//!Colision (a flushed entry is free, and so is its stale chain).
+		iht->intent.target = 1 + entryIndex;
+		intent_barrier ();
 		index_Entry->used = 1;
+		index_Entry->generation = iht->generation;
 
 		memcpy (index_Entry->k, k, key_size);
 		index_Entry->key_size = key_size;
@@ -316,14 +1637,24 @@ shmht_insert (struct shmht *h, void *k, size_t key_size,
 		index_Entry->next = -1;
 		index_Entry->bucket = index;
 		index_Entry->position = entryIndex;
-		index_Entry->bucket_stored_size = value_size;
-		index_Entry->sec = tv.tv_sec;
+		index_Entry->bucket_stored_size = stored_size;
+		index_Entry->value_size = value_size;
+		index_Entry->flags = flags;
+		index_Entry->sec = sec;
+		index_Entry->tag = tag;
+		tag_link (h, index_Entry);
+		gds_add (h, index_Entry, cost);
+		intent_barrier ();
+		iht->intent.linked = 1;
+		shmht_probe3 (insert__slot, key_hash, 1, -1);
 
 	}
 	else {
 		//Colision
 		shmht_debug (("shmht_insert: Collision in the entry %d \n",
 					  entryIndex));
+		//Length of the chain with the new entry.
+		int chain = 2;
 		int colision_index = locate_free_colision_entry (h);
 
 		//Paranoid check.
@@ -337,15 +1668,23 @@ shmht_insert (struct shmht *h, void *k, size_t key_size,
 		assert (colision_Entry->used
 				||
 				"Logical Error: locate_free_colision_entry returns a used entry!");
+		iht->intent.target = 1 + iht->tablelength + colision_index;
+		intent_barrier ();
 		colision_Entry->used = 1;
+		colision_Entry->generation = iht->generation;
 		memcpy (colision_Entry->k, k, key_size);
 		colision_Entry->key_size = key_size;
 		colision_Entry->h = key_hash;
 		colision_Entry->next = -1;
 		colision_Entry->position = colision_index;
 		colision_Entry->bucket = index;
-		colision_Entry->bucket_stored_size = value_size;
-		colision_Entry->sec = tv.tv_sec;
+		colision_Entry->bucket_stored_size = stored_size;
+		colision_Entry->value_size = value_size;
+		colision_Entry->flags = flags;
+		colision_Entry->sec = sec;
+		colision_Entry->tag = tag;
+		tag_link (h, colision_Entry);
+		gds_add (h, colision_Entry, cost);
 		//Look for the previous one.
 		if (index_Entry->next == -1) {
 			//There are not more colisions.
@@ -355,22 +1694,198 @@ shmht_insert (struct shmht *h, void *k, size_t key_size,
 		else {
 			//Look for the previous!
 			struct entry *aux = index_Entry;
-			while (aux->next != -1)
+			chain = 1;
+			while (aux->next != -1) {
 				aux =
 					h->collisionentries + (aux->next * sizeof (struct entry));
+				chain++;
+			}
+			stat_max (h, max_chain, chain);
+			chain++;
 			//Set all the stuff of entries:
 			aux->next = colision_index;
 			colision_Entry->next = -1;
 		}
+		intent_barrier ();
+		iht->intent.linked = 1;
+		shmht_probe3 (insert__slot, key_hash, chain, colision_index);
 	}
 	// Add 1 to the entrycount.
 	iht->entrycount++;
-	//unlock the write sem.
-	write_unlock (iht->semaphore);
+	if (flags & ENTRY_LEASE)
+		iht->leases++;
+	else
+		changelog_add (h, SHMHT_CHANGE_INSERT, k, key_size, v, stored_size,
+					   value_size, flags);
+	filter_add (h, key_hash);
+	near_invalidate (h, key_hash);
+	intent_end (iht);
+	stat_add (h, inserts, 1);
 
 	return 1;
+}								// __shmht_insert__
+
+/*****************************************************************************/
+//Inserts the value with the lock. With a shmht_store_mode (0 is the plain
+//insert) the key is checked and replaced in the same lock, it returns 0 if
+//the mode does not store it.
+static int
+insert_stored (struct shmht *h, unsigned int key_hash, void *k,
+			   size_t key_size, void *v, size_t stored_size,
+			   size_t value_size, unsigned int flags, unsigned int tag,
+			   unsigned int cost, const struct timespec *timeout, int mode)
+{
+	struct timeval tv;
+
+	//first acquire the lock.
+	//If it fails return -ECANCELED (-EAGAIN if it times out).
+	int retValue = ht_lock_timed (h, SHMHT_OP_INSERT, 1, timeout);
+	if (retValue < 0)
+		return retValue == -EAGAIN || retValue == -EROFS ? retValue
+			: -ECANCELED;
+
+	if (mode != 0) {
+		struct entry *e = __shmht_find__ (h, key_hash, k, key_size, NULL);
+		int exists = e != NULL && !(e->flags & ENTRY_LEASE);
+		if ((mode == SHMHT_STORE_ADD && exists)
+			|| (mode == SHMHT_STORE_REPLACE && !exists)) {
+			ht_write_unlock (h);
+			return 0;
+		}
+		//All the copies of the key (the plain inserts could duplicate it).
+		while (exists && __shmht_remove__ (h, key_hash, k, key_size) > 0)
+			exists = (e = __shmht_find__ (h, key_hash, k, key_size,
+										  NULL)) != NULL
+				&& !(e->flags & ENTRY_LEASE);
+	}
+
+	//Get the seconds from epoch:
+	gettimeofday (&tv, NULL);
+	retValue = __shmht_insert__ (h, key_hash, k, key_size, v, stored_size,
+								 value_size, flags, tv.tv_sec, tag, cost);
+	//unlock the write sem.
+	ht_write_unlock (h);
+
+	return retValue;
+}								// insert_stored
+
+/*****************************************************************************/
+int
+shmht_insert (struct shmht *h, void *k, size_t key_size,
+				  void *v, size_t value_size)
+{
+	return shmht_insert_hashed (h, h->hashfn (k), k, key_size, v,
+								value_size);
 }								// shmht_insert
 
+/*****************************************************************************/
+//Compresses the value, if it must be, in *compressed (to be freed by the
+//caller). Returns the compressed size, 0 if it must be stored as it is:
+//the values that don't get smaller are not compressed.
+static int
+value_compress (struct shmht *h, void *v, size_t value_size,
+				void **compressed)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+
+	*compressed = NULL;
+	if (!iht->compress_threshold || value_size < iht->compress_threshold
+		|| value_size > INT_MAX)
+		return 0;
+	*compressed = malloc (value_size);
+	if (*compressed == NULL)
+		return 0;
+	return shmht_lz_compress (v, value_size, *compressed, value_size - 1);
+}								// value_compress
+
+//Compresses the value if it must be, and inserts it with the tag and the
+//cost waiting for the lock until the timeout, as the mode of insert_stored.
+static int
+insert_value (struct shmht *h, unsigned int hashvalue, void *k,
+			  size_t key_size, void *v, size_t value_size, unsigned int tag,
+			  unsigned int cost, const struct timespec *timeout, int mode)
+{
+	table_switch (h);
+	void *compressed;
+	int compressed_size;
+	int retValue;
+
+	shmht_probe3 (insert__entry, k, key_size, value_size);
+	//Compress out of the lock.
+	compressed_size = value_compress (h, v, value_size, &compressed);
+
+	if (compressed_size > 0)
+		retValue = insert_stored (h, hash_mix (hashvalue), k, key_size,
+								  compressed, compressed_size, value_size,
+								  ENTRY_COMPRESSED, tag, cost, timeout, mode);
+	else
+		retValue = insert_stored (h, hash_mix (hashvalue), k, key_size, v,
+								  value_size, value_size, 0, tag, cost,
+								  timeout, mode);
+	free (compressed);
+	shmht_probe3 (insert__return, k, key_size, retValue);
+	return retValue;
+}								// insert_value
+
+/*****************************************************************************/
+int
+shmht_insert_hashed (struct shmht *h, unsigned int hashvalue, void *k,
+					 size_t key_size, void *v, size_t value_size)
+{
+	return insert_value (h, hashvalue, k, key_size, v, value_size, 0, 1,
+						 NULL, 0);
+}								// shmht_insert_hashed
+
+/*****************************************************************************/
+int
+shmht_insert_tagged (struct shmht *h, void *k, size_t key_size, void *v,
+					 size_t value_size, unsigned int tag)
+{
+	return insert_value (h, h->hashfn (k), k, key_size, v, value_size, tag,
+						 1, NULL, 0);
+}								// shmht_insert_tagged
+
+/*****************************************************************************/
+int
+shmht_insert_cost (struct shmht *h, void *k, size_t key_size, void *v,
+				   size_t value_size, unsigned int cost)
+{
+	return insert_value (h, h->hashfn (k), k, key_size, v, value_size, 0,
+						 cost, NULL, 0);
+}								// shmht_insert_cost
+
+/*****************************************************************************/
+int
+shmht_store (struct shmht *h, void *k, size_t key_size, void *v,
+			 size_t value_size, enum shmht_store_mode mode)
+{
+	if (mode != SHMHT_STORE_SET && mode != SHMHT_STORE_ADD
+		&& mode != SHMHT_STORE_REPLACE)
+		return -EINVAL;
+	return insert_value (h, h->hashfn (k), k, key_size, v, value_size, 0, 1,
+						 NULL, mode);
+}								// shmht_store
+
+/*****************************************************************************/
+int
+shmht_try_insert (struct shmht *h, void *k, size_t key_size, void *v,
+				  size_t value_size)
+{
+	return insert_value (h, h->hashfn (k), k, key_size, v, value_size, 0, 1,
+						 &no_wait, 0);
+}								// shmht_try_insert
+
+/*****************************************************************************/
+int
+shmht_timed_insert (struct shmht *h, void *k, size_t key_size, void *v,
+					size_t value_size, const struct timespec *deadline)
+{
+	struct timespec timeout;
+	timeout_to (deadline, &timeout);
+	return insert_value (h, h->hashfn (k), k, key_size, v, value_size, 0, 1,
+						 &timeout, 0);
+}								// shmht_timed_insert
+
 /*****************************************************************************/
 //Compare two keys :D
 //Return 0 if equal, 1 if not.
@@ -386,300 +1901,1657 @@ compareBinaryKeys (size_t sk1, void *k1, size_t sk2, void *k2)
 }								// compareBinaryKeys
 
 /*****************************************************************************/
-void *							/* returns the fist value associated with key */
-shmht_search (struct shmht *h, void *k, size_t key_size,
-				  size_t * returned_size)
+//Looks for the entry of the key, with the hash already mixed, also if it's a
+//lease. Returns in chain (if it's not NULL) the number of entries walked.
+//Must be called from a locked context, or between read_seq_begin and
+//read_seq_retry.
+static struct entry *
+__shmht_find__ (struct shmht *h, unsigned int hashvalue, void *k,
+				size_t key_size, int *chain)
 {
 	struct internal_hashtable *iht = h->internal_ht;
-	if (read_lock (iht->semaphore) < 0)
-		return NULL;
-	void *retValue = NULL;
 	struct entry *index_Entry;
-	unsigned int hashvalue, index;
+	unsigned int index;
+	int walked = 0;
 
-	//Calcule the hash
-	hashvalue = hash (h, k);
 	//Look for the index in the hashtable.
 	index = indexFor (iht->tablelength, hashvalue);
-	shmht_debug (("shmht_search: Index for this key: %d", index));
+	shmht_debug (("__shmht_find__: Index for this key: %d", index));
 	//Calcule the offset:
 	index_Entry = h->entrypoint + (index * sizeof (struct entry));
-	while (index_Entry != NULL && index_Entry->used) {
+	while (index_Entry != NULL && entry_in_use (iht, index_Entry)) {
+		walked++;
 		/* Check hash value to short circuit heavier comparison */
 		if (hashvalue == index_Entry->h
 			&&
 			!compareBinaryKeys (index_Entry->key_size,
 								(void *) index_Entry->k, key_size, k)) {
-			shmht_debug (("shmht_search: finded shmht_search!\n"));
-			//Look for the bucket. 
-			//Calcule it as: buckets offset + number * sizeof(complete bucket) 
-			//+ sizeof(bucket structure)
-			retValue = h->bucketmarket +
-				(index_Entry->bucket *
-				 (sizeof (struct bucket) + iht->registry_max_size))
-				+ sizeof (struct bucket);
-			(*returned_size) = index_Entry->bucket_stored_size;
-
-			//Paranoid check ;)
-			struct bucket *target_bucket = h->bucketmarket +
-				(index_Entry->bucket *
-				 (sizeof (struct bucket) + iht->registry_max_size));
-			assert (target_bucket->used == 1
-					|| "Logical Error: found an entry with Empty bucket");
-
+			shmht_debug (("__shmht_find__: finded!\n"));
 			break;
 		}
 
 		//If there is not in the entries... look in colisions :D
-		index_Entry = (index_Entry->next != -1) ?
+		//The readers of shmht_attach_ro walk the chains while they are
+		//written, so the offset and the length are checked.
+		index_Entry = (index_Entry->next < iht->tablelength
+					   && walked <= iht->tablelength) ?
 			h->collisionentries + (index_Entry->next * sizeof (struct entry))
 			: NULL;
 	}
-	read_unlock (iht->semaphore);
-
-	return retValue;
-}								// shmht_search
+	if (chain != NULL)
+		*chain = walked;
+	if (index_Entry != NULL && !entry_in_use (iht, index_Entry))
+		return NULL;
+	return index_Entry;
+}								// __shmht_find__
 
 /*****************************************************************************/
+//Looks for the value of the key, with the hash already mixed, the leases are
+//not values. Must be called from a locked context.
+static struct entry *
+__shmht_lookup__ (struct shmht *h, unsigned int hashvalue, void *k,
+				  size_t key_size)
+{
+	int chain;
+	struct entry *index_Entry =
+		__shmht_find__ (h, hashvalue, k, key_size, &chain);
 
+	stat_max (h, max_chain, chain);
+	if (index_Entry == NULL || (index_Entry->flags & ENTRY_LEASE)) {
+		stat_add (h, misses, 1);
+		shmht_probe3 (lookup, hashvalue, chain, 0);
+		return NULL;
+	}
+	stat_add (h, hits, 1);
+	gds_touch (h, index_Entry);
+	shmht_probe3 (lookup, hashvalue, chain, 1);
 
-/*
-  Since hashtable_remove can be called from a locked context, I've extracted the logic
-  into an internal function, and left only the lock/unlock logic in the hastable_remove
-  function.
-  To call from a locked context, call __shmht_remove__ instead hashtable_remove
- */
-static int
-__shmht_remove__ (struct shmht *h, void *k, size_t key_size)
+	//Paranoid check ;)
+	struct bucket *target_bucket = bucket_at (h, index_Entry->bucket);
+	assert (target_bucket->used == 1
+			|| "Logical Error: found an entry with Empty bucket");
+	return index_Entry;
+}								// __shmht_lookup__
+
+/*****************************************************************************/
+//The searches of the read only handles (shmht_attach_ro) don't lock: they
+//read the entry and the value, and if a writer has had the lock meanwhile
+//they discard them and search again. So they never write to the shared
+//memory, and they never wait for the readers.
+
+//Looks for the contiguous value of the key, as shmht_search.
+static void *
+readonly_search (struct shmht *h, unsigned int hashvalue, void *k,
+				 size_t key_size, size_t * returned_size)
 {
 	struct internal_hashtable *iht = h->internal_ht;
-	struct entry *index_Entry = NULL;
-	struct entry *previous_Entry = NULL;	// previous Entry
-	int retValue = 0;
-	unsigned int hashvalue, index;
-
-	hashvalue = hash (h, k);
-	index = indexFor (iht->tablelength, hash (h, k));
-
-	shmht_debug (("__shmht_remove__: Index for this key: %d\n", index));
-	//Calcule the offset:
-	index_Entry = h->entrypoint + (index * sizeof (struct entry));
-	while (index_Entry != NULL && index_Entry->used) {
-		/* Check hash value to short circuit heavier comparison */
-		if (hashvalue == index_Entry->h
-			&&
-			!compareBinaryKeys (index_Entry->key_size,
-								(void *) index_Entry->k, key_size, k)) {
-			shmht_debug (("__shmht_remove__: finded hashtable_remove!\n"));
+	unsigned long seq;
+	void *value;
+	size_t size = 0;
+
+	do {
+		seq = read_seq_begin (iht);
+		value = NULL;
+		size = 0;
+		//A miss while the table of a dead writer is not recovered.
+		if (seq & 1)
 			break;
+		struct entry *e = __shmht_find__ (h, hashvalue, k, key_size, NULL);
+		if (e == NULL || (e->flags & ENTRY_LEASE))
+			continue;
+		size = e->value_size;
+		if (!(e->flags & ENTRY_COMPRESSED)
+			&& e->bucket_stored_size <= iht->registry_max_size) {
+			value = h->bucketmarket + e->bucket + sizeof (struct bucket);
+			size = e->bucket_stored_size;
 		}
+	} while (read_seq_retry (iht, seq));
 
-		//If there is not in the entries... look in colisions :D
-		previous_Entry = index_Entry;
-		index_Entry = (index_Entry->next != -1) ?
-			h->collisionentries + (index_Entry->next * sizeof (struct entry))
-			: NULL;
-	}
+	stat_add (h, hits, size > 0 || value != NULL);
+	stat_add (h, misses, size == 0 && value == NULL);
+	(*returned_size) = size;
+	return value;
+}								// readonly_search
 
-	//If the key has been found:
-	if (index_Entry != NULL && index_Entry->used) {
-		//First, mark the bucket as not used.
-		struct bucket *target_bucket = h->bucketmarket +
-			(index_Entry->bucket *
-			 (sizeof (struct bucket) + iht->registry_max_size));
-		target_bucket->used = 0;
-		//+1 to the retValue (by default 0)
-		retValue += 1;
-		//Decrease the hash table entry count.
-		iht->entrycount -= 1;
-		if (!previous_Entry) {
-			//The found instance is NOT stored in Colision.
-			//So, we must copy to Entries the first of Colision.
-			if (index_Entry->next != -1) {
-				//Found the copy
-				struct entry *next_Entry =
-					h->collisionentries +
-					(index_Entry->next * sizeof (struct entry));
-				//Direct copy of the context of the next entry into entries.
-				int aux_position = index_Entry->position;
-				(*index_Entry) = (*next_Entry);
-				//Delete the "used" from the entry
-				next_Entry->used = 0;
-				//Set the correct position
-				index_Entry->position = aux_position;
+//Copies the value of the key, as search_copy. The compressed values are
+//copied to compressed (resized to compressed_size), to be decompressed by
+//the caller, and compressed_size is 0 for the other values.
+static int
+readonly_copy (struct shmht *h, unsigned int hashvalue, void *k,
+			   size_t key_size, void *v, size_t * value_size,
+			   void **compressed, int *compressed_size)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned long seq;
+	int ret;
+	size_t size = 0;
+
+	do {
+		seq = read_seq_begin (iht);
+		ret = 0;
+		*compressed_size = 0;
+		if (seq & 1)
+			break;
+		struct entry *e = __shmht_find__ (h, hashvalue, k, key_size, NULL);
+		if (e == NULL || (e->flags & ENTRY_LEASE))
+			continue;
+		unsigned int flags = e->flags;
+		unsigned long bucket = e->bucket;
+		size_t stored = e->bucket_stored_size;
+		size = e->value_size;
+		//The sizes could be of different values, if the entry has changed.
+		if (size > *value_size)
+			ret = -ENOSPC;
+		else if (stored > size)
+			ret = -EIO;
+		else if (flags & ENTRY_COMPRESSED) {
+			void *bigger = realloc (*compressed, stored);
+			if (bigger == NULL)
+				ret = -ENOMEM;
+			else {
+				*compressed = bigger;
+				*compressed_size = stored;
+				value_copy_at (h, bucket, stored, bigger);
+				ret = 1;
 			}
-			else				//There is not colision.
-				index_Entry->used = 0;
 		}
 		else {
-			//The found instance is stored in Colision:
-			previous_Entry->next = index_Entry->next;
-			//Mark the entry as not used.
-			index_Entry->used = 0;
+			value_copy_at (h, bucket, stored, v);
+			ret = 1;
 		}
-	}
-	// Now we're in a consistent state.
+	} while (read_seq_retry (iht, seq));
 
-	return retValue;
-}								// __shmht_remove__
+	stat_add (h, hits, ret != 0);
+	stat_add (h, misses, ret == 0);
+	if (ret != 0)
+		(*value_size) = size;
+	return ret;
+}								// readonly_copy
 
+/*****************************************************************************/
+void *							/* returns the fist value associated with key */
+shmht_search (struct shmht *h, void *k, size_t key_size,
+				  size_t * returned_size)
+{
+	return shmht_search_hashed (h, h->hashfn (k), k, key_size,
+								returned_size);
+}								// shmht_search
 
-/****************************************************************************/
-int
-shmht_remove (struct shmht *h, void *k, size_t key_size)
+/*****************************************************************************/
+void *
+shmht_search_hashed (struct shmht *h, unsigned int hashvalue, void *k,
+					 size_t key_size, size_t * returned_size)
 {
+	table_switch (h);
+	shmht_probe2 (search__entry, k, key_size);
+	hashvalue = hash_mix (hashvalue);
+	(*returned_size) = 0;
+	//The copies of the near cache don't need the lock.
+	struct near_slot *slot;
+	if (h->near != NULL
+		&& (slot = near_lookup (h, hashvalue, k, key_size)) != NULL) {
+		(*returned_size) = slot->value_size;
+		shmht_probe3 (search__return, k, key_size, 1);
+		return slot->data + slot->key_size;
+	}
+	//The misses of the filter don't need the lock.
+	if (!filter_may_contain (h, hashvalue)) {
+		shmht_probe3 (search__return, k, key_size, 0);
+		return NULL;
+	}
+	if (h->readonly) {
+		void *value = readonly_search (h, hashvalue, k, key_size,
+									   returned_size);
+		shmht_probe3 (search__return, k, key_size, value != NULL);
+		return value;
+	}
+	if (ht_read_lock (h, SHMHT_OP_SEARCH) < 0) {
+		shmht_probe3 (search__return, k, key_size, -ECANCELED);
+		return NULL;
+	}
 	struct internal_hashtable *iht = h->internal_ht;
-	if (write_lock (iht->semaphore) < 0)
-		return -ECANCELED;
-	int retValue = __shmht_remove__ (h, k, key_size);
-	write_unlock (iht->semaphore);
+	void *retValue = NULL;
+	struct entry *index_Entry = __shmht_lookup__ (h, hashvalue, k, key_size);
+
+	//The chained values are not contiguous, they can only be copied, as the
+	//compressed ones: only their size is returned.
+	if (index_Entry != NULL)
+		(*returned_size) = index_Entry->value_size;
+	if (index_Entry != NULL
+		&& index_Entry->bucket_stored_size <= iht->registry_max_size
+		&& !(index_Entry->flags & ENTRY_COMPRESSED)) {
+		//Look for the bucket. 
+		//Calcule it as: buckets offset + offset of the bucket
+		//+ sizeof(bucket structure)
+		retValue = h->bucketmarket + index_Entry->bucket
+			+ sizeof (struct bucket);
+		(*returned_size) = index_Entry->bucket_stored_size;
+		if (h->near != NULL)
+			near_store (h, hashvalue, k, key_size, retValue,
+						*returned_size, *near_version (h, hashvalue));
+	}
+	ht_read_unlock (h);
+
+	shmht_probe3 (search__return, k, key_size, retValue != NULL);
 	return retValue;
-}								// hashtable_remove
+}								// shmht_search_hashed
 
 /*****************************************************************************/
+int
+shmht_search_batch (struct shmht *h, unsigned int n, void **keys,
+					size_t * key_sizes,
+					void (*found) (void *arg, unsigned int i, void *value,
+								   size_t value_size), void *arg)
+{
+	table_switch (h);
+	struct internal_hashtable *iht;
+	//The hashes, and after them the keys to search.
+	unsigned int *hashes = malloc (n * (sizeof (unsigned int) + 1));
+	unsigned char *search = (unsigned char *) (hashes + n);
+	void *copy = NULL, *value = NULL;
+	unsigned int i;
+	int hits = 0;
+
+	if (hashes == NULL)
+		return -ENOMEM;
+	//The hashes, and the misses of the filter, out of the lock.
+	for (i = 0; i < n; i++) {
+		search[i] = 0;
+		if (keys[i] == NULL)
+			continue;
+		hashes[i] = hash_mix (h->hashfn (keys[i]));
+		search[i] = filter_may_contain (h, hashes[i]);
+	}
+
+	//The read only handles copy each value without lock, and call found
+	//with the copy.
+	if (h->readonly) {
+		void *compressed = NULL;
+		size_t copy_size = 0, size;
+		int compressed_size, ret;
+		for (i = 0; i < n; i++) {
+			if (!search[i])
+				continue;
+			size = copy_size;
+			ret = readonly_copy (h, hashes[i], keys[i], key_sizes[i], copy,
+								 &size, &compressed, &compressed_size);
+			if (ret == -ENOSPC && (value = realloc (copy, size)) != NULL) {
+				copy = value;
+				copy_size = size;
+				ret = readonly_copy (h, hashes[i], keys[i], key_sizes[i],
+									 copy, &size, &compressed,
+									 &compressed_size);
+			}
+			if (ret <= 0 || (compressed_size > 0
+							 && shmht_lz_decompress (compressed,
+													 compressed_size, copy,
+													 size) != size))
+				continue;
+			found (arg, i, copy, size);
+			hits++;
+		}
+		free (compressed);
+		free (copy);
+		free (hashes);
+		return hits;
+	}
+
+	if (ht_read_lock (h, SHMHT_OP_SEARCH) < 0) {
+		free (hashes);
+		return -ECANCELED;
+	}
+	iht = h->internal_ht;
+	for (i = 0; i < n; i++) {
+		if (!search[i])
+			continue;
+		struct entry *e = __shmht_lookup__ (h, hashes[i], keys[i],
+											key_sizes[i]);
+		if (e == NULL)
+			continue;
+		if (e->bucket_stored_size <= iht->registry_max_size
+			&& !(e->flags & ENTRY_COMPRESSED))
+			value = h->bucketmarket + e->bucket + sizeof (struct bucket);
+		else {
+			//The chained and compressed values are copied first.
+			size_t size = e->value_size > e->bucket_stored_size ?
+				e->value_size : e->bucket_stored_size;
+			void *bigger = realloc (copy, size + e->bucket_stored_size);
+			if (bigger == NULL)
+				continue;
+			copy = bigger;
+			value_copy (h, e, copy + size);
+			value = copy + size;
+			if ((e->flags & ENTRY_COMPRESSED)
+				&& shmht_lz_decompress (value, e->bucket_stored_size, copy,
+										e->value_size) != e->value_size)
+				continue;
+			if (e->flags & ENTRY_COMPRESSED)
+				value = copy;
+		}
+		found (arg, i, value, e->value_size);
+		hits++;
+	}
+	ht_read_unlock (h);
+
+	free (copy);
+	free (hashes);
+	return hits;
+}								// shmht_search_batch
 
+/*****************************************************************************/
 int
-shmht_flush (struct shmht *h)
+shmht_search_copy (struct shmht *h, void *k, size_t key_size,
+				   void *v, size_t * value_size)
+{
+	return shmht_search_copy_hashed (h, h->hashfn (k), k, key_size, v,
+									 value_size);
+}								// shmht_search_copy
+
+/*****************************************************************************/
+//Copies the value of the key, waiting for the lock until the timeout.
+static int
+search_copy (struct shmht *h, unsigned int hashvalue, void *k,
+			 size_t key_size, void *v, size_t * value_size,
+			 const struct timespec *timeout)
+{
+	table_switch (h);
+	shmht_probe2 (search__entry, k, key_size);
+	hashvalue = hash_mix (hashvalue);
+	//The copies of the near cache don't need the lock.
+	struct near_slot *slot;
+	if (h->near != NULL
+		&& (slot = near_lookup (h, hashvalue, k, key_size)) != NULL) {
+		int found = slot->value_size > *value_size ? -ENOSPC : 1;
+		if (found > 0)
+			memcpy (v, slot->data + slot->key_size, slot->value_size);
+		(*value_size) = slot->value_size;
+		shmht_probe3 (search__return, k, key_size, found);
+		return found;
+	}
+	//The misses of the filter don't need the lock.
+	if (!filter_may_contain (h, hashvalue)) {
+		shmht_probe3 (search__return, k, key_size, 0);
+		return 0;
+	}
+	void *compressed = NULL;
+	int compressed_size = 0;
+	unsigned int version =
+		__atomic_load_n (near_version (h, hashvalue), __ATOMIC_ACQUIRE);
+	int retValue;
+	if (h->readonly) {
+		retValue = readonly_copy (h, hashvalue, k, key_size, v, value_size,
+								  &compressed, &compressed_size);
+		goto copied;
+	}
+	retValue = ht_lock_timed (h, SHMHT_OP_SEARCH, 0, timeout);
+	if (retValue < 0) {
+		retValue = retValue == -EAGAIN ? -EAGAIN : -ECANCELED;
+		shmht_probe3 (search__return, k, key_size, retValue);
+		return retValue;
+	}
+	struct entry *index_Entry = __shmht_lookup__ (h, hashvalue, k, key_size);
+
+	if (index_Entry != NULL) {
+		if (index_Entry->value_size > *value_size)
+			retValue = -ENOSPC;
+		else if (index_Entry->flags & ENTRY_COMPRESSED) {
+			//Copy the compressed value, it's decompressed out of the lock.
+			compressed_size = index_Entry->bucket_stored_size;
+			compressed = malloc (compressed_size);
+			if (compressed != NULL) {
+				value_copy (h, index_Entry, compressed);
+				retValue = 1;
+			}
+			else
+				retValue = -ENOMEM;
+		}
+		else {
+			value_copy (h, index_Entry, v);
+			retValue = 1;
+		}
+		(*value_size) = index_Entry->value_size;
+	}
+	ht_read_unlock (h);
+
+  copied:
+	if (retValue > 0 && compressed_size > 0
+		&& shmht_lz_decompress (compressed, compressed_size, v,
+								*value_size) != *value_size)
+		retValue = -EIO;
+	free (compressed);
+	if (retValue > 0 && h->near != NULL)
+		near_store (h, hashvalue, k, key_size, v, *value_size, version);
+
+	shmht_probe3 (search__return, k, key_size, retValue);
+	return retValue;
+}								// search_copy
+
+/*****************************************************************************/
+int
+shmht_search_copy_hashed (struct shmht *h, unsigned int hashvalue, void *k,
+						  size_t key_size, void *v, size_t * value_size)
+{
+	return search_copy (h, hashvalue, k, key_size, v, value_size, NULL);
+}								// shmht_search_copy_hashed
+
+/*****************************************************************************/
+int
+shmht_try_search (struct shmht *h, void *k, size_t key_size, void *v,
+				  size_t * value_size)
+{
+	return search_copy (h, h->hashfn (k), k, key_size, v, value_size,
+						&no_wait);
+}								// shmht_try_search
+
+/*****************************************************************************/
+int
+shmht_timed_search (struct shmht *h, void *k, size_t key_size, void *v,
+					size_t * value_size, const struct timespec *deadline)
 {
+	struct timespec timeout;
+	timeout_to (deadline, &timeout);
+	return search_copy (h, h->hashfn (k), k, key_size, v, value_size,
+						&timeout);
+}								// shmht_timed_search
+
+/*****************************************************************************/
+
 
+/*
+  Since hashtable_remove can be called from a locked context, I've extracted the logic
+  into an internal function, and left only the lock/unlock logic in the hastable_remove
+  function.
+  To call from a locked context, call __shmht_remove__ instead hashtable_remove
+  (with the hash already mixed).
+ */
+static int
+__shmht_remove__ (struct shmht *h, unsigned int hashvalue, void *k,
+				  size_t key_size)
+{
 	struct internal_hashtable *iht = h->internal_ht;
-	if (write_lock (iht->semaphore) < 0)
-		return -ECANCELED;
-	int i;
-	//First, clear all the buckets:
-	for (i = 0; i < iht->tablelength; i++) {
-		struct bucket *target_bucket = h->bucketmarket +
-			(i * (sizeof (struct bucket) + iht->registry_max_size));
-		target_bucket->used = 0;
+	struct entry *index_Entry = NULL;
+	struct entry *previous_Entry = NULL;	// previous Entry
+	int retValue = 0;
+	int chain = 0;
+	unsigned int index;
+
+	shmht_probe2 (remove__entry, k, key_size);
+	index = indexFor (iht->tablelength, hashvalue);
+
+	shmht_debug (("__shmht_remove__: Index for this key: %d\n", index));
+	//Calcule the offset:
+	index_Entry = h->entrypoint + (index * sizeof (struct entry));
+	while (index_Entry != NULL && entry_in_use (iht, index_Entry)) {
+		chain++;
+		/* Check hash value to short circuit heavier comparison */
+		if (hashvalue == index_Entry->h
+			&&
+			!compareBinaryKeys (index_Entry->key_size,
+								(void *) index_Entry->k, key_size, k)) {
+			shmht_debug (("__shmht_remove__: finded hashtable_remove!\n"));
+			break;
+		}
+
+		//If there is not in the entries... look in colisions :D
+		previous_Entry = index_Entry;
+		index_Entry = (index_Entry->next != -1) ?
+			h->collisionentries + (index_Entry->next * sizeof (struct entry))
+			: NULL;
 	}
 
-	struct entry *target_entry;
-	//Second, clear all the entries:
-	for (i = 0; i < iht->tablelength; i++) {
-		target_entry = h->entrypoint + (i * sizeof (struct entry));
-		target_entry->used = 0;
+	//If the key has been found:
+	if (index_Entry != NULL && entry_in_use (iht, index_Entry)) {
+		//From here, if the process dies the remove is completed.
+		iht->intent.slot = index;
+		iht->intent.target = entry_id (h, index_Entry);
+		iht->intent.previous = previous_Entry ?
+			entry_id (h, previous_Entry) : 0;
+		iht->intent.moved = previous_Entry ? -1 : index_Entry->next;
+		iht->intent.bucket = entry_bucket (index_Entry);
+		iht->intent.tag = index_Entry->tag;
+		if (!previous_Entry && index_Entry->next != -1) {
+			//And the one of the colision that is moved to the slot.
+			struct entry *moved = h->collisionentries +
+				(index_Entry->next * sizeof (struct entry));
+			iht->intent.tag |= moved->tag;
+		}
+		iht->intent.hash = hashvalue;
+		iht->intent.entrycount = iht->entrycount;
+		intent_begin (iht, INTENT_REMOVE);
+		//First, return the buckets to the slab.
+		value_free (h, entry_bucket (index_Entry));
+		//+1 to the retValue (by default 0)
+		retValue += 1;
+		//Decrease the hash table entry count.
+		iht->entrycount -= 1;
+		filter_del (h, hashvalue);
+		near_invalidate (h, hashvalue);
+		//The processes waiting for the lease look for the key again.
+		if (index_Entry->flags & ENTRY_LEASE) {
+			iht->leases--;
+			if (index_Entry->flags & ENTRY_LEASE_WAITERS)
+				lease_wake (h, hashvalue);
+		}
+		tag_unlink (h, index_Entry);
+		gds_del (h, index_Entry);
+		if (!previous_Entry) {
+			//The found instance is NOT stored in Colision.
+			//So, we must copy to Entries the first of Colision.
+			if (index_Entry->next != -1) {
+				//Found the copy
+				struct entry *next_Entry =
+					h->collisionentries +
+					(index_Entry->next * sizeof (struct entry));
+				//Direct copy of the context of the next entry into entries.
+				int aux_position = index_Entry->position;
+				(*index_Entry) = (*next_Entry);
+				//Delete the "used" from the entry
+				next_Entry->used = 0;
+				//Set the correct position
+				index_Entry->position = aux_position;
+				tag_moved (h, index_Entry);
+				gds_moved (h, index_Entry);
+			}
+			else				//There is not colision.
+				index_Entry->used = 0;
+		}
+		else {
+			//The found instance is stored in Colision:
+			previous_Entry->next = index_Entry->next;
+			//Mark the entry as not used.
+			index_Entry->used = 0;
+		}
+		intent_end (iht);
 	}
+	// Now we're in a consistent state.
 
-	//Last, clear all the colisions.
-	for (i = 0; i < iht->tablelength; i++) {
-		target_entry = h->collisionentries + (i * sizeof (struct entry));
-		target_entry->used = 0;
+	shmht_probe3 (remove__return, hashvalue, chain, retValue);
+	return retValue;
+}								// __shmht_remove__
+
+
+/****************************************************************************/
+int
+shmht_remove (struct shmht *h, void *k, size_t key_size)
+{
+	return shmht_remove_hashed (h, h->hashfn (k), k, key_size);
+}								// hashtable_remove
+
+/****************************************************************************/
+//Removes the key, waiting for the lock until the timeout.
+static int
+remove_key (struct shmht *h, unsigned int hashvalue, void *k,
+			size_t key_size, const struct timespec *timeout)
+{
+	table_switch (h);
+	int retValue = ht_lock_timed (h, SHMHT_OP_REMOVE, 1, timeout);
+	if (retValue < 0)
+		return retValue == -EAGAIN || retValue == -EROFS ? retValue
+			: -ECANCELED;
+	retValue = __shmht_remove__ (h, hash_mix (hashvalue), k, key_size);
+	if (retValue > 0)
+		changelog_add (h, SHMHT_CHANGE_REMOVE, k, key_size, NULL, 0, 0, 0);
+	ht_write_unlock (h);
+	stat_add (h, removes, retValue);
+	return retValue;
+}								// remove_key
+
+/****************************************************************************/
+int
+shmht_remove_hashed (struct shmht *h, unsigned int hashvalue, void *k,
+					 size_t key_size)
+{
+	return remove_key (h, hashvalue, k, key_size, NULL);
+}								// shmht_remove_hashed
+
+/****************************************************************************/
+int
+shmht_try_remove (struct shmht *h, void *k, size_t key_size)
+{
+	return remove_key (h, h->hashfn (k), k, key_size, &no_wait);
+}								// shmht_try_remove
+
+/****************************************************************************/
+int
+shmht_timed_remove (struct shmht *h, void *k, size_t key_size,
+					const struct timespec *deadline)
+{
+	struct timespec timeout;
+	timeout_to (deadline, &timeout);
+	return remove_key (h, h->hashfn (k), k, key_size, &timeout);
+}								// shmht_timed_remove
+
+/****************************************************************************/
+//Removes up to max entries of the tag, walking the list of its head of the
+//tag index. Must be called from a locked context. Returns the number of
+//removed entries.
+static int
+__shmht_invalidate_tag__ (struct shmht *h, unsigned int tag, int max)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	char key[MAX_KEY_SIZE];
+	unsigned int id = tag_head (h, tag)->first;
+	int removed = 0;
+
+	while (id && removed < max) {
+		struct entry *e = entry_of_id (h, id);
+		unsigned int next = e->tag_next;
+		if (e->tag != tag) {
+			id = next;
+			continue;
+		}
+		//__shmht_remove__ moves the first colision of a slot to the removed
+		//entry, then the next one could be there.
+		unsigned int moved = id <= iht->tablelength && e->next != -1 ?
+			1 + iht->tablelength + e->next : 0;
+		size_t key_size = e->key_size;
+		memcpy (key, e->k, key_size);
+		if (__shmht_remove__ (h, e->h, key, key_size) > 0) {
+			changelog_add (h, SHMHT_CHANGE_REMOVE, key, key_size, NULL, 0, 0,
+						   0);
+			removed++;
+		}
+		id = next && next == moved ? id : next;
 	}
-	iht->entrycount = 0;
-	write_unlock (iht->semaphore);
-	return 0;
+	return removed;
+}								// __shmht_invalidate_tag__
 
-}								// shmht_flush
+/****************************************************************************/
+int
+shmht_invalidate_tag (struct shmht *h, unsigned int tag)
+{
+	int removed = 0, stripe;
+
+	if (tag == 0)
+		return -EINVAL;
+	table_switch (h);
+	//In stripes, so the other processes get the lock between them.
+	do {
+		int ret = ht_lock_timed (h, SHMHT_OP_REMOVE, 1, NULL);
+		if (ret < 0)
+			return ret == -EROFS ? ret : -ECANCELED;
+		stripe = __shmht_invalidate_tag__ (h, tag, TAG_STRIPE);
+		ht_write_unlock (h);
+		removed += stripe;
+	} while (stripe == TAG_STRIPE);
+	stat_add (h, removes, removed);
+	return removed;
+}								// shmht_invalidate_tag
 
 /****************************************************************************/
+unsigned long
+shmht_changelog_cursor (struct shmht *h)
+{
+	table_switch (h);
+	if (h->changelog == NULL)
+		return 0;
+	return __atomic_load_n (&h->changelog->committed, __ATOMIC_ACQUIRE);
+}								// shmht_changelog_cursor
 
+/****************************************************************************/
 int
-shmht_remove_older_entries (struct shmht *h, int p)
+shmht_changelog_read (struct shmht *h, unsigned long *cursor,
+					  struct shmht_change *change, void *buf,
+					  size_t buf_size)
 {
-	//Define a local aux structure ;D
-	struct finder_aux_struct
-	{
-		long sec;
-		int is_in_col;
-		int index;
-	};
-	//Define a local function.
-	void insert_older_if_necessary (struct entry *e,
-									struct finder_aux_struct *into,
-									unsigned int size_of_into, int is_in_col)
-	{
-
-		int i;
-		//Var that points to the place to replace.
-		struct finder_aux_struct *aux = NULL;
-		for (i = 0; i < size_of_into; i++){
-		  //x		  printf ("Comparison => entry: %ld, struct: %ld \n", e->sec, into[i].sec);
-			if (e->sec < into[i].sec) {
-				//If it's -1, it's not initiated, stop.
-				aux = &into[i];
-				break;
-			}
+	table_switch (h);
+	struct changelog *log = h->changelog;
+	struct changelog_record r;
+	void *stored = NULL;
+
+	if (log == NULL)
+		return -EINVAL;
+
+	for (;;) {
+		unsigned long pos = *cursor;
+		unsigned long committed =
+			__atomic_load_n (&log->committed, __ATOMIC_ACQUIRE);
+		if (pos == committed)
+			return 0;
+		if (pos > committed)
+			goto overflow;
+
+		memcpy (&r, changelog_at (log, pos), sizeof (r));
+		__atomic_thread_fence (__ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&log->reserved, __ATOMIC_RELAXED) - pos >
+			log->size)
+			goto overflow;
+		if (r.op == CHANGELOG_PAD) {
+			*cursor = pos + r.length;
+			continue;
 		}
 
-		if (aux != NULL) {
-			//In aux, we have the element to replace.
-			shmht_debug (("insert_older_if_necessary: Inserted Entry : secs %ld, is_in_col: %d, position: %d \n"
-						  , e->sec, is_in_col, e->position));
-			aux->sec = e->sec;
-			aux->is_in_col = is_in_col;
-			aux->index = e->position;
+		//The key, and then the value.
+		int compressed = (r.flags & ENTRY_COMPRESSED)
+			&& !(r.flags & CHANGELOG_NO_VALUE);
+		size_t value_size = (r.flags & CHANGELOG_NO_VALUE) ? 0 : r.value_size;
+		if (r.key_size + value_size > buf_size)
+			return -ENOSPC;
+		memcpy (buf, changelog_at (log, pos) + 1, r.key_size);
+		if (compressed) {
+			stored = realloc (stored, r.stored_size);
+			if (stored == NULL)
+				return -ENOMEM;
+			memcpy (stored, (void *) (changelog_at (log, pos) + 1) +
+					r.key_size, r.stored_size);
+		}
+		else
+			memcpy (buf + r.key_size, (void *) (changelog_at (log, pos) + 1)
+					+ r.key_size, r.stored_size);
+		__atomic_thread_fence (__ATOMIC_SEQ_CST);
+		if (__atomic_load_n (&log->reserved, __ATOMIC_RELAXED) - pos >
+			log->size)
+			goto overflow;
+
+		if (compressed) {
+			int size = shmht_lz_decompress (stored, r.stored_size,
+											buf + r.key_size, value_size);
+			free (stored);
+			if (size != (int) value_size)
+				return -EIO;
 		}
-	}							// insert_older_if_necessary
+		change->seq = r.seq;
+		change->op = r.op;
+		change->key = buf;
+		change->key_size = r.key_size;
+		change->value = (r.flags & CHANGELOG_NO_VALUE) ? NULL
+			: buf + r.key_size;
+		change->value_size = r.value_size;
+		*cursor = pos + r.length;
+		return 1;
+	}
 
+  overflow:
+	//The records from the cursor have been overwritten, continue from the
+	//oldest one.
+	free (stored);
+	*cursor = __atomic_load_n (&log->tail, __ATOMIC_RELAXED);
+	return -EOVERFLOW;
+}								// shmht_changelog_read
 
+/****************************************************************************/
+int
+shmht_get_or_lock (struct shmht *h, void *k, size_t key_size, void *v,
+				   size_t * value_size, int lease_ms, int wait_ms)
+{
+	unsigned int hashvalue = h->hashfn (k);
+	unsigned int key_hash = hash_mix (hashvalue);
+	long wait_end = now_ms () + wait_ms;
+
+	for (;;) {
+		//Most of the times the value is there.
+		int retValue = search_copy (h, hashvalue, k, key_size, v, value_size,
+									NULL);
+		if (retValue != 0)
+			return retValue;
+
+		int ret = ht_lock_timed (h, SHMHT_OP_INSERT, 1, NULL);
+		if (ret < 0)
+			return ret == -EROFS ? ret : -ECANCELED;
+		struct entry *e = __shmht_find__ (h, key_hash, k, key_size, NULL);
+		long now = now_ms ();
+		if (e == NULL) {
+			//The first one takes the lease. Its sec is the one of the
+			//entries, for the eviction and the tools.
+			struct timeval tv;
+			gettimeofday (&tv, NULL);
+			retValue = __shmht_insert__ (h, key_hash, k, key_size, NULL, 0, 0,
+										 ENTRY_LEASE, tv.tv_sec, 0, 1);
+			if (retValue > 0)
+				__shmht_find__ (h, key_hash, k, key_size, NULL)->bucket =
+					now + lease_ms;
+			ht_write_unlock (h);
+			return retValue > 0 ? 0 : retValue;
+		}
+		if (!(e->flags & ENTRY_LEASE)) {
+			//Inserted after the search, read it.
+			ht_write_unlock (h);
+			continue;
+		}
+		long lease_end = e->bucket;
+		if (lease_end <= now) {
+			//The lease has expired, the owner could be dead.
+			e->bucket = now + lease_ms;
+			ht_write_unlock (h);
+			return 0;
+		}
+		if (now >= wait_end) {
+			ht_write_unlock (h);
+			return -EAGAIN;
+		}
+		//Wait until the lease is released (or expires).
+		e->flags |= ENTRY_LEASE_WAITERS;
+		unsigned int seen = *near_version (h, key_hash);
+		long ms = (lease_end < wait_end ? lease_end : wait_end) - now;
+		ht_write_unlock (h);
+		lease_wait (h, key_hash, seen, ms);
+	}
+}								// shmht_get_or_lock
 
-	//Check before lock:
-	if (p > 100)
-		return -EINVAL;
+/*****************************************************************************/
+
+//The maintenance operations split the slots of the table (of the entries
+//and of the colisions) between the threads of the process (see
+//shmht_maintenance_threads), with the lock held by the caller. Each part has
+//its own state, and the caller reduces them after.
+struct scan_part
+{
+	struct shmht *h;
+	unsigned int first;
+	unsigned int last;
+	void (*fn) (struct scan_part * part);
+	void *arg;
+};
 
+static void *
+scan_thread (void *arg)
+{
+	struct scan_part *part = arg;
+	part->fn (part);
+	return NULL;
+}								// scan_thread
+
+//Calls fn for the h->threads parts, the first one in this thread. A part
+//whose thread can't be created runs here too.
+static void
+scan_parallel (struct shmht *h, struct scan_part *parts,
+			   void (*fn) (struct scan_part * part))
+{
 	struct internal_hashtable *iht = h->internal_ht;
-	if (write_lock (iht->semaphore) < 0)
+	pthread_t tids[MAINTENANCE_MAX_THREADS];
+	int started[MAINTENANCE_MAX_THREADS];
+	unsigned int t, n = h->threads;
+
+	for (t = 0; t < n; t++) {
+		parts[t].h = h;
+		parts[t].first = (unsigned long) iht->tablelength * t / n;
+		parts[t].last = (unsigned long) iht->tablelength * (t + 1) / n;
+		parts[t].fn = fn;
+	}
+	for (t = 1; t < n; t++) {
+		started[t] = !pthread_create (&tids[t], NULL, scan_thread, &parts[t]);
+		if (!started[t])
+			fn (&parts[t]);
+	}
+	fn (&parts[0]);
+	for (t = 1; t < n; t++)
+		if (started[t])
+			pthread_join (tids[t], NULL);
+}								// scan_parallel
+
+//The entry i of the part, with the next ones prefetched: the used flag is at
+//the start and the generation at the end of the entries.
+static inline struct entry *
+scan_entry (void *entries, unsigned int i, unsigned int last)
+{
+	if (i + SCAN_PREFETCH < last) {
+		struct entry *ahead =
+			entries + ((i + SCAN_PREFETCH) * sizeof (struct entry));
+		__builtin_prefetch (&ahead->used, 1);
+		__builtin_prefetch (&ahead->generation, 1);
+	}
+	return entries + (i * sizeof (struct entry));
+}								// scan_entry
+
+/*****************************************************************************/
+
+static void
+clear_part (struct scan_part *part)
+{
+	struct shmht *h = part->h;
+	unsigned int i;
+
+	for (i = part->first; i < part->last; i++) {
+		scan_entry (h->entrypoint, i, part->last)->used = 0;
+		scan_entry (h->collisionentries, i, part->last)->used = 0;
+	}
+}								// clear_part
+
+//Clears the used flag of all the entries and colisions.
+static void
+__shmht_clear_all__ (struct shmht *h)
+{
+	struct scan_part parts[MAINTENANCE_MAX_THREADS];
+	scan_parallel (h, parts, clear_part);
+}								// __shmht_clear_all__
+
+/*****************************************************************************/
+
+//The buckets freed by a part, in a list for each size class, that are
+//linked to the free lists of the pool after.
+struct free_lists
+{
+	unsigned long head[SLAB_MAX_CLASSES];
+	unsigned long tail[SLAB_MAX_CLASSES];
+	unsigned long count[SLAB_MAX_CLASSES];
+};
+
+//Frees the chunks of the value at offset to the lists of the part, or to the
+//pool without lists.
+static void
+free_value_part (struct shmht *h, struct free_lists *lists,
+				 unsigned long offset)
+{
+	struct slab_pool *pool = h->slab;
+
+	while (offset != SLAB_NONE && bucket_at (h, offset)->used) {
+		struct bucket *chunk = bucket_at (h, offset);
+		unsigned long next = chunk->next;
+		int c = chunk->slab_class;
+		chunk->used = 0;
+		if (lists == NULL) {
+			chunk->next = pool->classes[c].free;
+			pool->classes[c].free = offset;
+			pool->classes[c].used--;
+			offset = next;
+			continue;
+		}
+		chunk->next = lists->head[c];
+		if (lists->head[c] == SLAB_NONE)
+			lists->tail[c] = offset;
+		lists->head[c] = offset;
+		lists->count[c]++;
+		offset = next;
+	}
+}								// free_value_part
+
+static void
+free_values_part (struct scan_part *part)
+{
+	struct shmht *h = part->h;
+	struct internal_hashtable *iht = h->internal_ht;
+	struct free_lists *lists = part->arg;
+	unsigned int i;
+
+	for (i = part->first; i < part->last; i++) {
+		struct entry *e = scan_entry (h->entrypoint, i, part->last);
+		if (entry_in_use (iht, e))
+			free_value_part (h, lists, entry_bucket (e));
+		e = scan_entry (h->collisionentries, i, part->last);
+		if (entry_in_use (iht, e))
+			free_value_part (h, lists, entry_bucket (e));
+	}
+}								// free_values_part
+
+//Returns the buckets of all the entries to the pool.
+//Must be called from a locked context.
+static void
+__shmht_free_values__ (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct slab_pool *pool = h->slab;
+	struct scan_part parts[MAINTENANCE_MAX_THREADS];
+	struct free_lists *lists = NULL;
+	unsigned int t, c;
+
+	//The lists of the threads are too big for the stack. Without them (one
+	//thread, or no memory, as in a recovery) the scan frees to the pool.
+	if (h->threads > 1)
+		lists = malloc (h->threads * sizeof (struct free_lists));
+	if (lists == NULL) {
+		parts[0].h = h;
+		parts[0].first = 0;
+		parts[0].last = iht->tablelength;
+		parts[0].arg = NULL;
+		pool_lock (h);
+		free_values_part (&parts[0]);
+		pool_unlock (h);
+		return;
+	}
+	for (t = 0; t < h->threads; t++) {
+		for (c = 0; c < SLAB_MAX_CLASSES; c++) {
+			lists[t].head[c] = lists[t].tail[c] = SLAB_NONE;
+			lists[t].count[c] = 0;
+		}
+		parts[t].arg = &lists[t];
+	}
+	pool_lock (h);
+	scan_parallel (h, parts, free_values_part);
+	for (t = 0; t < h->threads; t++)
+		for (c = 0; c < pool->nclasses; c++) {
+			if (lists[t].count[c] == 0)
+				continue;
+			bucket_at (h, lists[t].tail[c])->next = pool->classes[c].free;
+			pool->classes[c].free = lists[t].head[c];
+			pool->classes[c].used -= lists[t].count[c];
+		}
+	pool_unlock (h);
+	free (lists);
+}								// __shmht_free_values__
+
+/*****************************************************************************/
+
+//Flushes the generation, from a locked context. The recovery can call it
+//again for the same generation.
+static void
+__shmht_flush__ (struct shmht *h, unsigned int generation)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+
+	//A new generation makes all the entries stale, so they are free for the
+	//inserts without touching them. And all the buckets are free again, but
+	//in a container only the ones of this table.
+	if (h->pool_semaphore >= 0)
+		__shmht_free_values__ (h);
+	else
+		slab_reset (h->slab);
+	iht->generation = generation + 1;
+	changelog_add (h, SHMHT_CHANGE_FLUSH, NULL, 0, NULL, 0, 0, 0);
+	//All the keys are gone.
+	memset (h->filter, 0, iht->filter_size);
+	near_invalidate_all (h);
+	//And the leases, wake all the processes that could wait for them.
+	if (iht->leases > 0) {
+		unsigned int i;
+		for (i = 0; i < NEAR_STRIPES; i++)
+			lease_wake (h, i);
+		iht->leases = 0;
+	}
+	//Only when the counter wraps around an old entry could look valid
+	//again, so clear all the used flags once in 2^32 flushes.
+	if (iht->generation == 0) {
+		__shmht_clear_all__ (h);
+		memset (h->tags, 0, sizeof (struct tag_head) * iht->tablelength);
+	}
+	iht->entrycount = 0;
+	iht->heap_size = 0;
+}								// __shmht_flush__
+
+int
+shmht_flush (struct shmht *h)
+{
+	table_switch (h);
+
+	struct internal_hashtable *iht;
+	shmht_probe0 (flush__entry);
+	if (ht_write_lock (h, SHMHT_OP_FLUSH) < 0) {
+		iht = h->internal_ht;
+		shmht_probe2 (flush__return, iht->generation, -ECANCELED);
 		return -ECANCELED;
+	}
+	iht = h->internal_ht;
+	iht->intent.generation = iht->generation;
+	intent_begin (iht, INTENT_FLUSH);
+	__shmht_flush__ (h, iht->generation);
+	intent_end (iht);
+	shmht_probe2 (flush__return, iht->generation, 0);
+	ht_write_unlock (h);
+	return 0;
 
-	//Start the stuff
-	int retValue = 0;
-	//Calcule the number of entries to delete:
-	int deleteEntries = iht->tablelength * p / 100;
+}								// shmht_flush
 
-	shmht_debug (("shmht_remove_older_entries: Number of entries to Delete: %d\n", deleteEntries));
+/****************************************************************************/
 
-	struct finder_aux_struct older_storage[deleteEntries];
+//Moves a value stored in one bucket to the first free bucket of its class if
+//it's before the current one. Returns 1 if it has been moved.
+static int
+compact_value (struct shmht *h, struct entry *e)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct slab_pool *pool = h->slab;
+
+	//The chained values are not moved, and the leases have not value.
+	if (e->bucket_stored_size > iht->registry_max_size
+		|| (e->flags & ENTRY_LEASE))
+		return 0;
+
+	struct bucket *chunk = bucket_at (h, e->bucket);
+	struct slab_class *class = &pool->classes[chunk->slab_class];
+	pool_lock (h);
+	if (class->free == SLAB_NONE || class->free > e->bucket) {
+		pool_unlock (h);
+		return 0;
+	}
 
-	int i;
-	//Init the struct:
-	for (i = 0; i < deleteEntries; i++) {
-		older_storage[i].sec = LONG_MAX;
-		older_storage[i].is_in_col = -1;
-		older_storage[i].index = -1;
+	//The free bucket is of the same class, so slab_alloc takes it.
+	unsigned long offset = slab_alloc (h, e->bucket_stored_size);
+	memcpy (h->bucketmarket + offset + sizeof (struct bucket),
+			h->bucketmarket + e->bucket + sizeof (struct bucket),
+			e->bucket_stored_size);
+	//The entry takes the copy before the old bucket is freed, so a process
+	//that dies here only loses a bucket.
+	unsigned long old = e->bucket;
+	e->bucket = offset;
+	intent_barrier ();
+	slab_free (h, old);
+	pool_unlock (h);
+	return 1;
+}								// compact_value
+
+/****************************************************************************/
+
+//Compacts the chains of the entries from first to last: their colision
+//entries are moved to the first free colision entries (from free_hint, that
+//is updated), so the chains are packed and contiguous, and their values to
+//the first free buckets.
+//Must be called from a locked context. Returns the number of moves.
+static int
+__shmht_compact_stripe__ (struct shmht *h, unsigned int first,
+						  unsigned int last, unsigned int *free_hint)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	int moved = 0;
+	unsigned int i;
+
+	for (i = first; i < last && i < iht->tablelength; i++) {
+		struct entry *previous = h->entrypoint + (i * sizeof (struct entry));
+		if (!entry_in_use (iht, previous))
+			continue;
+		iht->intent.slot = i;
+		iht->intent.target = 0;
+		iht->intent.moved = -1;
+		intent_barrier ();
+		moved += compact_value (h, previous);
+
+		while (previous->next != -1) {
+			struct entry *e =
+				h->collisionentries + (previous->next * sizeof (struct entry));
+			//Look for the first free colision entry.
+			while (*free_hint < iht->tablelength
+				   && entry_in_use (iht,
+									h->collisionentries +
+									(*free_hint * sizeof (struct entry))))
+				(*free_hint)++;
+
+			if (*free_hint < previous->next) {
+				struct entry *target = h->collisionentries +
+					(*free_hint * sizeof (struct entry));
+				shmht_debug (("__shmht_compact_stripe__: colision %d to %d\n",
+							  previous->next, *free_hint));
+				//If the process dies, the one of them that is not in the
+				//chain is freed.
+				iht->intent.target = 1 + iht->tablelength + *free_hint;
+				iht->intent.moved = previous->next;
+				iht->intent.tag |= e->tag;
+				intent_barrier ();
+				(*target) = (*e);
+				target->position = *free_hint;
+				tag_moved (h, target);
+				gds_moved (h, target);
+				previous->next = *free_hint;
+				e->used = 0;
+				e = target;
+				moved++;
+			}
+			moved += compact_value (h, e);
+			previous = e;
+		}
 	}
+	return moved;
+}								// __shmht_compact_stripe__
 
-	//Go around the structs:
-	//Mantain ordered the structure.
-	struct entry *target_entry;
-	//Second, clear all the entries:
-	for (i = 0; i < iht->tablelength; i++) {
-		target_entry = h->entrypoint + (i * sizeof (struct entry));
-		if (target_entry->used)
-			insert_older_if_necessary (target_entry, older_storage,
-									   deleteEntries, 0);
+/****************************************************************************/
+
+int
+shmht_compact (struct shmht *h)
+{
+	table_switch (h);
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned int first, free_hint = 0;
+	int moved = 0;
+
+	//Lock only a stripe each time, so the other processes can go on.
+	for (first = 0; first < iht->tablelength; first += COMPACT_STRIPE) {
+		if (ht_write_lock (h, SHMHT_OP_COMPACT) < 0)
+			return -ECANCELED;
+		//A new generation of the table is compacted from the start.
+		if (h->internal_ht != iht) {
+			iht = h->internal_ht;
+			first = free_hint = 0;
+		}
+		iht->intent.tag = 0;
+		intent_begin (iht, INTENT_COMPACT);
+		moved += __shmht_compact_stripe__ (h, first, first + COMPACT_STRIPE,
+										   &free_hint);
+		intent_end (iht);
+		ht_write_unlock (h);
+	}
+	return moved;
+}								// shmht_compact
+
+/****************************************************************************/
+//The recovery of the operation of a writer that died with the lock (see
+//struct write_intent), called by the next process that takes the lock. It
+//only walks the chain of the operation, but the tag index links the entries
+//of all the chains, so it's rebuilt if the operation was of a tagged entry.
+//A bucket that the dead process was taking or freeing could be lost. The
+//eviction heap of SHMHT_EVICT_GDS is rebuilt too.
+
+//Cuts the chain of the slot where it's broken, and frees the colision entry
+//of the id if it's used and it's not in the chain.
+static void
+repair_chain (struct shmht *h, unsigned int slot, unsigned int id)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct entry *e = h->entrypoint + (slot * sizeof (struct entry));
+	struct entry *orphan = id > iht->tablelength ? entry_of_id (h, id) : NULL;
+	unsigned int walked = 0;
+
+	while (entry_in_use (iht, e) && e->next != -1) {
+		struct entry *c;
+		if (e->next >= iht->tablelength
+			|| ++walked > iht->tablelength) {
+			e->next = -1;
+			break;
+		}
+		c = h->collisionentries + (e->next * sizeof (struct entry));
+		if (!entry_in_use (iht, c)
+			|| indexFor (iht->tablelength, c->h) != slot) {
+			e->next = -1;
+			break;
+		}
+		if (c == orphan)
+			orphan = NULL;
+		e = c;
 	}
+	if (orphan != NULL && entry_in_use (iht, orphan))
+		orphan->used = 0;
+}								// repair_chain
+
+//Links again all the tagged entries in the tag index.
+static void
+tags_rebuild (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned int i;
 
-	//Last, clear all the colisions.
 	for (i = 0; i < iht->tablelength; i++) {
-		target_entry = h->collisionentries + (i * sizeof (struct entry));
-		if (target_entry->used)
-			insert_older_if_necessary (target_entry, older_storage,
-									   deleteEntries, 1);
+		h->tags[i].generation = iht->generation;
+		h->tags[i].first = 0;
+	}
+	for (i = 1; i <= 2 * iht->tablelength; i++) {
+		struct entry *e = entry_of_id (h, i);
+		if (entry_in_use (iht, e))
+			tag_link (h, e);
 	}
+}								// tags_rebuild
 
+//An insert is completed if the entry was linked in the chain, and else it's
+//rolled back.
+static void
+recover_insert (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct write_intent *intent = &iht->intent;
+	struct entry *e = intent->target ? entry_of_id (h, intent->target) : NULL;
+
+	if (e != NULL && intent->linked) {
+		iht->entrycount = intent->entrycount + 1;
+		if ((e->flags & ENTRY_LEASE) && iht->leases == 0)
+			iht->leases = 1;
+		filter_add (h, intent->hash);
+	}
+	else {
+		if (e != NULL && intent->target > iht->tablelength) {
+			//The colision could be linked at the end of the chain.
+			struct entry *p = h->entrypoint +
+				(intent->slot * sizeof (struct entry));
+			int colision = intent->target - 1 - iht->tablelength;
+			unsigned int walked = 0;
+			while (entry_in_use (iht, p) && p->next != -1
+				   && p->next < iht->tablelength
+				   && walked++ < iht->tablelength) {
+				if (p->next == colision) {
+					p->next = -1;
+					break;
+				}
+				p = h->collisionentries + (p->next * sizeof (struct entry));
+			}
+		}
+		if (e != NULL)
+			e->used = 0;
+		value_free (h, intent->bucket);
+		iht->entrycount = intent->entrycount;
+	}
+	near_invalidate (h, intent->hash);
+}								// recover_insert
 
-	//Now, delete the entries stored in older_storage:
-	for (i = 0; i < deleteEntries; i++) {
-		if (older_storage[i].index != LONG_MAX) {
-			if (!older_storage[i].is_in_col)
-				target_entry =
-					h->entrypoint +
-					(older_storage[i].index * sizeof (struct entry));
-			else
-				target_entry =
-					h->collisionentries +
-					(older_storage[i].index * sizeof (struct entry));
-			__shmht_remove__ (h, target_entry->k, target_entry->key_size);
-			retValue++;
+//A remove is always completed: the value could be freed.
+static void
+recover_remove (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct write_intent *intent = &iht->intent;
+	struct entry *e = entry_of_id (h, intent->target);
+
+	if (intent->previous) {
+		entry_of_id (h, intent->previous)->next = e->next;
+		e->used = 0;
+	}
+	else if (intent->moved != -1) {
+		//The colision is not used after it's copied to the slot.
+		struct entry *m =
+			h->collisionentries + (intent->moved * sizeof (struct entry));
+		if (entry_in_use (iht, m)) {
+			(*e) = (*m);
+			m->used = 0;
 		}
-		else
+		e->position = intent->slot;
+	}
+	else
+		e->used = 0;
+	value_free (h, intent->bucket);
+	iht->entrycount = intent->entrycount - 1;
+	near_invalidate (h, intent->hash);
+	lease_wake (h, intent->hash);
+}								// recover_remove
+
+static void
+recover (struct shmht *h)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct write_intent *intent = &iht->intent;
+
+	shmht_debug (("recover: operation %u of the dead process %d\n",
+				  intent->op, intent->owner));
+	switch (intent->op) {
+	case INTENT_INSERT:
+		recover_insert (h);
+		break;
+	case INTENT_REMOVE:
+		recover_remove (h);
+		break;
+	case INTENT_FLUSH:
+		__shmht_flush__ (h, intent->generation);
+		break;
+	case INTENT_COMPACT:
+		repair_chain (h, intent->slot, intent->target);
+		if (intent->moved != -1)
+			repair_chain (h, intent->slot,
+						  1 + iht->tablelength + intent->moved);
+		break;
+	}
+	if (intent->op != INTENT_NONE && intent->op != INTENT_FLUSH
+		&& intent->tag)
+		tags_rebuild (h);
+	if (intent->op != INTENT_NONE && iht->eviction == SHMHT_EVICT_GDS)
+		heap_rebuild (h);
+	repair_chain (h, intent->slot, 0);
+	intent->op = INTENT_NONE;
+	intent->owner = 0;
+	stat_add (h, recoveries, 1);
+}								// recover
+
+/****************************************************************************/
+//Evicts up to max entries with the lowest priorities of the eviction heap,
+//and advances the clock to the last one. Must be called from a locked
+//context. Returns the number of evicted entries.
+static int
+__shmht_evict_gds__ (struct shmht *h, int max)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	char key[MAX_KEY_SIZE];
+	int removed = 0;
+
+	while (removed < max && iht->heap_size > 0) {
+		struct entry *e = heap_entry (h, 0);
+		//The entries found since they were placed get the clock of then.
+		if (e->touched + e->credit > e->priority) {
+			e->priority = e->touched + e->credit;
+			e->touched = 0;
+			heap_down (h, 0);
+			continue;
+		}
+		iht->gds_clock = e->priority;
+		size_t key_size = e->key_size;
+		memcpy (key, e->k, key_size);
+		changelog_add (h, SHMHT_CHANGE_EVICT, key, key_size, NULL, 0, 0, 0);
+		removed += __shmht_remove__ (h, e->h, key, key_size);
+	}
+	return removed;
+}								// __shmht_evict_gds__
+
+/****************************************************************************/
+
+//The victims of the eviction by age: each part keeps the oldest entries of
+//its slots in a max-heap by their time, and the caller merges them.
+struct victim
+{
+	long sec;
+	unsigned int id;
+	unsigned int hash;
+};
+
+struct victims
+{
+	struct victim *heap;
+	unsigned int size;
+	unsigned int max;
+};
+
+static void
+victim_add (struct victims *v, struct entry *e, unsigned int id)
+{
+	struct victim new = { e->sec, id, e->h };
+	unsigned int pos;
+
+	if (v->size < v->max) {
+		//Up from the end.
+		pos = v->size++;
+		while (pos > 0 && v->heap[(pos - 1) / 2].sec < new.sec) {
+			v->heap[pos] = v->heap[(pos - 1) / 2];
+			pos = (pos - 1) / 2;
+		}
+		v->heap[pos] = new;
+		return;
+	}
+	if (new.sec >= v->heap[0].sec)
+		return;
+	//It replaces the newest one, down from the top.
+	pos = 0;
+	for (;;) {
+		unsigned int child = 2 * pos + 1;
+		if (child >= v->size)
+			break;
+		if (child + 1 < v->size && v->heap[child + 1].sec > v->heap[child].sec)
+			child++;
+		if (v->heap[child].sec <= new.sec)
 			break;
-	}							//for
+		v->heap[pos] = v->heap[child];
+		pos = child;
+	}
+	v->heap[pos] = new;
+}								// victim_add
+
+static void
+victims_part (struct scan_part *part)
+{
+	struct shmht *h = part->h;
+	struct internal_hashtable *iht = h->internal_ht;
+	struct victims *v = part->arg;
+	unsigned int i;
+
+	for (i = part->first; i < part->last; i++) {
+		struct entry *e = scan_entry (h->entrypoint, i, part->last);
+		if (entry_in_use (iht, e))
+			victim_add (v, e, 1 + i);
+		e = scan_entry (h->collisionentries, i, part->last);
+		if (entry_in_use (iht, e))
+			victim_add (v, e, 1 + iht->tablelength + i);
+	}
+}								// victims_part
+
+static int
+victim_cmp (const void *a, const void *b)
+{
+	const struct victim *v1 = a, *v2 = b;
+	return v1->sec < v2->sec ? -1 : v1->sec > v2->sec;
+}								// victim_cmp
+
+//The entry of the victim, NULL if it has been removed. The removes move the
+//first colision of a chain to its slot, so it could be there.
+static struct entry *
+victim_entry (struct shmht *h, struct victim *v)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct entry *e = entry_of_id (h, v->id);
+
+	if (entry_in_use (iht, e) && e->h == v->hash && e->sec == v->sec)
+		return e;
+	e = h->entrypoint + (indexFor (iht->tablelength, v->hash) *
+						 sizeof (struct entry));
+	if (entry_in_use (iht, e) && e->h == v->hash && e->sec == v->sec)
+		return e;
+	return NULL;
+}								// victim_entry
+
+//Evicts the max oldest entries. Must be called from a locked context.
+//Returns the number of evicted entries, or -ENOMEM.
+static int
+__shmht_evict_age__ (struct shmht *h, unsigned int max)
+{
+	struct scan_part parts[MAINTENANCE_MAX_THREADS];
+	struct victims v[MAINTENANCE_MAX_THREADS];
+	char key[MAX_KEY_SIZE];
+	unsigned int t, i, n = 0;
+	int removed = 0;
+
+	if (max == 0)
+		return 0;
+	struct victim *all = malloc ((size_t) h->threads * max *
+								 sizeof (struct victim));
+	if (all == NULL)
+		return -ENOMEM;
+	for (t = 0; t < h->threads; t++) {
+		v[t].heap = all + (size_t) t *max;
+		v[t].size = 0;
+		v[t].max = max;
+		parts[t].arg = &v[t];
+	}
+	scan_parallel (h, parts, victims_part);
+
+	//The oldest ones of all the parts.
+	for (t = 0; t < h->threads; t++) {
+		memmove (all + n, v[t].heap, v[t].size * sizeof (struct victim));
+		n += v[t].size;
+	}
+	qsort (all, n, sizeof (struct victim), victim_cmp);
+	for (i = 0; i < n && i < max; i++) {
+		struct entry *e = victim_entry (h, &all[i]);
+		if (e == NULL)
+			continue;
+		size_t key_size = e->key_size;
+		memcpy (key, e->k, key_size);
+		changelog_add (h, SHMHT_CHANGE_EVICT, key, key_size, NULL, 0, 0, 0);
+		removed += __shmht_remove__ (h, e->h, key, key_size);
+	}
+	free (all);
+	return removed;
+}								// __shmht_evict_age__
+
+/****************************************************************************/
+
+int
+shmht_remove_older_entries (struct shmht *h, int p)
+{
+	table_switch (h);
+
+	//Check before lock:
+	if (p > 100 || p < 0)
+		return -EINVAL;
+
+	shmht_probe1 (evict__entry, p);
+	if (ht_write_lock (h, SHMHT_OP_EVICT) < 0) {
+		shmht_probe2 (evict__return, p, -ECANCELED);
+		return -ECANCELED;
+	}
+	struct internal_hashtable *iht = h->internal_ht;
+
+	//Calcule the number of entries to delete:
+	int retValue, deleteEntries = iht->tablelength * p / 100;
+	shmht_debug (("shmht_remove_older_entries: Number of entries to Delete: %d\n", deleteEntries));
 
-	write_unlock (iht->semaphore);
+	if (iht->eviction == SHMHT_EVICT_GDS)
+		retValue = __shmht_evict_gds__ (h, deleteEntries);
+	else
+		retValue = __shmht_evict_age__ (h, deleteEntries);
+
+	ht_write_unlock (h);
+	if (retValue > 0)
+		stat_add (h, evictions, retValue);
+	shmht_probe2 (evict__return, p, retValue);
 	return retValue;
 }								// shmht_remove_older_entries
 
+/****************************************************************************/
+int
+shmht_maintenance_threads (struct shmht *h, unsigned int threads)
+{
+	if (threads == 0 || threads > MAINTENANCE_MAX_THREADS)
+		return -EINVAL;
+	h->threads = threads;
+	return 0;
+}								// shmht_maintenance_threads
+
+
+/****************************************************************************/
+
+int
+shmht_stats (struct shmht *h, struct shmht_stats *stats)
+{
+	table_switch (h);
+	struct internal_hashtable *iht = h->internal_ht;
+	struct stats_slot *slots = h->stats;
+	int i;
+
+	//The counters are read without locking, they are only approximated.
+	bzero (stats, sizeof (struct shmht_stats));
+	for (i = 0; i < STATS_SLOTS; i++) {
+#define SUM_STAT(name) \
+		stats->name += __atomic_load_n (&slots[i].name, __ATOMIC_RELAXED)
+#define MAX_STAT(name) \
+		do { \
+			unsigned long v = \
+				__atomic_load_n (&slots[i].name, __ATOMIC_RELAXED); \
+			if (stats->name < v) \
+				stats->name = v; \
+		} while (0)
+		SUM_STAT (hits);
+		SUM_STAT (misses);
+		SUM_STAT (inserts);
+		SUM_STAT (insert_full);
+		SUM_STAT (insert_nomem);
+		SUM_STAT (insert_invalid);
+		SUM_STAT (removes);
+		SUM_STAT (evictions);
+		SUM_STAT (filter_negatives);
+		SUM_STAT (near_hits);
+		MAX_STAT (max_chain);
+		SUM_STAT (free_scans);
+		SUM_STAT (free_scan_length);
+		MAX_STAT (max_free_scan);
+		SUM_STAT (recoveries);
+#undef SUM_STAT
+#undef MAX_STAT
+	}
+	stats->entries = iht->entrycount;
+	stats->tablelength = iht->tablelength;
+	return 0;
+}								// shmht_stats
+
+/****************************************************************************/
+
+int
+shmht_lock_profile (struct shmht *h, enum shmht_op op,
+					struct shmht_lock_histogram *wait,
+					struct shmht_lock_histogram *hold)
+{
+#ifdef SHMHT_LOCK_PROFILE
+	struct lock_profile *profile = h->lock_profile;
+	if (op < 0 || op >= SHMHT_OPS)
+		return -EINVAL;
+	//Copied without locking, they are only approximated.
+	memcpy (wait, &profile->wait[op], sizeof (struct shmht_lock_histogram));
+	memcpy (hold, &profile->hold[op], sizeof (struct shmht_lock_histogram));
+	return 0;
+#else
+	(void) h;
+	(void) op;
+	(void) wait;
+	(void) hold;
+	return -ENOSYS;
+#endif
+}								// shmht_lock_profile
 
 /****************************************************************************/
 
@@ -687,7 +3559,12 @@ shmht_remove_older_entries (struct shmht *h, int p)
 int
 shmht_destroy (struct shmht *h)
 {
+	table_switch (h);
 	struct internal_hashtable *iht = h->internal_ht;
+	//The tables of a container are destroyed with it, and the read only
+	//handles can't destroy the table.
+	if (h->pool_semaphore >= 0 || h->readonly)
+		return -EINVAL;
 	//Wait untill there are not more processess.
 	WRITE_LOCK_READERS (iht->semaphore);
 	WRITE_LOCK_TO_WRITE (iht->semaphore);
@@ -698,3 +3575,518 @@ shmht_destroy (struct shmht *h)
 	shmctl (iht->shmid, IPC_RMID, NULL);
 	return 0;
 }								// shmht_destroy
+
+/*****************************************************************************/
+//The bulk loads: the next generation of a table is built in a new shared
+//memory without any lock, and it replaces the current one when it's
+//published (see bulk_generation).
+
+struct shmht_bulk *
+shmht_bulk_begin (char *name, unsigned int number, size_t register_size,
+				  unsigned int (*hashf) (void *), int (*eqf) (void *, void *),
+				  const struct shmht_options *opts)
+{
+	struct shmht_bulk *b = calloc (1, sizeof (struct shmht_bulk));
+	struct slab_pool pool;
+	struct shmht layout;
+	unsigned int pindex, size;
+	void *base;
+	int id;
+
+	if (b == NULL || number > (1u << 30))
+		goto error;
+	//The current generation (its number could be other), a new empty table
+	//if there is not.
+	b->table = __shmht_attach__ (name, 0);
+	if (b->table == NULL)
+		b->table = create_shmht_ext (name, number, register_size, hashf, eqf,
+									 opts);
+	if (b->table == NULL || b->table->bulk_key == -1)
+		goto error;
+	struct internal_hashtable *current = b->table->internal_ht;
+	key_t key = current->key == b->table->key ? b->table->bulk_key
+		: b->table->key;
+
+	size = table_length (number, &pindex);
+	slab_init (&pool, size, register_size, opts ? opts->pool_size : 0);
+	unsigned long filter_size = opts ?
+		(opts->filter_size + FILTER_BLOCK - 1) & ~(FILTER_BLOCK - 1) : 0;
+	unsigned long changelog_size = opts ?
+		CHANGELOG_ALIGN (opts->changelog_size) : 0;
+	size_t all_ht_size = shmht_layout (&layout, NULL, size, pool.size,
+									   filter_size, changelog_size);
+
+	//The memory of a build that has not been published is removed.
+	id = shmget (key, all_ht_size, IPC_CREAT | IPC_EXCL | 0666);
+	if (id < 0 && errno == EEXIST && bulk_generation (key) < 0
+		&& shmctl (shmget (key, 0, 0), IPC_RMID, NULL) == 0)
+		id = shmget (key, all_ht_size, IPC_CREAT | IPC_EXCL | 0666);
+	if (id < 0) {
+		perror ("shmget: ");
+		goto error;
+	}
+	base = shmat (id, NULL, 0);
+	b->h = malloc (sizeof (struct shmht));
+	if (base == (void *) -1 || b->h == NULL) {
+		if (base != (void *) -1)
+			shmdt (base);
+		shmctl (id, IPC_RMID, NULL);
+		goto error;
+	}
+	bzero (base, all_ht_size);
+
+	struct shmht *h = b->h;
+	shmht_layout (h, base, size, pool.size, filter_size, changelog_size);
+	memcpy (h->slab, &pool, sizeof (struct slab_pool));
+	slab_reset (h->slab);
+	struct internal_hashtable *iht = h->internal_ht;
+	iht->semaphore = current->semaphore;
+	iht->shmid = id;
+	iht->key = key;
+	iht->layout_size = all_ht_size;
+	iht->filter_size = filter_size;
+	iht->changelog_size = changelog_size;
+	if (changelog_size)
+		h->changelog->size = changelog_size;
+	iht->registry_max_size = register_size;
+	iht->tablelength = size;
+	iht->primeindex = pindex;
+	if (opts != NULL) {
+		iht->compress_threshold = opts->compress_threshold;
+		iht->eviction = opts->eviction;
+	}
+	h->stats_slot = (struct stats_slot *) h->stats + getpid () % STATS_SLOTS;
+	h->near = NULL;
+	h->threads = 1;
+	h->pool_semaphore = -1;
+	h->readonly = 0;
+	h->key = b->table->key;
+	h->bulk_key = b->table->bulk_key;
+	h->hashfn = hashf;
+	h->eqfn = eqf;
+	return b;
+
+  error:
+	if (b != NULL && b->table != NULL) {
+		shmdt (b->table->internal_ht);
+		free (b->table);
+	}
+	if (b != NULL)
+		free (b->h);
+	free (b);
+	return NULL;
+}								// shmht_bulk_begin
+
+/*****************************************************************************/
+int
+shmht_bulk_add (struct shmht_bulk *b, void *k, size_t key_size, void *v,
+				size_t value_size)
+{
+	struct shmht *h = b->h;
+	struct internal_hashtable *iht = h->internal_ht;
+	struct bulk_record *r;
+	void *compressed;
+	int compressed_size;
+	size_t length = (sizeof (struct bulk_record) + key_size + 7) & ~7;
+
+	if (key_size > MAX_KEY_SIZE || value_size > INT_MAX)
+		return -EINVAL;
+	//The table is full as with shmht_insert.
+	if (b->nitems >= iht->tablelength)
+		return -1;
+	if (b->nitems == b->items_size) {
+		unsigned long items_size = b->items_size ? 2 * b->items_size : 1024;
+		struct bulk_item *items = realloc (b->items, items_size *
+										   sizeof (struct bulk_item));
+		if (items == NULL)
+			return -ENOMEM;
+		b->items = items;
+		b->items_size = items_size;
+	}
+	if (b->records_used + length > b->records_size) {
+		size_t records_size = 2 * b->records_size + length + 65536;
+		char *records = realloc (b->records, records_size);
+		if (records == NULL)
+			return -ENOMEM;
+		b->records = records;
+		b->records_size = records_size;
+	}
+
+	//The values are stored now, in the order of the adds.
+	compressed_size = value_compress (h, v, value_size, &compressed);
+	unsigned long bucket = compressed_size > 0 ?
+		value_store (h, compressed, compressed_size) :
+		value_store (h, v, value_size);
+	free (compressed);
+	if (bucket == SLAB_NONE)
+		return -1;
+
+	r = (struct bulk_record *) (b->records + b->records_used);
+	r->hash = hash_mix (h->hashfn (k));
+	r->flags = compressed_size > 0 ? ENTRY_COMPRESSED : 0;
+	r->bucket = bucket;
+	r->stored_size = compressed_size > 0 ? compressed_size : value_size;
+	r->value_size = value_size;
+	r->key_size = key_size;
+	memcpy (r->k, k, key_size);
+	b->items[b->nitems].index = indexFor (iht->tablelength, r->hash);
+	b->items[b->nitems].offset = b->records_used;
+	b->nitems++;
+	b->records_used += length;
+	return 1;
+}								// shmht_bulk_add
+
+/*****************************************************************************/
+//Order of the slots, and of the adds in each slot.
+static int
+bulk_item_cmp (const void *a, const void *b)
+{
+	const struct bulk_item *i1 = a, *i2 = b;
+	if (i1->index != i2->index)
+		return i1->index < i2->index ? -1 : 1;
+	return i1->offset < i2->offset ? -1 : i1->offset > i2->offset;
+}								// bulk_item_cmp
+
+//Writes the entries in the order of their slots, and the colisions of each
+//slot one after the other, so the chains are walked forward in the memory.
+static void
+bulk_place (struct shmht_bulk *b)
+{
+	struct shmht *h = b->h;
+	struct internal_hashtable *iht = h->internal_ht;
+	struct entry *e, *last = NULL;
+	struct timeval tv;
+	unsigned long i;
+	unsigned int colisions = 0;
+
+	gettimeofday (&tv, NULL);
+	qsort (b->items, b->nitems, sizeof (struct bulk_item), bulk_item_cmp);
+	for (i = 0; i < b->nitems; i++) {
+		struct bulk_record *r =
+			(struct bulk_record *) (b->records + b->items[i].offset);
+		int position;
+		if (last == NULL || b->items[i].index != b->items[i - 1].index) {
+			position = b->items[i].index;
+			e = h->entrypoint + position * sizeof (struct entry);
+		}
+		else {
+			position = colisions++;
+			e = h->collisionentries + position * sizeof (struct entry);
+			last->next = position;
+		}
+		e->used = 1;
+		e->generation = iht->generation;
+		memcpy (e->k, r->k, r->key_size);
+		e->key_size = r->key_size;
+		e->h = r->hash;
+		e->next = -1;
+		e->bucket = r->bucket;
+		e->position = position;
+		e->bucket_stored_size = r->stored_size;
+		e->value_size = r->value_size;
+		e->flags = r->flags;
+		e->sec = tv.tv_sec;
+		e->tag = 0;
+		gds_add (h, e, 1);
+		filter_add (h, r->hash);
+		last = e;
+	}
+	iht->entrycount = b->nitems;
+}								// bulk_place
+
+//Frees the builder, and detaches the generations.
+static void
+bulk_free (struct shmht_bulk *b)
+{
+	shmdt (b->table->internal_ht);
+	shmdt (b->h->internal_ht);
+	free (b->table);
+	free (b->h);
+	free (b->items);
+	free (b->records);
+	free (b);
+}								// bulk_free
+
+/*****************************************************************************/
+int
+shmht_bulk_publish (struct shmht_bulk *b)
+{
+	struct shmht *table = b->table;
+	struct internal_hashtable *iht = b->h->internal_ht;
+
+	bulk_place (b);
+	if (ht_write_lock (table, SHMHT_OP_FLUSH) < 0) {
+		shmht_bulk_abort (b);
+		return -ECANCELED;
+	}
+	//The positions of the changelog go on, so the readers of the old one
+	//see a flush, or they have lost records.
+	struct internal_hashtable *current = table->internal_ht;
+	struct changelog *log = b->h->changelog;
+	if (log != NULL && table->changelog != NULL) {
+		log->seq = table->changelog->seq;
+		log->tail = log->reserved = log->committed =
+			table->changelog->committed;
+	}
+	changelog_add (b->h, SHMHT_CHANGE_FLUSH, NULL, 0, NULL, 0, 0, 0);
+
+	__atomic_store_n (&iht->magic, SHMHT_MAGIC, __ATOMIC_RELEASE);
+	current->successor = iht->shmid;
+	__atomic_store_n (&current->replaced, 1, __ATOMIC_RELEASE);
+	//It's freed when the last process detaches it.
+	shmctl (current->shmid, IPC_RMID, NULL);
+	ht_write_unlock (table);
+
+	bulk_free (b);
+	return 0;
+}								// shmht_bulk_publish
+
+/*****************************************************************************/
+void
+shmht_bulk_abort (struct shmht_bulk *b)
+{
+	struct internal_hashtable *iht = b->h->internal_ht;
+	shmctl (iht->shmid, IPC_RMID, NULL);
+	bulk_free (b);
+}								// shmht_bulk_abort
+
+/*****************************************************************************/
+//The hash of the keys that are strings (FNV-1a), and its equality.
+
+unsigned int
+shmht_string_hash (void *k)
+{
+	unsigned char *p = k;
+	unsigned int hash = 2166136261u;
+
+	while (*p)
+		hash = (hash ^ *p++) * 16777619u;
+	return hash;
+}								// shmht_string_hash
+
+int
+shmht_string_eq (void *k1, void *k2)
+{
+	return !strcmp (k1, k2);
+}								// shmht_string_eq
+
+/*****************************************************************************/
+//The containers of tables: the tables are in one shared memory, and share
+//its pool of buckets.
+
+#define CONTAINER_HEADER_SIZE CACHE_LINE_ALIGN (sizeof (struct container_header))
+
+size_t
+shmht_table_size (unsigned int number, const struct shmht_options *opts)
+{
+	struct shmht layout;
+	unsigned int pindex, size = table_length (number, &pindex);
+	unsigned long filter_size = opts ?
+		(opts->filter_size + FILTER_BLOCK - 1) & ~(FILTER_BLOCK - 1) : 0;
+	unsigned long changelog_size = opts ?
+		CHANGELOG_ALIGN (opts->changelog_size) : 0;
+
+	return CACHE_LINE_ALIGN (shmht_layout (&layout, NULL, size, 0,
+										   filter_size, changelog_size));
+}								// shmht_table_size
+
+/*****************************************************************************/
+struct shmht_container *
+shmht_container_create (char *name, size_t tables_size, size_t pool_size,
+						size_t max_value_size)
+{
+	struct slab_pool pool;
+	struct shmht_container *c;
+	int created = 0;
+	union semun arg;
+	arg.val = 0;
+
+	if (pool_size == 0 || max_value_size > INT_MAX)
+		return NULL;
+	key_t key = ftok (name, CONTAINER_PROJ);
+	if (key < 0) {
+		perror ("ftok: ");
+		return NULL;
+	}
+
+	slab_init (&pool, 0, max_value_size, pool_size);
+	tables_size = CACHE_LINE_ALIGN (tables_size);
+	size_t all_size = CONTAINER_HEADER_SIZE + tables_size +
+		sizeof (struct slab_pool) + pool.size;
+
+	int id = shmget (key, all_size, 0666);
+	if (id < 0) {
+		id = shmget (key, all_size, IPC_CREAT | 0666);
+		created = 1;
+	}
+	if (id < 0) {
+		perror ("shmget: ");
+		return NULL;
+	}
+	void *base = shmat (id, NULL, 0);
+	if (base == (void *) -1) {
+		perror ("shmat: ");
+		return NULL;
+	}
+
+	//One semaphore, the mutex of the directory and the pool.
+	int semaphore = semget (key, 1, 0666);
+	if (semaphore < 0) {
+		semaphore = semget (key, 1, IPC_CREAT | 0666);
+		if (semaphore < 0 || semctl (semaphore, 0, SETVAL, arg) == -1) {
+			perror ("semget: ");
+			return NULL;
+		}
+	}
+
+	struct container_header *header = base;
+	if (created) {
+		header->shmid = id;
+		header->semaphore = semaphore;
+		header->tables_used = CONTAINER_HEADER_SIZE;
+		header->tables_end = CONTAINER_HEADER_SIZE + tables_size;
+		header->max_value_size = max_value_size;
+		memcpy (base + header->tables_end, &pool, sizeof (struct slab_pool));
+		slab_reset (base + header->tables_end);
+		header->magic = CONTAINER_MAGIC;
+	}
+	else if (header->magic != CONTAINER_MAGIC) {
+		shmdt (base);
+		return NULL;
+	}
+
+	c = malloc (sizeof (struct shmht_container));
+	if (c == NULL)
+		return NULL;
+	c->header = header;
+	c->slab = base + header->tables_end;
+	c->bucketmarket = c->slab + sizeof (struct slab_pool);
+	return c;
+}								// shmht_container_create
+
+/*****************************************************************************/
+struct shmht *
+shmht_container_table (struct shmht_container *c, char *table,
+					   unsigned int number,
+					   unsigned int (*hashf) (void *),
+					   int (*eqf) (void *, void *),
+					   const struct shmht_options *opts)
+{
+	struct container_header *header = c->header;
+	void *base = header;
+	struct container_table *t;
+	unsigned int i, pindex, size;
+	union semun arg;
+	arg.val = 0;
+
+	if (strlen (table) >= CONTAINER_NAME_SIZE)
+		return NULL;
+	struct shmht *h = malloc (sizeof (struct shmht));
+	if (h == NULL)
+		return NULL;
+	if (mutex_lock (header->semaphore, 0) < 0) {
+		free (h);
+		return NULL;
+	}
+
+	for (i = 0; i < header->ntables; i++)
+		if (!strcmp (header->tables[i].name, table))
+			break;
+	t = &header->tables[i];
+
+	if (i < header->ntables) {
+		//An existing table has its own layout.
+		struct internal_hashtable *iht = base + t->offset;
+		size = table_length (t->number, &pindex);
+		shmht_layout (h, iht, size, 0, iht->filter_size,
+					  iht->changelog_size);
+	}
+	else {
+		unsigned long filter_size = opts ?
+			(opts->filter_size + FILTER_BLOCK - 1) & ~(FILTER_BLOCK - 1) : 0;
+		unsigned long changelog_size = opts ?
+			CHANGELOG_ALIGN (opts->changelog_size) : 0;
+		size_t table_size = shmht_table_size (number, opts);
+		//Each table has its own lock.
+		int semaphore = -1;
+		if (i < CONTAINER_MAX_TABLES
+			&& header->tables_used + table_size <= header->tables_end)
+			semaphore = semget (IPC_PRIVATE, 2, IPC_CREAT | 0666);
+		if (semaphore < 0 || semctl (semaphore, 0, SETVAL, arg) == -1
+			|| semctl (semaphore, 1, SETVAL, arg) == -1) {
+			mutex_unlock (header->semaphore, 0);
+			free (h);
+			return NULL;
+		}
+
+		strcpy (t->name, table);
+		t->offset = header->tables_used;
+		t->number = number;
+		t->filter_size = filter_size;
+		size = table_length (number, &pindex);
+		shmht_layout (h, base + t->offset, size, 0, filter_size,
+					  changelog_size);
+
+		struct internal_hashtable *iht = h->internal_ht;
+		bzero (iht, table_size);
+		iht->changelog_size = changelog_size;
+		if (changelog_size)
+			h->changelog->size = changelog_size;
+		iht->semaphore = semaphore;
+		iht->shmid = header->shmid;
+		iht->layout_size = table_size;
+		iht->filter_size = filter_size;
+		iht->registry_max_size = header->max_value_size;
+		iht->tablelength = size;
+		iht->primeindex = pindex;
+		if (opts != NULL) {
+			iht->compress_threshold = opts->compress_threshold;
+			iht->eviction = opts->eviction;
+		}
+		iht->magic = SHMHT_MAGIC;
+
+		header->tables_used += table_size;
+		header->ntables++;
+	}
+	mutex_unlock (header->semaphore, 0);
+
+	//The pool of the container, instead of the one of the table.
+	h->slab = c->slab;
+	h->bucketmarket = c->bucketmarket;
+	h->pool_semaphore = header->semaphore;
+	h->stats_slot = (struct stats_slot *) h->stats + getpid () % STATS_SLOTS;
+	h->near = NULL;
+	h->threads = 1;
+	h->readonly = 0;
+	h->key = -1;
+	h->bulk_key = -1;
+	h->hashfn = hashf;
+	h->eqfn = eqf;
+	return h;
+}								// shmht_container_table
+
+/*****************************************************************************/
+void
+shmht_container_close (struct shmht_container *c)
+{
+	free (c);
+}								// shmht_container_close
+
+/*****************************************************************************/
+int
+shmht_container_destroy (struct shmht_container *c)
+{
+	struct container_header *header = c->header;
+	unsigned int i;
+
+	mutex_lock (header->semaphore, 0);
+	for (i = 0; i < header->ntables; i++) {
+		struct internal_hashtable *iht =
+			(void *) header + header->tables[i].offset;
+		semctl (iht->semaphore, 0, IPC_RMID);
+	}
+	semctl (header->semaphore, 0, IPC_RMID);
+	shmctl (header->shmid, IPC_RMID, NULL);
+	free (c);
+	return 0;
+}								// shmht_container_destroy
@@ -2,8 +2,17 @@
 #define __HASHTABLE_CWC22_H__
 
 #include <unistd.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
 
 struct shmht;
+struct shmht_set;
+struct shmht_container;
+struct shmht_bulk;
 
 /*! \mainpage lib_shmht
  *
@@ -18,6 +27,9 @@ struct shmht;
  * space.<BR>
  * <b>concurrency</b>: The accesses are controlled by a semaphore R/W lock implemntation, so not concurrency
  * problem is possible.<BR>
+ * <b>robustness</b>: A process that dies with the write lock (as killed by the OOM killer) leaves
+ * its operation in the table, and the next process that takes the lock rolls it back or completes it,
+ * walking only its chain.<BR>
  * <b>performance</b>: The performance is the main target of this implementation.<BR>
  *
  * It has the next <b>limitations</b>: <BR>
@@ -34,7 +46,7 @@ struct shmht;
  * @name                    shmht_hashtable
  * @param   name            Name of the HashTable.
  * @param   number          Number of records.
- * @param   size            Size of each record.
+ * @param   size            Max size of each record.
  * @param   hashfunction    function for hashing keys.
  * @param   key_eq_fn       function for determining key equality
  * @return                  newly created hashtable or NULL on failure
@@ -52,6 +64,83 @@ struct shmht *create_shmht(char *name,
 				unsigned int (*hashfunction) (void *),
 				int (*key_eq_fn) (void *, void *));
 
+/*!
+ * Eviction policies of shmht_remove_older_entries (the eviction option of
+ * create_shmht_ext).
+ */
+enum shmht_eviction
+{
+	//The oldest entries first.
+	SHMHT_EVICT_AGE,
+	//GreedyDual-Size: the entries with the lowest cost per byte first (see
+	//shmht_insert_cost), aged by the cost of the evicted ones.
+	SHMHT_EVICT_GDS
+};
+
+/*!
+ * Optional parameters of create_shmht_ext. A zeroed structure creates the
+ * same hash table as create_shmht.
+ */
+struct shmht_options
+{
+	//Bytes of shared memory for the values. The values only take the size
+	//class they need, so with small values the table can store many more
+	//entries than pool_size / size. 0 means enough for number values of
+	//the max size.
+	size_t pool_size;
+	//Values of this size or bigger are stored compressed, if they can be
+	//compressed. They are only readable with shmht_search_copy.
+	//0 disables the compression.
+	size_t compress_threshold;
+	//Bytes of the negative lookup filter, a counting Bloom filter that
+	//answers most of the searches of keys that are not in the table without
+	//locking it. 8 bytes for each entry give about 4% of false positives.
+	//0 disables the filter.
+	size_t filter_size;
+	//Bytes of the changelog, a ring in the shared memory with the last
+	//changes of the table (see shmht_changelog_read). 0 disables it.
+	size_t changelog_size;
+	//Policy of shmht_remove_older_entries, SHMHT_EVICT_AGE by default.
+	enum shmht_eviction eviction;
+};
+
+/*!
+ * @name                    create_shmht_ext
+ * @param   opts            Optional parameters, NULL for the defaults.
+ *
+ * Same as create_shmht, with the optional parameters of the table. The
+ * options are set by the process that creates the shared memory, the others
+ * use the existing table as it is.
+ */
+
+struct shmht *create_shmht_ext (char *name,
+				unsigned int number,
+				size_t size,
+				unsigned int (*hashfunction) (void *),
+				int (*key_eq_fn) (void *, void *),
+				const struct shmht_options *opts);
+
+/*!
+ * @name                    shmht_attach_ro
+ * @param   name            Name of the existing HashTable.
+ * @return                  the hashtable, NULL if it does not exist or its
+ *                          layout is not valid.
+ *
+ * Attaches a process that only reads to an existing hashtable. The memory is
+ * mapped read only, and the searches (shmht_search, shmht_search_copy,
+ * shmht_search_batch and their variants) and shmht_count don't use the
+ * semaphore: they read without lock, and read again if a writer has changed
+ * the table meanwhile. So the readers don't write to the shared memory, and
+ * the writers never wait for them. The stats of the searches are kept in
+ * the process, they are not in shmht_stats.
+ * The writes fail, shmht_insert and shmht_remove with -EROFS, and the handle
+ * is only freed (shmht_destroy fails).
+ */
+
+struct shmht *shmht_attach_ro (char *name,
+				unsigned int (*hashfunction) (void *),
+				int (*key_eq_fn) (void *, void *));
+
 /*!   
  * @name        shmht_insert
  * @param   h   the hashtable to insert into
@@ -63,7 +152,10 @@ struct shmht *create_shmht(char *name,
  * The value returned when using a duplicate key is undefined.
  * If in doubt, remove before insert.
  * The size of this hashtable is fixed, so if the hashtable is full, the insert
- * will fail.
+ * will fail. It also fails when there is not memory left in the size class of
+ * the value.
+ * The values bigger than the max size of the records are stored in a chain of
+ * records, they only fail if there is not enought memory in the table.
  */
 
 int
@@ -76,17 +168,64 @@ shmht_insert (struct shmht *h, void *k, size_t key_size, void *v,
  * @param   h   the hashtable to search
  * @param   k   the key to search for  - does not claim ownership
  * @param key_size Size of the key.
- * @param returned_size [out], the size of the returned value.
+ * @param returned_size [out], the size of the returned value, 0 if the key
+ *              is not found.
  * @return      the value associated with the key, or NULL if none found
  * 
  * You should be careful, beacause, this function returns a pointer to the 
  * shared memory area. DO NOT FREE THIS POINTER!
+ * The values bigger than the max size are not stored contiguously, and the
+ * compressed values must be decompressed, so for them it returns NULL with
+ * the size of the value in returned_size (a miss returns NULL and 0): read
+ * them with shmht_search_copy, with a buffer of that size.
  */
 
 void *shmht_search (struct shmht *h, void *k, size_t key_size,
 						size_t * returned_size);
 
 
+/*!
+ * @name        shmht_search_copy
+ * @param   h   the hashtable to search
+ * @param   k   the key to search for  - does not claim ownership
+ * @param key_size Size of the key.
+ * @param   v   [out] buffer where the value is copied.
+ * @param value_size [in/out] size of the buffer, returns the size of the value.
+ * @return      1 if found, 0 if not found, -ENOSPC if the buffer is too small
+ *              (value_size returns the necessary size), <0 for other errors.
+ *
+ * The value is copied while the hashtable is locked, so it's safe to use it
+ * after concurrent removals. It works for all the values, also for the ones
+ * bigger than the max size. The compressed values are decompressed after
+ * the unlock.
+ */
+
+int shmht_search_copy (struct shmht *h, void *k, size_t key_size,
+					   void *v, size_t * value_size);
+
+
+/*!
+ * @name        shmht_search_batch
+ * @param   h   the hashtable
+ * @param   n   number of keys.
+ * @param keys  the keys, the NULL ones are skipped.
+ * @param key_sizes sizes of the keys.
+ * @param found called for each key found, with its index in keys and its
+ *              value.
+ * @param arg   argument for found.
+ * @return      the number of keys found, <0 if error.
+ *
+ * Searches many keys with one read lock. found is called with the lock
+ * held, so it must copy the value and return, without calling the
+ * hashtable. The value points to the shared memory, or to a copy for the
+ * chained and compressed values, and it's valid only in the call.
+ */
+
+int shmht_search_batch (struct shmht *h, unsigned int n, void **keys,
+						size_t * key_sizes,
+						void (*found) (void *arg, unsigned int i, void *value,
+									   size_t value_size), void *arg);
+
 /*!   
  * @name        shmht_remove
  * @param   h   the hashtable to remove the item from
@@ -97,7 +236,239 @@ void *shmht_search (struct shmht *h, void *k, size_t key_size,
 
 int shmht_remove (struct shmht *h, void *k, size_t key_size);
 
+/*!
+ * @name        shmht_insert_hashed
+ * @name        shmht_search_hashed
+ * @name        shmht_search_copy_hashed
+ * @name        shmht_remove_hashed
+ * @param hashvalue  the value of the hash function of the table for the key.
+ *
+ * Same as shmht_insert, shmht_search, shmht_search_copy and shmht_remove, with
+ * the hash of the key calculated by the caller, so the hash function of the
+ * table is not called. They are for the callers that can inline the hash
+ * function, as the C++ wrapper of shmht.hpp.
+ * The hash value must be the one of the hash function of the table, or the
+ * processes that use the hash function will not find the key.
+ */
+
+int shmht_insert_hashed (struct shmht *h, unsigned int hashvalue, void *k,
+						 size_t key_size, void *v, size_t value_size);
+
+void *shmht_search_hashed (struct shmht *h, unsigned int hashvalue, void *k,
+						   size_t key_size, size_t * returned_size);
+
+int shmht_search_copy_hashed (struct shmht *h, unsigned int hashvalue,
+							  void *k, size_t key_size, void *v,
+							  size_t * value_size);
+
+int shmht_remove_hashed (struct shmht *h, unsigned int hashvalue, void *k,
+						 size_t key_size);
+
+/*!
+ * @name        shmht_insert_tagged
+ * @param  tag  id of the group of the entry, 0 is no group.
+ * @return      the same as shmht_insert.
+ *
+ * Same as shmht_insert, and the entry is in the group of the tag, as the
+ * entries cached from a same row or page, so they can be removed together
+ * with shmht_invalidate_tag.
+ */
+
+int shmht_insert_tagged (struct shmht *h, void *k, size_t key_size, void *v,
+						 size_t value_size, unsigned int tag);
+
+/*!
+ * @name        shmht_insert_cost
+ * @param cost  cost to compute the value again, in any unit (as
+ *              microseconds), the other inserts have cost 1.
+ * @return      the same as shmht_insert.
+ *
+ * Same as shmht_insert, with the cost of the value for the SHMHT_EVICT_GDS
+ * eviction: the entries are evicted by their cost per byte of key and value,
+ * plus the cost of the last evicted one when they were inserted or found, so
+ * the expensive and small values stay longer. The tables with other eviction
+ * ignore the cost.
+ */
+
+int shmht_insert_cost (struct shmht *h, void *k, size_t key_size, void *v,
+					   size_t value_size, unsigned int cost);
+
+/*!
+ * Modes of shmht_store.
+ */
+enum shmht_store_mode
+{
+	//Replaces the value of the key, or inserts it.
+	SHMHT_STORE_SET = 1,
+	//Only if the key is not in the table.
+	SHMHT_STORE_ADD,
+	//Only if the key is in the table.
+	SHMHT_STORE_REPLACE
+};
+
+/*!
+ * @name        shmht_store
+ * @param mode  how the key is stored.
+ * @return      > zero if stored, 0 if the mode does not store it (the key
+ *              exists for SHMHT_STORE_ADD, or not for SHMHT_STORE_REPLACE),
+ *              <0 for the errors of shmht_insert.
+ *
+ * Same as shmht_insert, checking the key and removing its old value with the
+ * same write lock as the insert, so the processes that store a key at once
+ * don't duplicate it, and only one of the adds stores it. If the insert
+ * fails, the old value has been removed anyway.
+ */
+
+int shmht_store (struct shmht *h, void *k, size_t key_size, void *v,
+				 size_t value_size, enum shmht_store_mode mode);
+
+/*!
+ * @name        shmht_invalidate_tag
+ * @param  tag  the tag of shmht_insert_tagged.
+ * @return      the number of removed entries, -EINVAL if the tag is 0,
+ *              -EROFS if the handle is read-only, or -ECANCELED.
+ *
+ * Removes all the entries of the tag. The entries of a tag are linked in an
+ * index of the table, so the time is of the size of the group (and of the
+ * other tags with the same slot of the index), not of the table. The lock is
+ * released every few hundreds of entries, so an insert of the tag while it
+ * runs could stay.
+ */
+
+int shmht_invalidate_tag (struct shmht *h, unsigned int tag);
+
+
+
+/*!
+ * @name        shmht_try_search
+ * @name        shmht_try_insert
+ * @name        shmht_try_remove
+ * @return      -EAGAIN if the hashtable is locked, else the same as
+ *              shmht_search_copy, shmht_insert and shmht_remove.
+ *
+ * They never wait for the lock, so an event loop can go on with another
+ * thing (or ask the backend) while other process holds the lock, as in a
+ * shmht_remove_older_entries.
+ */
+
+int shmht_try_search (struct shmht *h, void *k, size_t key_size, void *v,
+					  size_t * value_size);
+
+int shmht_try_insert (struct shmht *h, void *k, size_t key_size, void *v,
+					  size_t value_size);
+
+int shmht_try_remove (struct shmht *h, void *k, size_t key_size);
+
+/*!
+ * @name        shmht_timed_search
+ * @name        shmht_timed_insert
+ * @name        shmht_timed_remove
+ * @param deadline  time of CLOCK_MONOTONIC to stop waiting for the lock.
+ * @return      -EAGAIN if the lock is not acquired before the deadline, else
+ *              the same as shmht_search_copy, shmht_insert and shmht_remove.
+ *
+ * A deadline that has passed is the same as the try variants.
+ */
+
+int shmht_timed_search (struct shmht *h, void *k, size_t key_size, void *v,
+						size_t * value_size,
+						const struct timespec *deadline);
+
+int shmht_timed_insert (struct shmht *h, void *k, size_t key_size, void *v,
+						size_t value_size, const struct timespec *deadline);
+
+int shmht_timed_remove (struct shmht *h, void *k, size_t key_size,
+						const struct timespec *deadline);
+
+/*!
+ * @name        shmht_get_or_lock
+ * @param   h   the hashtable
+ * @param   k   the key to search for  - does not claim ownership
+ * @param key_size Size of the key.
+ * @param   v   [out] buffer where the value is copied.
+ * @param value_size [in/out] size of the buffer, returns the size of the value.
+ * @param lease_ms  milliseconds that the lease is valid.
+ * @param wait_ms   milliseconds to wait for the lease of other process.
+ * @return      1 if found (as shmht_search_copy), 0 if the caller has the
+ *              lease of the key, -EAGAIN if other process has it after
+ *              waiting wait_ms, -EROFS if the handle is read-only, <0 for
+ *              other errors.
+ *
+ * Avoids that all the processes ask the backend for a missing key at once.
+ * The first one that misses the key gets a lease for it (an entry without
+ * value), and it must insert the value with shmht_insert (that replaces the
+ * lease), or remove the key with shmht_remove to give the lease up. The
+ * other processes wait for it (sleeping in a futex), and then return the
+ * value. If the lease expires, the next process takes it.
+ * The leases are entries of the hashtable (shmht_count counts them), but the
+ * searches don't find them.
+ */
+
+int shmht_get_or_lock (struct shmht *h, void *k, size_t key_size, void *v,
+					   size_t * value_size, int lease_ms, int wait_ms);
 
+/*!
+ * Changes of the changelog.
+ */
+enum shmht_change_op
+{
+	SHMHT_CHANGE_INSERT,
+	SHMHT_CHANGE_REMOVE,
+	//Removed by shmht_remove_older_entries.
+	SHMHT_CHANGE_EVICT,
+	//shmht_flush, it has not key.
+	SHMHT_CHANGE_FLUSH
+};
+
+struct shmht_change
+{
+	//Sequence number of the change in the table.
+	unsigned long seq;
+	enum shmht_change_op op;
+	//The key and the value are in the buffer of shmht_changelog_read.
+	void *key;
+	size_t key_size;
+	//The value of the inserts, NULL if it was too big for the changelog
+	//(search it in the table).
+	void *value;
+	size_t value_size;
+};
+
+/*!
+ * @name        shmht_changelog_cursor
+ * @param   h   the hashtable
+ * @return      the cursor after the last change, to read the next ones.
+ *
+ * The cursor 0 reads from the first change.
+ */
+
+unsigned long shmht_changelog_cursor (struct shmht *h);
+
+/*!
+ * @name        shmht_changelog_read
+ * @param   h   the hashtable
+ * @param cursor [in/out] position of the reader, it's moved to the next
+ *              change.
+ * @param change [out] the change.
+ * @param   buf buffer for the key and the value of the change.
+ * @param buf_size size of the buffer.
+ * @return      1 if there was a change, 0 if there are not more changes,
+ *              -EOVERFLOW if the changes from the cursor have been
+ *              overwritten (the cursor is moved to the oldest change),
+ *              -ENOSPC if the buffer is too small for the key and the value,
+ *              -EINVAL if the table has not changelog.
+ *
+ * Reads the next change of the changelog (the changelog_size option), the
+ * inserts, removes, evictions and flushes of the table in order, without
+ * locking the table. Each reader keeps its own cursor, so a follower can
+ * replicate or persist the changes as they happen.
+ * The changelog is a ring with the last changes: a reader that is too late
+ * loses the older ones, and must rescan the table after -EOVERFLOW.
+ */
+
+int shmht_changelog_read (struct shmht *h, unsigned long *cursor,
+						  struct shmht_change *change, void *buf,
+						  size_t buf_size);
 
 /*!   
  * @name        shmht_count
@@ -112,6 +483,11 @@ int shmht_count (struct shmht *h);
  * @name        shmht_flush
  * @param   h   the hashtable
  * @return      0 if not problem, <0 if error.
+ *
+ * The flush does not walk the table, it starts a new generation of entries, so
+ * it takes the same time for any table size. The entries of older generations
+ * are reused by the next insertions. The tables of values in containers free
+ * the values of the entries, in the threads of shmht_maintenance_threads.
  */
 
 int shmht_flush (struct shmht *h);
@@ -121,10 +497,172 @@ int shmht_flush (struct shmht *h);
  * @param   h   the hashtable
  * @param   p   the % of older values to erase
  * @return      The number of deleted entries.
+ *
+ * With the SHMHT_EVICT_GDS eviction, the p % of the entries with the lowest
+ * priorities are erased instead, taken from a heap in the shared memory, so
+ * the time is of the evicted entries and not of the table. The searches
+ * refresh the priority of the entries found (not the near caches nor the
+ * read only handles).
+ * With the age eviction, the table is scanned in the threads of
+ * shmht_maintenance_threads.
  */
 
 int shmht_remove_older_entries (struct shmht *h, int p);
 
+/*!
+ * @name        shmht_compact
+ * @param   h   the hashtable
+ * @return      The number of moved entries and values, <0 if error.
+ *
+ * Packs the colision entries of the chains, so each chain is contiguous and
+ * the used colision entries are together, and moves the values to the first
+ * free buckets of their size class. It locks the hashtable for each stripe of
+ * entries, not for all the table, so it can be called on a live table.
+ * The pointers returned by shmht_search are not valid after the compaction.
+ */
+
+int shmht_compact (struct shmht *h);
+
+/*!
+ * @name        shmht_maintenance_threads
+ * @param   h   the hashtable
+ * @param threads  number of threads, from 1 (the default) to 64.
+ * @return      0 if not problem, -EINVAL if the number is not valid.
+ *
+ * Sets the number of threads of this handle that scan the table in the
+ * operations that walk all the entries: the eviction by age, the freeing of
+ * the values of a flush and the clear of the table when the generations wrap.
+ * Each thread scans a range of the slots while the hashtable is locked, so
+ * with big tables the lock is held less time. The compaction is not threaded.
+ */
+
+int shmht_maintenance_threads (struct shmht *h, unsigned int threads);
+
+/*!
+ * @name        shmht_near_cache
+ * @param   h   the hashtable
+ * @param entries  number of values of the near cache, 0 disables it.
+ * @param max_value_size  the bigger values are not cached.
+ * @return      0 if not problem, <0 if error.
+ *
+ * Enables a near cache in this process (for this handle): the searches keep
+ * a copy of the values they find, and the next searches of the key return
+ * the copy without locking, while no process has inserted or removed a key
+ * of its stripe (or flushed the table). Checking it is only an atomic read
+ * of the shared memory.
+ * With the near cache, shmht_search returns a pointer to the copy of the
+ * process, that is valid until the next search of the handle.
+ * Call it with 0 entries to free the cache before freeing the handle.
+ */
+
+int shmht_near_cache (struct shmht *h, size_t entries,
+					  size_t max_value_size);
+
+/*!
+ * @name        shmht_near_stats
+ * @param   h   the hashtable
+ * @param hits  [out] searches answered by the near cache of this process.
+ * @param misses [out] searches that have read the hashtable.
+ * @return      0 if not problem, -EINVAL if there is not near cache.
+ */
+
+int shmht_near_stats (struct shmht *h, unsigned long *hits,
+					  unsigned long *misses);
+
+/*!
+ * Counters of the operations of all the processes on the hashtable.
+ */
+struct shmht_stats
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	//Failed inserts: the hashtable is full, there is not memory for the
+	//value, or the key or value are too big.
+	unsigned long insert_full;
+	unsigned long insert_nomem;
+	unsigned long insert_invalid;
+	unsigned long removes;
+	//Entries removed by shmht_remove_older_entries.
+	unsigned long evictions;
+	//Misses answered by the negative lookup filter (they are in misses too).
+	unsigned long filter_negatives;
+	//Hits answered by the near caches of the processes (they are in hits
+	//too).
+	unsigned long near_hits;
+	//Longest chain of entries walked.
+	unsigned long max_chain;
+	//Scans of the colision entries looking for a free one, total and
+	//longest number of entries scanned.
+	unsigned long free_scans;
+	unsigned long free_scan_length;
+	unsigned long max_free_scan;
+	//Operations of the processes that died with the write lock, rolled back
+	//or completed by the next one.
+	unsigned long recoveries;
+	//Current number of entries and size of the hashtable.
+	unsigned long entries;
+	unsigned long tablelength;
+};
+
+/*!
+ * @name        shmht_stats
+ * @param   h   the hashtable
+ * @param stats [out] the counters.
+ * @return      0 if not problem, <0 if error.
+ *
+ * The counters are kept in the shared memory, in slots updated with relaxed
+ * atomics by the processes, and they are read without locking.
+ */
+
+int shmht_stats (struct shmht *h, struct shmht_stats *stats);
+
+/*!
+ * Operations of the lock profile.
+ */
+enum shmht_op
+{
+	SHMHT_OP_SEARCH,
+	SHMHT_OP_INSERT,
+	SHMHT_OP_REMOVE,
+	SHMHT_OP_FLUSH,
+	SHMHT_OP_EVICT,
+	SHMHT_OP_COMPACT,
+	SHMHT_OP_COUNT,
+	SHMHT_OPS
+};
+
+//The bucket i of a histogram counts the times from 2^i to 2^(i+1) - 1
+//nanoseconds, and the last one all the bigger times.
+#define SHMHT_LOCK_HIST_BUCKETS 32
+
+struct shmht_lock_histogram
+{
+	unsigned long count;
+	unsigned long total_ns;
+	unsigned long buckets[SHMHT_LOCK_HIST_BUCKETS];
+};
+
+/*!
+ * @name        shmht_lock_profile
+ * @param   h   the hashtable
+ * @param   op  the operation (SHMHT_OP_*).
+ * @param wait  [out] histogram of the time waiting for the lock.
+ * @param hold  [out] histogram of the time holding the lock.
+ * @return      0 if not problem, -ENOSYS if the library is built without
+ *              SHMHT_LOCK_PROFILE, <0 for other errors.
+ *
+ * The histograms are kept in the shared memory, so they have the times of all
+ * the processes using the hashtable. They are only recorded when the library
+ * is built with -DSHMHT_LOCK_PROFILE, otherwise the locks are not timed at
+ * all (the memory of the histograms is always in the layout, so the processes
+ * built with and without the profile can share a hashtable).
+ */
+
+int shmht_lock_profile (struct shmht *h, enum shmht_op op,
+						struct shmht_lock_histogram *wait,
+						struct shmht_lock_histogram *hold);
+
 /*!   
  * @name        shmht_destroy
  * @param   h   the hashtable
@@ -133,8 +671,267 @@ int shmht_remove_older_entries (struct shmht *h, int p);
  * using the shared memory hash table will fail (it deletes the shared memory and
  * the semaphores used as mutex). 
  * If you have any doubt, use the hashtable_flush, instead of this function.
+ * The tables of a container are destroyed with shmht_container_destroy,
+ * it returns -EINVAL for them.
  */
 
 int shmht_destroy (struct shmht *h);
 
+/*!
+ * @name                    shmht_bulk_begin
+ * @param   name            Name of the HashTable, as for create_shmht.
+ * @param   number          Number of entries of the new generation.
+ * @param   size            Max size of the values of the new generation.
+ * @param   opts            Optional parameters of the new generation, NULL
+ *                          for the defaults.
+ * @return                  the builder, NULL if error.
+ *
+ * Starts to build the next generation of the table (it's created empty if
+ * it does not exist), in a new shared memory, with its own number, size and
+ * options. The processes go on using the current generation meanwhile. Only
+ * one process builds the table each time, the memory of a build that has
+ * not been published is removed. It's only for the tables of create_shmht,
+ * not for the sets and the containers.
+ */
+
+struct shmht_bulk *shmht_bulk_begin (char *name,
+				unsigned int number,
+				size_t size,
+				unsigned int (*hashfunction) (void *),
+				int (*key_eq_fn) (void *, void *),
+				const struct shmht_options *opts);
+
+/*!
+ * @name        shmht_bulk_add
+ * @param   b   the builder
+ * @return      1 if added, -1 if the new generation is full (as shmht_insert)
+ *              and <0 for other errors.
+ *
+ * Adds a key to the new generation, without any lock: the value is stored,
+ * and the entries are written in the order of their slots when it's
+ * published. The keys must be different, as with shmht_insert.
+ */
+
+int shmht_bulk_add (struct shmht_bulk *b, void *k, size_t key_size, void *v,
+					size_t value_size);
+
+/*!
+ * @name        shmht_bulk_publish
+ * @param   b   the builder, it's freed.
+ * @return      0 if published, <0 if error.
+ *
+ * Replaces the current generation by the new one atomically: each process
+ * takes the new one in its next operation on the table (the operations
+ * waiting for the lock during the publish too), and the old one is freed
+ * when no process is attached to it. The changelog of the new
+ * generation goes on with a SHMHT_CHANGE_FLUSH, without the keys of the
+ * build.
+ */
+
+int shmht_bulk_publish (struct shmht_bulk *b);
+
+/*!
+ * @name        shmht_bulk_abort
+ * @param   b   the builder, it's freed.
+ *
+ * Removes the new generation, the current one is not changed.
+ */
+
+void shmht_bulk_abort (struct shmht_bulk *b);
+
+/*!
+ * @name                    shmht_container_create
+ * @param   name            Name of the container, a file as for create_shmht.
+ * @param   tables_size     Bytes for the tables, see shmht_table_size.
+ * @param   pool_size       Bytes of the pool of values of all the tables.
+ * @param   max_value_size  Max size of the values of the tables, the bigger
+ *                          ones are chained.
+ * @return                  the container, NULL if error.
+ *
+ * Creates (or takes the existing) container: one shared memory with many
+ * named tables (shmht_container_table), each one with its own keys and its
+ * own lock, but with one pool of values for all of them, so the memory goes
+ * to the tables that use it. The pool has its own lock, only held to take
+ * or return buckets. The sizes are set by the process that creates it.
+ */
+
+struct shmht_container *shmht_container_create (char *name,
+												size_t tables_size,
+												size_t pool_size,
+												size_t max_value_size);
+
+/*!
+ * @name        shmht_table_size
+ * @return      the bytes that a table of number entries takes in a
+ *              container (without its values).
+ */
+
+size_t shmht_table_size (unsigned int number,
+						 const struct shmht_options *opts);
+
+/*!
+ * @name        shmht_container_table
+ * @param   c   the container
+ * @param table name of the table (up to 31 characters).
+ * @param number Number of entries of the table.
+ * @param opts  Optional parameters as create_shmht_ext, without pool_size.
+ * @return      the table, NULL if error (or there is not space for it).
+ *
+ * Creates (or takes the existing) table of the container, it's used with the
+ * rest of the API as the ones of create_shmht. As them, the table is created
+ * with number and opts, the other processes use it as it is.
+ * The flush of a table returns its buckets one by one, as the pool is
+ * shared.
+ */
+
+struct shmht *shmht_container_table (struct shmht_container *c, char *table,
+									 unsigned int number,
+									 unsigned int (*hashfunction) (void *),
+									 int (*key_eq_fn) (void *, void *),
+									 const struct shmht_options *opts);
+
+/*!
+ * @name        shmht_container_close
+ *
+ * Frees the container of this process, as freeing the handle of
+ * create_shmht. The tables of the container stay valid.
+ */
+
+void shmht_container_close (struct shmht_container *c);
+
+/*!
+ * @name        shmht_container_destroy
+ *
+ * Deletes the shared memory and the semaphores of the container and of all
+ * its tables, and frees the container. As shmht_destroy, the processes
+ * using it will fail.
+ */
+
+int shmht_container_destroy (struct shmht_container *c);
+
+/*!
+ * @name        shmht_string_hash
+ *
+ * Hash and equality functions for the keys that are strings: the hash reads
+ * the key until its '\0' (FNV-1a), and the key_size of the calls is
+ * strlen (key). They are the functions of the tables of shmht-memcached, so
+ * the C processes that share the tables with it must use them.
+ */
+
+unsigned int shmht_string_hash (void *k);
+
+int shmht_string_eq (void *k1, void *k2);
+
+/*!
+ * Options of shmht_set_create, zero for the defaults.
+ */
+struct shmht_set_options
+{
+	//Number of shards, 0 means one for each NUMA node. Each shard is a
+	//hashtable with its own shared memory and lock, bound to the NUMA node
+	//shard % nodes.
+	unsigned int shards;
+	//Each NUMA node has a copy of all the table (the shards are the copies):
+	//the writes go to all the copies, and the searches to the copy of the
+	//node of the process. For the read mostly data. It ignores shards.
+	int replicate;
+	//Options of each shard (the pool_size and filter_size are of each
+	//shard), NULL for the defaults.
+	const struct shmht_options *table;
+};
+
+/*!
+ * @name                    shmht_set_create
+ * @param   name            Name of the hashtable, as create_shmht.
+ * @param   number          Number of entries of all the set (of each copy
+ *                          with replicate).
+ * @param   opts            Options of the set, NULL for the defaults.
+ * @return                  the set, NULL if error.
+ *
+ * Creates (or takes the existing) set of hashtables, sharded by the hash of
+ * the keys. The shards don't share the lock nor the memory, and each one is
+ * in the memory of a NUMA node, so the processes of each node don't read
+ * the memory of the other ones (with replicate), or the throughput grows
+ * with the nodes and not only with the cores.
+ * The shards are hashtables as the ones of create_shmht, and shmht_set_shard
+ * returns the shard of a key for the rest of the API.
+ */
+
+struct shmht_set *shmht_set_create (char *name, unsigned int number,
+									size_t size,
+									unsigned int (*hashfunction) (void *),
+									int (*key_eq_fn) (void *, void *),
+									const struct shmht_set_options *opts);
+
+/*!
+ * @name        shmht_set_shard
+ * @return      the shard of the key (the copy of the node of the process
+ *              with replicate).
+ *
+ * The writes in the shard of a replicated set only change that copy.
+ */
+
+struct shmht *shmht_set_shard (struct shmht_set *s, void *k,
+							   size_t key_size);
+
+/*!
+ * @name        shmht_set_insert
+ * @return      > zero for successful insertion, else for error.
+ *
+ * As shmht_insert, in the shard of the key. With replicate, it's inserted in
+ * all the copies, or in none if it fails in one.
+ */
+
+int shmht_set_insert (struct shmht_set *s, void *k, size_t key_size,
+					  void *v, size_t value_size);
+
+/*!
+ * As shmht_search and shmht_search_copy, in the shard of the key.
+ */
+
+void *shmht_set_search (struct shmht_set *s, void *k, size_t key_size,
+						size_t * returned_size);
+
+int shmht_set_search_copy (struct shmht_set *s, void *k, size_t key_size,
+						   void *v, size_t * value_size);
+
+/*!
+ * @name        shmht_set_remove
+ * @return      the number of removed entries (of the local copy with
+ *              replicate), <0 if error.
+ */
+
+int shmht_set_remove (struct shmht_set *s, void *k, size_t key_size);
+
+/*!
+ * @name        shmht_set_count
+ * @return      the number of entries of all the shards (of the local copy
+ *              with replicate), <0 if error.
+ */
+
+int shmht_set_count (struct shmht_set *s);
+
+int shmht_set_flush (struct shmht_set *s);
+
+/*!
+ * @name        shmht_set_close
+ *
+ * Frees the set of this process, the shared memory stays, as freeing the
+ * handle of create_shmht.
+ */
+
+void shmht_set_close (struct shmht_set *s);
+
+/*!
+ * @name        shmht_set_destroy
+ *
+ * shmht_destroy of all the shards, and frees the set.
+ */
+
+int shmht_set_destroy (struct shmht_set *s);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* __HASHTABLE_CWC22_H__ */
@@ -0,0 +1,167 @@
+/*
+ * Typed C++ wrapper of the hashtable, header only.
+ *
+ *   libshmht::table<Key, Value, Hash, Eq> t ("/path/of/the/file", 1000);
+ *   t.insert (key, value);
+ *   if (t.get (key, value) > 0) ...
+ *
+ * The keys and values must be trivially copyable: the keys are stored and
+ * compared as their bytes, and the values are copied from the object to the
+ * shared memory and back, without any other copy. The sizes are known at
+ * compile time, and the hash is inlined, it calls the *_hashed functions of
+ * the library, so there are not calls through function pointers.
+ *
+ * The table is the same of create_shmht, so C and C++ processes can share it
+ * if the C processes use the same hash (the hash_function below can be given
+ * to create_shmht from C++ code too) and the same bytes for the keys.
+ * As the keys are compared as bytes, Eq must agree with it (keys without
+ * padding), it's only given as the equality function of the table.
+ * (The namespace is libshmht, as shmht is the name of the C structure.)
+ */
+
+#ifndef __HASHTABLE_HPP__
+#define __HASHTABLE_HPP__
+
+#include "shmht.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <stdexcept>
+#include <type_traits>
+
+namespace libshmht
+{
+
+	template <typename Key, typename Value,
+			  typename Hash = std::hash<Key>,
+			  typename Eq = std::equal_to<Key> >
+	class table
+	{
+		//Same as MAX_KEY_SIZE of shmht_private.h
+		static_assert (sizeof (Key) <= 512, "the key is too big");
+		static_assert (std::is_trivially_copyable<Key>::value,
+					   "the key must be trivially copyable");
+		static_assert (std::is_trivially_copyable<Value>::value,
+					   "the value must be trivially copyable");
+
+	  public:
+		//Creates the hashtable, or takes the existing one, as create_shmht.
+		//Throws std::runtime_error if it fails.
+		table (const char *name, unsigned int number,
+			   const struct shmht_options *opts = nullptr)
+		{
+			h = create_shmht_ext (const_cast<char *> (name), number,
+								  sizeof (Value), hash_function,
+								  key_eq_function, opts);
+			if (h == nullptr)
+				throw std::runtime_error ("shmht: can not create the table");
+		}
+
+		table (const table &) = delete;
+		table &operator= (const table &) = delete;
+
+		table (table && other) noexcept : h (other.h)
+		{
+			other.h = nullptr;
+		}
+
+		~table ()
+		{
+			//As the C processes, only the handle is freed, the hashtable
+			//stays in the shared memory.
+			std::free (h);
+		}
+
+		//The hash of the key, as the hash function of the table.
+		static unsigned int hash (const Key & k)
+		{
+			return static_cast<unsigned int> (Hash ()(k));
+		}
+
+		//> 0 if inserted, as shmht_insert. It does not check for repeated
+		//keys, remove before insert.
+		int insert (const Key & k, const Value & v)
+		{
+			return shmht_insert_hashed (h, hash (k), const_cast<Key *> (&k),
+										sizeof (Key),
+										const_cast<Value *> (&v),
+										sizeof (Value));
+		}
+
+		//Copies the value of the key to v. 1 if found, 0 if not found, <0 if
+		//error (-EINVAL if the stored value is not a Value).
+		int get (const Key & k, Value & v)
+		{
+			size_t size = sizeof (Value);
+			int ret = shmht_search_copy_hashed (h, hash (k),
+												const_cast<Key *> (&k),
+												sizeof (Key), &v, &size);
+			if (ret > 0 && size != sizeof (Value))
+				return -EINVAL;
+			return ret;
+		}
+
+		//The number of removed entries, as shmht_remove.
+		int remove (const Key & k)
+		{
+			return shmht_remove_hashed (h, hash (k), const_cast<Key *> (&k),
+										sizeof (Key));
+		}
+
+		int count ()
+		{
+			return shmht_count (h);
+		}
+
+		int flush ()
+		{
+			return shmht_flush (h);
+		}
+
+		int remove_older_entries (int p)
+		{
+			return shmht_remove_older_entries (h, p);
+		}
+
+		int stats (struct shmht_stats *stats)
+		{
+			return shmht_stats (h, stats);
+		}
+
+		//Destroys the shared memory, see shmht_destroy.
+		int destroy ()
+		{
+			return shmht_destroy (h);
+		}
+
+		//The C handle, for the rest of the API.
+		struct shmht *handle ()
+		{
+			return h;
+		}
+
+		//The hash and equality functions of the table for create_shmht.
+		//The stored keys could be not aligned, so they are copied.
+		static unsigned int hash_function (void *k)
+		{
+			Key key;
+			std::memcpy (&key, k, sizeof (Key));
+			return hash (key);
+		}
+
+		static int key_eq_function (void *k1, void *k2)
+		{
+			Key key1, key2;
+			std::memcpy (&key1, k1, sizeof (Key));
+			std::memcpy (&key2, k2, sizeof (Key));
+			return Eq ()(key1, key2);
+		}
+
+	  private:
+		struct shmht *h;
+	};
+
+}								// namespace libshmht
+
+#endif //__HASHTABLE_HPP__
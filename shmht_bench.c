@@ -0,0 +1,574 @@
+/*
+ * Throughput and latency benchmark of the hashtable with several processes.
+ *
+ * It forks readers, that only search, and writers, that insert, remove and
+ * search, over the same hashtable. When an insert fails because the table is
+ * full, the writer evicts the older entries (shmht_remove_older_entries).
+ * The keys are chosen with a uniform or a zipfian distribution.
+ * With -S, the hashtable is a shmht_set of that number of shards, and each
+ * operation uses the shard of its key.
+ * With -M, the workers send the operations to a shmht-memcached of the same
+ * hashtable over its socket, to compare it with the direct API:
+ *   shmht-memcached -n keys -v value_size /tmp/shmht_bench &
+ *   shmht_bench -M /tmp/shmht.sock
+ * (the evictions are done by the daemon).
+ * With -R, the readers attach the hashtable read only (shmht_attach_ro), and
+ * search it without lock.
+ * With -G, the hashtable evicts with SHMHT_EVICT_GDS instead of by age, to
+ * compare the hits of both policies.
+ *
+ * The results are printed as JSON, one object for each operation with its
+ * throughput and latency percentiles, to compare between library versions.
+ *
+ * Usage: shmht_bench [options], see usage ().
+ */
+#include <shmht.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_FILE "/tmp/shmht_bench"
+#define MAX_PROCS 256
+
+enum bench_op
+{
+	OP_SEARCH,
+	OP_INSERT,
+	OP_REMOVE,
+	OP_EVICT,
+	OPS
+};
+
+static const char *op_names[OPS] = { "search", "insert", "remove", "evict" };
+
+//Latency histogram: 16 linear sub-buckets for each power of 2 of ns.
+#define SUB_BUCKETS 16
+#define HIST_BUCKETS (64 * SUB_BUCKETS)
+
+struct op_result
+{
+	unsigned long count;
+	unsigned long errors;
+	unsigned long hits;
+	unsigned long hist[HIST_BUCKETS];
+};
+
+struct proc_result
+{
+	struct op_result ops[OPS];
+};
+
+static struct
+{
+	int readers;
+	int writers;
+	int seconds;
+	size_t key_size;
+	size_t value_size;
+	unsigned long keys;
+	unsigned int table_size;
+	double zipf;
+	int write_pct;
+	int remove_pct;
+	int evict_pct;
+	int copy;
+	unsigned long near;
+	unsigned int shards;
+	char *socket;
+	int readonly;
+	int gds;
+} conf = {
+4, 1, 5, 16, 100, 100000, 0, 0.0, 100, 20, 10, 0, 0, 0, NULL, 0, 0};
+
+//Connection to shmht-memcached, -1 for the direct API.
+static int mc_fd = -1;
+static char *mc_buf;
+static size_t mc_buf_size;
+
+//Keys are fixed size, so the hash function needs the size.
+static unsigned int
+fnv_hash (void *k)
+{
+	unsigned char *p = k;
+	unsigned int h = 2166136261u;
+	size_t i;
+	for (i = 0; i < conf.key_size; i++)
+		h = (h ^ p[i]) * 16777619u;
+	return h;
+}
+
+static int
+key_eq (void *k1, void *k2)
+{
+	return !memcmp (k1, k2, conf.key_size);
+}
+
+static inline unsigned long
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static int
+hist_bucket (unsigned long ns)
+{
+	if (ns < SUB_BUCKETS)
+		return ns;
+	int e = 63 - __builtin_clzl (ns);
+	//The SUB_BUCKETS parts of [2^e, 2^(e+1))
+	return (e - 3) * SUB_BUCKETS + ((ns >> (e - 4)) & (SUB_BUCKETS - 1));
+}
+
+//Lower bound of the bucket.
+static unsigned long
+hist_value (int b)
+{
+	if (b < SUB_BUCKETS)
+		return b;
+	int e = b / SUB_BUCKETS + 3;
+	return (1UL << e) + ((unsigned long) (b % SUB_BUCKETS) << (e - 4));
+}
+
+static unsigned long
+percentile (struct op_result *r, double p)
+{
+	unsigned long target = (unsigned long) ceil (r->count * p);
+	unsigned long seen = 0;
+	int b;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += r->hist[b];
+		if (seen >= target && seen > 0)
+			return hist_value (b);
+	}
+	return 0;
+}
+
+/*****************************************************************************/
+//Zipfian generator (Gray et al., "Quickly generating billion-record
+//synthetic databases").
+static struct
+{
+	double theta, alpha, zetan, eta;
+} zipf;
+
+static void
+zipf_init (unsigned long n, double theta)
+{
+	double zeta2 = 1.0 + pow (0.5, theta);
+	unsigned long i;
+	zipf.theta = theta;
+	zipf.zetan = 0;
+	for (i = 1; i <= n; i++)
+		zipf.zetan += 1.0 / pow (i, theta);
+	zipf.alpha = 1.0 / (1.0 - theta);
+	zipf.eta = (1.0 - pow (2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf.zetan);
+}
+
+static unsigned long
+next_key (unsigned int *seed)
+{
+	if (conf.zipf <= 0)
+		return rand_r (seed) % conf.keys;
+	double u = (double) rand_r (seed) / RAND_MAX;
+	double uz = u * zipf.zetan;
+	if (uz < 1.0)
+		return 0;
+	if (uz < 1.0 + pow (0.5, zipf.theta))
+		return 1;
+	unsigned long k = (unsigned long) (conf.keys *
+									   pow (zipf.eta * u - zipf.eta + 1,
+											zipf.alpha));
+	return k < conf.keys ? k : conf.keys - 1;
+}
+
+static void
+make_key (char *key, unsigned long n)
+{
+	char digits[32];
+	int len = snprintf (digits, sizeof (digits), "%lu", n);
+	memset (key, 'k', conf.key_size);
+	memcpy (key + conf.key_size - len, digits,
+			(size_t) len < conf.key_size ? len : conf.key_size);
+}
+
+/*****************************************************************************/
+static void
+record (struct op_result *r, unsigned long start, int ok, int hit)
+{
+	r->count++;
+	r->hist[hist_bucket (now_ns () - start)]++;
+	if (!ok)
+		r->errors++;
+	if (hit)
+		r->hits++;
+}
+
+/*****************************************************************************/
+//The operations over the protocol of memcached.
+
+static int
+mc_connect (void)
+{
+	struct sockaddr_un addr;
+	int fd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strncpy (addr.sun_path, conf.socket, sizeof (addr.sun_path) - 1);
+	if (fd < 0 || connect (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0)
+		return -1;
+	mc_buf_size = conf.value_size + 2 * conf.key_size + 256;
+	mc_buf = malloc (mc_buf_size);
+	return mc_buf == NULL ? -1 : fd;
+}
+
+//Sends the request, and reads the reply until it ends with end. Returns
+//the reply length, <0 if error.
+static int
+mc_request (size_t len, const char *end)
+{
+	size_t got = 0, end_len = strlen (end);
+
+	if (write (mc_fd, mc_buf, len) != (ssize_t) len)
+		return -1;
+	do {
+		ssize_t n = read (mc_fd, mc_buf + got, mc_buf_size - got);
+		if (n <= 0)
+			return -1;
+		got += n;
+	} while (got < end_len || memcmp (mc_buf + got - end_len, end, end_len));
+	return got;
+}
+
+static void
+mc_search (char *key, struct proc_result *res)
+{
+	unsigned long start = now_ns ();
+	int len = sprintf (mc_buf, "get %.*s\r\n", (int) conf.key_size, key);
+	int ret = mc_request (len, "END\r\n");
+	record (&res->ops[OP_SEARCH], start, ret > 0, ret > 5);
+}
+
+static void
+mc_write (char *key, void *value, struct proc_result *res,
+		  unsigned int *seed)
+{
+	unsigned long start = now_ns ();
+	int len, ret;
+
+	if (rand_r (seed) % 100 < conf.remove_pct) {
+		len = sprintf (mc_buf, "delete %.*s\r\n", (int) conf.key_size, key);
+		ret = mc_request (len, "\r\n");
+		record (&res->ops[OP_REMOVE], start, ret > 0,
+				ret > 0 && mc_buf[0] == 'D');
+		return;
+	}
+	len = sprintf (mc_buf, "set %.*s 0 0 %zu\r\n", (int) conf.key_size, key,
+				   conf.value_size);
+	memcpy (mc_buf + len, value, conf.value_size);
+	len += conf.value_size;
+	len += sprintf (mc_buf + len, "\r\n");
+	ret = mc_request (len, "\r\n");
+	record (&res->ops[OP_INSERT], start, ret > 0 && mc_buf[0] == 'S', 0);
+}
+
+/*****************************************************************************/
+static void
+do_search (struct shmht *h, char *key, void *buf, struct proc_result *res)
+{
+	size_t size = conf.value_size;
+	unsigned long start = now_ns ();
+	int ret;
+
+	if (conf.copy)
+		ret = shmht_search_copy (h, key, conf.key_size, buf, &size);
+	else
+		ret = shmht_search (h, key, conf.key_size, &size) != NULL
+			|| size > 0;
+	record (&res->ops[OP_SEARCH], start, ret >= 0, ret > 0);
+}
+
+static void
+do_write (struct shmht *h, char *key, void *value, struct proc_result *res,
+		  unsigned int *seed)
+{
+	unsigned long start = now_ns ();
+	int ret;
+
+	if (rand_r (seed) % 100 < conf.remove_pct) {
+		ret = shmht_remove (h, key, conf.key_size);
+		record (&res->ops[OP_REMOVE], start, ret >= 0, ret > 0);
+		return;
+	}
+
+	//Remove before insert, the hashtable does not replace.
+	shmht_remove (h, key, conf.key_size);
+	ret = shmht_insert (h, key, conf.key_size, value, conf.value_size);
+	record (&res->ops[OP_INSERT], start, ret > 0, 0);
+	if (ret <= 0) {
+		start = now_ns ();
+		ret = shmht_remove_older_entries (h, conf.evict_pct);
+		record (&res->ops[OP_EVICT], start, ret >= 0, ret > 0);
+	}
+}
+
+//The hashtable of the benchmark, or the set of shards with -S.
+static struct shmht_set *
+open_set (struct shmht **h)
+{
+	struct shmht_options table = { 0 };
+	struct shmht_set_options opts = { conf.shards, 0, &table };
+
+	table.eviction = conf.gds ? SHMHT_EVICT_GDS : SHMHT_EVICT_AGE;
+	*h = NULL;
+	if (conf.shards > 0)
+		return shmht_set_create (BENCH_FILE, conf.table_size, conf.value_size,
+								 fnv_hash, key_eq, &opts);
+	*h = create_shmht_ext (BENCH_FILE, conf.table_size, conf.value_size,
+						   fnv_hash, key_eq, &table);
+	return NULL;
+}
+
+static void
+worker (int id, int writer, volatile int *go, struct proc_result *res)
+{
+	struct shmht *table;
+	struct shmht_set *set = NULL;
+	if (conf.readonly && !writer && conf.shards == 0)
+		table = shmht_attach_ro (BENCH_FILE, fnv_hash, key_eq);
+	else
+		set = open_set (&table);
+	struct shmht *h = table;
+	char *key = malloc (conf.key_size);
+	char *value = malloc (conf.value_size);
+	unsigned int seed = getpid () ^ (id * 7919);
+
+	if (h == NULL && set == NULL)
+		exit (1);
+	if (conf.socket != NULL && (mc_fd = mc_connect ()) < 0)
+		exit (1);
+	if (conf.near > 0 && set == NULL
+		&& shmht_near_cache (h, conf.near, conf.value_size) < 0)
+		exit (1);
+	memset (value, 'v', conf.value_size);
+	while (!*go)
+		usleep (100);
+
+	unsigned long end = now_ns () + conf.seconds * 1000000000UL;
+	while (*go && now_ns () < end) {
+		//Check the clock each few operations.
+		int i;
+		for (i = 0; i < 64; i++) {
+			make_key (key, next_key (&seed));
+			if (set != NULL)
+				h = shmht_set_shard (set, key, conf.key_size);
+			if (writer && rand_r (&seed) % 100 < conf.write_pct) {
+				if (mc_fd >= 0)
+					mc_write (key, value, res, &seed);
+				else
+					do_write (h, key, value, res, &seed);
+			}
+			else if (mc_fd >= 0)
+				mc_search (key, res);
+			else
+				do_search (h, key, value, res);
+		}
+	}
+	exit (0);
+}
+
+static void
+usage (char *argv0)
+{
+	fprintf (stderr,
+			 "Usage: %s [options]\n"
+			 "  -r readers     processes that only search (4)\n"
+			 "  -w writers     processes that write (1)\n"
+			 "  -t seconds     duration (5)\n"
+			 "  -k key_size    bytes of the keys (16)\n"
+			 "  -v value_size  bytes of the values (100)\n"
+			 "  -n keys        number of different keys (100000)\n"
+			 "  -s table_size  entries of the hashtable (keys)\n"
+			 "  -z theta       zipfian keys with this skew, 0 is uniform (0)\n"
+			 "  -W percent     writes in the writers, the rest searches (100)\n"
+			 "  -x percent     removes in the writes, the rest inserts (20)\n"
+			 "  -e percent     evicted when the hashtable is full (10)\n"
+			 "  -c             search copying the value (shmht_search_copy)\n"
+			 "  -N entries     near cache of each process (0)\n"
+			 "  -S shards      shmht_set of shards, 0 is one hashtable (0)\n"
+			 "  -M socket      operations through shmht-memcached\n"
+			 "  -R             readers attached read only (shmht_attach_ro)\n"
+			 "  -G             GreedyDual-Size eviction (SHMHT_EVICT_GDS)\n",
+			 argv0);
+	exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+	int opt, i;
+
+	while ((opt = getopt (argc, argv, "r:w:t:k:v:n:s:z:W:x:e:cN:S:M:RG"))
+		   != -1) {
+		switch (opt) {
+		case 'r':
+			conf.readers = atoi (optarg);
+			break;
+		case 'w':
+			conf.writers = atoi (optarg);
+			break;
+		case 't':
+			conf.seconds = atoi (optarg);
+			break;
+		case 'k':
+			conf.key_size = atol (optarg);
+			break;
+		case 'v':
+			conf.value_size = atol (optarg);
+			break;
+		case 'n':
+			conf.keys = atol (optarg);
+			break;
+		case 's':
+			conf.table_size = atol (optarg);
+			break;
+		case 'z':
+			conf.zipf = atof (optarg);
+			break;
+		case 'W':
+			conf.write_pct = atoi (optarg);
+			break;
+		case 'x':
+			conf.remove_pct = atoi (optarg);
+			break;
+		case 'e':
+			conf.evict_pct = atoi (optarg);
+			break;
+		case 'c':
+			conf.copy = 1;
+			break;
+		case 'N':
+			conf.near = atol (optarg);
+			break;
+		case 'S':
+			conf.shards = atoi (optarg);
+			break;
+		case 'M':
+			conf.socket = optarg;
+			break;
+		case 'R':
+			conf.readonly = 1;
+			break;
+		case 'G':
+			conf.gds = 1;
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	int procs = conf.readers + conf.writers;
+	if (procs <= 0 || procs > MAX_PROCS || conf.keys == 0
+		|| conf.key_size == 0 || conf.value_size == 0)
+		usage (argv[0]);
+	if (conf.table_size == 0)
+		conf.table_size = conf.keys;
+	if (conf.zipf > 0)
+		zipf_init (conf.keys, conf.zipf);
+
+	fclose (fopen (BENCH_FILE, "a"));
+	struct shmht *h;
+	struct shmht_set *set = open_set (&h);
+	if (h == NULL && set == NULL)
+		return 1;
+	if (set != NULL)
+		shmht_set_flush (set);
+	else
+		shmht_flush (h);
+
+	//Fill the hashtable before starting.
+	char *key = malloc (conf.key_size);
+	char *value = calloc (1, conf.value_size);
+	unsigned long n;
+	for (n = 0; n < conf.keys; n++) {
+		make_key (key, n);
+		if (set != NULL)
+			h = shmht_set_shard (set, key, conf.key_size);
+		if (shmht_insert (h, key, conf.key_size, value, conf.value_size) <= 0)
+			break;
+	}
+
+	//The results and the start flag are shared with the workers.
+	size_t shared_size = sizeof (int) + procs * sizeof (struct proc_result);
+	void *shared = mmap (NULL, shared_size, PROT_READ | PROT_WRITE,
+						 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (shared == MAP_FAILED)
+		return 1;
+	volatile int *go = shared;
+	struct proc_result *results =
+		(struct proc_result *) ((char *) shared + sizeof (int));
+
+	for (i = 0; i < procs; i++)
+		if (fork () == 0)
+			worker (i, i >= conf.readers, go, &results[i]);
+	unsigned long start = now_ns ();
+	*go = 1;
+	int failed = 0;
+	for (i = 0; i < procs; i++) {
+		int status;
+		wait (&status);
+		if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+			failed++;
+	}
+	double elapsed = (now_ns () - start) / 1e9;
+
+	//Merge the results of all the processes.
+	struct op_result total[OPS];
+	memset (total, 0, sizeof (total));
+	for (i = 0; i < procs; i++) {
+		int op, b;
+		for (op = 0; op < OPS; op++) {
+			total[op].count += results[i].ops[op].count;
+			total[op].errors += results[i].ops[op].errors;
+			total[op].hits += results[i].ops[op].hits;
+			for (b = 0; b < HIST_BUCKETS; b++)
+				total[op].hist[b] += results[i].ops[op].hist[b];
+		}
+	}
+
+	printf ("{\"config\": {\"readers\": %d, \"writers\": %d, "
+			"\"seconds\": %d, \"key_size\": %zu, \"value_size\": %zu, "
+			"\"keys\": %lu, \"table_size\": %u, \"zipf\": %.2f, "
+			"\"write_pct\": %d, \"remove_pct\": %d, \"evict_pct\": %d, "
+			"\"copy\": %d, \"near\": %lu, \"shards\": %u, "
+			"\"memcached\": %d, \"readonly\": %d, \"gds\": %d, "
+			"\"prefilled\": %lu},\n",
+			conf.readers, conf.writers, conf.seconds, conf.key_size,
+			conf.value_size, conf.keys, conf.table_size, conf.zipf,
+			conf.write_pct, conf.remove_pct, conf.evict_pct, conf.copy, conf.near,
+			conf.shards, conf.socket != NULL, conf.readonly, conf.gds, n);
+	printf (" \"elapsed\": %.3f, \"failed_procs\": %d,\n", elapsed, failed);
+	printf (" \"ops\": {");
+	for (i = 0; i < OPS; i++) {
+		printf ("%s\n  \"%s\": {\"count\": %lu, \"ops_per_sec\": %.0f, "
+				"\"errors\": %lu, \"hits\": %lu, \"p50_ns\": %lu, "
+				"\"p99_ns\": %lu, \"p999_ns\": %lu}", i ? "," : "",
+				op_names[i], total[i].count, total[i].count / elapsed,
+				total[i].errors, total[i].hits, percentile (&total[i], 0.50),
+				percentile (&total[i], 0.99), percentile (&total[i], 0.999));
+	}
+	printf ("\n }\n}\n");
+
+	shmht_destroy (h);
+	free (h);
+	return failed != 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * Memory footprint of a table with buckets of the max value size against a
+ * table with small buckets where the big values are chained.
+ *
+ * Usage: shmht_bench_memory [values]
+ */
+#include <shmht.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <sys/time.h>
+
+#define BENCH_FILE "/tmp/shmht_bench_memory"
+//95% of the values are small, the rest are up to MAX_VALUE.
+#define SMALL_MIN 64
+#define SMALL_MAX 512
+#define BIG_MIN (8 * 1024)
+#define MAX_VALUE (64 * 1024)
+
+/*dbj2 hash function:*/
+static unsigned int
+dbj2_hash (void *str_)
+{
+	unsigned long hash = 5381;
+	char *str = (char *) str_;
+	int c;
+
+	while ((c = *str++))
+		hash = ((hash << 5) + hash) + c;	/* hash * 33 + c */
+
+	return (unsigned int) hash;
+}
+
+static int
+str_compar (void *c1, void *c2)
+{
+	return !strcmp ((char *) c1, (char *) c2);
+}
+
+static double
+now (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+//Size of the shared memory segment of the table.
+static size_t
+segment_size (void)
+{
+	struct shmid_ds ds;
+	int id = shmget (ftok (BENCH_FILE, 1), 0, 0);
+	if (id < 0 || shmctl (id, IPC_STAT, &ds) < 0)
+		return 0;
+	return ds.shm_segsz;
+}
+
+static void
+run (const char *name, struct shmht *h, int values, size_t * sizes)
+{
+	char key[32];
+	static char value[MAX_VALUE], copy[MAX_VALUE];
+	int i, failed = 0, found = 0;
+	size_t stored = 0;
+	double t0, t1, t2;
+
+	memset (value, 'v', sizeof (value));
+	t0 = now ();
+	for (i = 0; i < values; i++) {
+		sprintf (key, "key_%d", i);
+		if (shmht_insert (h, key, strlen (key) + 1, value, sizes[i]) > 0)
+			stored += sizes[i];
+		else
+			failed++;
+	}
+	t1 = now ();
+	for (i = 0; i < values; i++) {
+		size_t size = sizeof (copy);
+		sprintf (key, "key_%d", i);
+		if (shmht_search_copy (h, key, strlen (key) + 1, copy, &size) > 0)
+			found++;
+	}
+	t2 = now ();
+
+	size_t segment = segment_size ();
+	printf ("table=%s segment_bytes=%zu value_bytes=%zu inserted=%d "
+			"failed=%d found=%d bytes_per_value=%.0f insert_us=%.3f "
+			"search_us=%.3f\n", name, segment, stored, values - failed,
+			failed, found, (double) segment / (values - failed),
+			(t1 - t0) * 1e6 / values, (t2 - t1) * 1e6 / values);
+}
+
+int
+main (int argc, char *argv[])
+{
+	int values = argc > 1 ? atoi (argv[1]) : 2000;
+	size_t *sizes = malloc (values * sizeof (size_t));
+	size_t total = 0;
+	struct shmht_options opts;
+	struct shmht *h;
+	int i;
+
+	fclose (fopen (BENCH_FILE, "a"));
+	srandom (42);
+	for (i = 0; i < values; i++) {
+		if (random () % 100 < 95)
+			sizes[i] = SMALL_MIN + random () % (SMALL_MAX - SMALL_MIN);
+		else
+			sizes[i] = BIG_MIN + random () % (MAX_VALUE - BIG_MIN);
+		total += sizes[i];
+	}
+	printf ("values=%d value_bytes=%zu\n", values, total);
+
+	//Every bucket of the max value size.
+	h = create_shmht (BENCH_FILE, values, MAX_VALUE, dbj2_hash, str_compar);
+	if (h == NULL)
+		return 1;
+	run ("max_size_buckets", h, values, sizes);
+	shmht_destroy (h);
+	free (h);
+
+	//Small buckets and the memory sized for the total bytes (plus the
+	//waste of the size classes).
+	memset (&opts, 0, sizeof (opts));
+	opts.pool_size = total + total / 4;
+	h = create_shmht_ext (BENCH_FILE, values, SMALL_MAX, dbj2_hash,
+						  str_compar, &opts);
+	if (h == NULL)
+		return 1;
+	run ("chained_buckets", h, values, sizes);
+	shmht_destroy (h);
+	free (h);
+
+	free (sizes);
+	return 0;
+}
@@ -0,0 +1,179 @@
+#include "shmht_lz.h"
+#include <stdint.h>
+#include <string.h>
+
+//Minimum length of a match.
+#define LZ_MIN_MATCH 4
+//The last match must start 12 bytes before the end, and the last 5 bytes are
+//always literals (as in the LZ4 block format).
+#define LZ_MF_LIMIT 12
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+//Size of the table of the last positions of each hash.
+#define LZ_HASH_LOG 12
+
+static inline uint32_t
+read32 (const uint8_t * p)
+{
+	uint32_t v;
+	memcpy (&v, p, sizeof (v));
+	return v;
+}
+
+static inline unsigned int
+lz_hash (uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+//Writes a length bigger than 15 as a sequence of bytes (255 continues).
+static inline uint8_t *
+write_length (uint8_t * op, int length)
+{
+	while (length >= 255) {
+		*op++ = 255;
+		length -= 255;
+	}
+	*op++ = length;
+	return op;
+}
+
+//Writes the literals from anchor and the match. With match_length < 0, only
+//the literals (the last sequence).
+//Returns NULL if it doesn't fit in the output.
+static uint8_t *
+write_sequence (uint8_t * op, uint8_t * oend, const uint8_t * anchor,
+				int literals, int offset, int match_length)
+{
+	//token + lengths + literals + offset
+	if (op + 1 + literals / 255 + 1 + literals + 2 + match_length / 255 + 1 >
+		oend)
+		return NULL;
+
+	uint8_t *token = op++;
+	*token = (literals >= 15 ? 15 : literals) << 4;
+	if (literals >= 15)
+		op = write_length (op, literals - 15);
+	memcpy (op, anchor, literals);
+	op += literals;
+
+	if (match_length >= 0) {
+		*op++ = offset & 0xff;
+		*op++ = offset >> 8;
+		*token |= match_length >= 15 ? 15 : match_length;
+		if (match_length >= 15)
+			op = write_length (op, match_length - 15);
+	}
+	return op;
+}
+
+/*****************************************************************************/
+int
+shmht_lz_compress (const void *src, int src_size, void *dst, int dst_size)
+{
+	const uint8_t *base = src;
+	const uint8_t *ip = base;
+	const uint8_t *anchor = base;
+	const uint8_t *end = base + src_size;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dst_size;
+	//Position + 1 of the last sequence with each hash, 0 if there is not.
+	uint32_t table[1 << LZ_HASH_LOG];
+
+	memset (table, 0, sizeof (table));
+	if (src_size > LZ_MF_LIMIT) {
+		const uint8_t *mflimit = end - LZ_MF_LIMIT;
+		const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+
+		while (ip < mflimit) {
+			uint32_t sequence = read32 (ip);
+			unsigned int h = lz_hash (sequence);
+			const uint8_t *ref = base + table[h] - 1;
+			int found = table[h] != 0 && ip - ref <= LZ_MAX_OFFSET
+				&& read32 (ref) == sequence;
+
+			table[h] = ip - base + 1;
+			if (!found) {
+				ip++;
+				continue;
+			}
+
+			//Extend the match.
+			const uint8_t *mp = ip + LZ_MIN_MATCH;
+			const uint8_t *rp = ref + LZ_MIN_MATCH;
+			while (mp < matchlimit && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+			op = write_sequence (op, oend, anchor, ip - anchor, ip - ref,
+								 mp - ip - LZ_MIN_MATCH);
+			if (op == NULL)
+				return 0;
+			ip = anchor = mp;
+		}
+	}
+
+	//The rest are literals.
+	op = write_sequence (op, oend, anchor, end - anchor, 0, -1);
+	if (op == NULL)
+		return 0;
+	return op - (uint8_t *) dst;
+}								// shmht_lz_compress
+
+/*****************************************************************************/
+int
+shmht_lz_decompress (const void *src, int src_size, void *dst, int dst_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = ip + src_size;
+	uint8_t *op = dst;
+	uint8_t *oend = op + dst_size;
+
+	while (ip < iend) {
+		unsigned int token = *ip++;
+		size_t length = token >> 4;
+		unsigned int b;
+
+		//Literals:
+		if (length == 15)
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		if (length > iend - ip || length > oend - op)
+			return -1;
+		memcpy (op, ip, length);
+		op += length;
+		ip += length;
+
+		//The last sequence has not match.
+		if (ip >= iend)
+			break;
+
+		//Match:
+		if (iend - ip < 2)
+			return -1;
+		size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op - (uint8_t *) dst)
+			return -1;
+		length = token & 15;
+		if (length == 15)
+			do {
+				if (ip >= iend)
+					return -1;
+				b = *ip++;
+				length += b;
+			} while (b == 255);
+		length += LZ_MIN_MATCH;
+		if (length > oend - op)
+			return -1;
+		//The match can overlap the output, copy byte by byte.
+		const uint8_t *ref = op - offset;
+		while (length--)
+			*op++ = *ref++;
+	}
+	return op - (uint8_t *) dst;
+}								// shmht_lz_decompress
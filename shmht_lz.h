@@ -0,0 +1,41 @@
+/*
+ * Small LZ77 codec for the values of the hash table. It writes the LZ4 block
+ * format (sequences of literals and matches with 16 bits offsets), it's fast
+ * and it doesn't depend on external libraries.
+ */
+
+#ifndef __HASHTABLE_LZ__
+#define __HASHTABLE_LZ__
+
+/*!
+ * @name                shmht_lz_compress
+ * @param   src         data to compress.
+ * @param   src_size    size of the data.
+ * @param   dst         buffer for the compressed data.
+ * @param   dst_size    size of the buffer.
+ * @return              size of the compressed data, 0 if it doesn't fit in
+ *                      the buffer.
+ *
+ * Passing a buffer smaller than the data, it fails with the data that
+ * can not be compressed.
+ */
+
+int shmht_lz_compress (const void *src, int src_size, void *dst,
+					   int dst_size);
+
+/*!
+ * @name                shmht_lz_decompress
+ * @param   src         compressed data.
+ * @param   src_size    size of the compressed data.
+ * @param   dst         buffer for the data.
+ * @param   dst_size    size of the buffer.
+ * @return              size of the data, <0 if the compressed data is not
+ *                      valid or it doesn't fit in the buffer.
+ *
+ * It never reads or writes out of the buffers, even with corrupted data.
+ */
+
+int shmht_lz_decompress (const void *src, int src_size, void *dst,
+						 int dst_size);
+
+#endif // __HASHTABLE_LZ__
@@ -0,0 +1,671 @@
+/*
+ * shmht-memcached: serves hashtables with the text protocol of memcached over
+ * a Unix socket, for the processes that can not map them (Python, Go, the
+ * JVM...), while the C processes keep using them in the shared memory.
+ *
+ * It forks a worker for each core, each one with its own handles of the
+ * tables and its own epoll loop, all of them accepting from the socket. The
+ * keys of a multiget, and of the gets that are pipelined together, are
+ * searched with shmht_search_batch, one read lock for all of them.
+ *
+ * Usage: shmht-memcached [options] table..., see usage ().
+ *
+ * The keys are strings: the tables use shmht_string_hash and shmht_string_eq,
+ * and the key_size is strlen (key), so the C processes must use them too.
+ * With several tables, the key "name:key" is the key "key" of the table
+ * whose file has the basename name, the other keys are of the first table.
+ * The commands are get, gets, set, add, replace, delete, flush_all, stats,
+ * version, verbosity and quit. The exptime of the stores is ignored (the
+ * tables evict their older entries when they are full), and the cas of gets
+ * is always 0. The flags are ignored (0), unless -f: then they are stored in
+ * the 4 first bytes of the values.
+ */
+#define _GNU_SOURCE
+#include <shmht.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define MAX_WORKERS 256
+#define MAX_TABLES 16
+#define MAX_EVENTS 64
+//Max length of a key of the protocol, and of a command line.
+#define MAX_KEY 250
+#define MAX_LINE 4096
+//Max keys searched in one batch.
+#define MAX_BATCH 1024
+#define READ_SIZE 16384
+
+static struct
+{
+	char *socket;
+	int workers;
+	unsigned int entries;
+	size_t value_size;
+	int evict_pct;
+	int flags;
+} conf = {
+"/tmp/shmht.sock", 0, 100000, 1024, 10, 0};
+
+struct table
+{
+	char *file;
+	//Basename of the file, for the keys "name:key".
+	char *name;
+	struct shmht *h;
+};
+
+static struct table tables[MAX_TABLES];
+static int ntables;
+
+//A growing buffer.
+struct buffer
+{
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct conn
+{
+	int fd;
+	struct buffer in;
+	struct buffer out;
+	//Bytes of out already written.
+	size_t sent;
+	//Waiting for the socket to write.
+	int writing;
+	int closing;
+	//Bytes of a rejected data block that are still to be discarded.
+	size_t swallow;
+};
+
+//The keys of the gets that are searched together.
+struct batch
+{
+	unsigned int n;
+	//The key of the request, and the one of the table.
+	char *keys[MAX_BATCH];
+	void *table_keys[MAX_BATCH];
+	size_t key_sizes[MAX_BATCH];
+	int table[MAX_BATCH];
+	//The values found, in values, or -1.
+	long offsets[MAX_BATCH];
+	size_t sizes[MAX_BATCH];
+	//The get command of each key, and if it's a gets.
+	unsigned int command[MAX_BATCH];
+	int cas[MAX_BATCH];
+	struct buffer values;
+};
+
+static struct batch batch;
+
+/*****************************************************************************/
+static int
+buffer_reserve (struct buffer *b, size_t size)
+{
+	if (b->len + size <= b->cap)
+		return 0;
+	size_t cap = b->cap ? b->cap : READ_SIZE;
+	while (cap < b->len + size)
+		cap *= 2;
+	char *data = realloc (b->data, cap);
+	if (data == NULL)
+		return -1;
+	b->data = data;
+	b->cap = cap;
+	return 0;
+}
+
+static void
+buffer_add (struct buffer *b, const void *data, size_t size)
+{
+	if (buffer_reserve (b, size) < 0)
+		return;
+	memcpy (b->data + b->len, data, size);
+	b->len += size;
+}
+
+static void
+buffer_printf (struct buffer *b, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+
+static void
+buffer_printf (struct buffer *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (buffer_reserve (b, 256) < 0)
+		return;
+	va_start (ap, fmt);
+	n = vsnprintf (b->data + b->len, b->cap - b->len, fmt, ap);
+	va_end (ap);
+	if (n > 0 && (size_t) n < b->cap - b->len)
+		b->len += n;
+}
+
+#define reply(c, s) buffer_add (&(c)->out, s, sizeof (s) - 1)
+
+/*****************************************************************************/
+//The table of a key, and the key in the table (without the name of the
+//table).
+static int
+table_of (char *key, char **table_key)
+{
+	char *colon;
+	int i;
+
+	*table_key = key;
+	if (ntables > 1 && (colon = strchr (key, ':')) != NULL) {
+		for (i = 0; i < ntables; i++)
+			if (strlen (tables[i].name) == (size_t) (colon - key)
+				&& !strncmp (tables[i].name, key, colon - key)) {
+				*table_key = colon + 1;
+				return i;
+			}
+	}
+	return 0;
+}
+
+//Splits the line in tokens, it ends the tokens with '\0'.
+static int
+tokenize (char *line, char **tokens, int max)
+{
+	int n = 0;
+	char *save;
+	char *t = strtok_r (line, " ", &save);
+	while (t != NULL && n < max) {
+		tokens[n++] = t;
+		t = strtok_r (NULL, " ", &save);
+	}
+	return n;
+}
+
+/*****************************************************************************/
+static void
+batch_found (void *arg, unsigned int i, void *value, size_t value_size)
+{
+	unsigned int *index = arg;
+	unsigned int k = index[i];
+
+	batch.offsets[k] = batch.values.len;
+	batch.sizes[k] = value_size;
+	buffer_add (&batch.values, value, value_size);
+	if (batch.values.len != batch.offsets[k] + value_size)
+		batch.offsets[k] = -1;
+}
+
+//Searches the keys of the batch, one batch for each table, and writes the
+//replies of its commands.
+static void
+batch_run (struct conn *c, unsigned int commands)
+{
+	static unsigned int index[MAX_BATCH];
+	static void *keys[MAX_BATCH];
+	static size_t sizes[MAX_BATCH];
+	unsigned int i, k, n, command;
+	int t;
+
+	batch.values.len = 0;
+	for (i = 0; i < batch.n; i++)
+		batch.offsets[i] = -1;
+	for (t = 0; t < ntables; t++) {
+		for (i = 0, n = 0; i < batch.n; i++)
+			if (batch.table[i] == t) {
+				index[n] = i;
+				keys[n] = batch.table_keys[i];
+				sizes[n++] = batch.key_sizes[i];
+			}
+		if (n > 0)
+			shmht_search_batch (tables[t].h, n, keys, sizes, batch_found,
+								index);
+	}
+
+	for (command = 0, k = 0; command < commands; command++) {
+		for (; k < batch.n && batch.command[k] == command; k++) {
+			char *value = batch.values.data + batch.offsets[k];
+			size_t size = batch.sizes[k];
+			unsigned int flags = 0;
+			if (batch.offsets[k] < 0)
+				continue;
+			if (conf.flags && size >= sizeof (flags)) {
+				memcpy (&flags, value, sizeof (flags));
+				value += sizeof (flags);
+				size -= sizeof (flags);
+			}
+			if (batch.cas[k])
+				buffer_printf (&c->out, "VALUE %s %u %zu 0\r\n",
+							   batch.keys[k], flags, size);
+			else
+				buffer_printf (&c->out, "VALUE %s %u %zu\r\n", batch.keys[k],
+							   flags, size);
+			buffer_add (&c->out, value, size);
+			reply (c, "\r\n");
+		}
+		reply (c, "END\r\n");
+	}
+	batch.n = 0;
+}
+
+/*****************************************************************************/
+//Stores the value, evicting the older entries if the table is full.
+static void
+store (struct conn *c, char *cmd, char *key, unsigned int flags, char *data,
+	   size_t bytes, int noreply)
+{
+	char *table_key;
+	struct shmht *h = tables[table_of (key, &table_key)].h;
+	size_t key_size = strlen (table_key);
+	//The check of add and replace is in the lock of the insert, so the
+	//workers don't store a key at once.
+	enum shmht_store_mode mode = !strcmp (cmd, "add") ? SHMHT_STORE_ADD
+		: !strcmp (cmd, "replace") ? SHMHT_STORE_REPLACE : SHMHT_STORE_SET;
+	int ret;
+
+	//The flags are before the value (over the end of the command line, it
+	//has been parsed).
+	if (conf.flags) {
+		data -= sizeof (flags);
+		memcpy (data, &flags, sizeof (flags));
+		bytes += sizeof (flags);
+	}
+	ret = shmht_store (h, table_key, key_size, data, bytes, mode);
+	//A replace that fails has removed the old value already.
+	if (ret < 0 && shmht_remove_older_entries (h, conf.evict_pct) > 0)
+		ret = shmht_store (h, table_key, key_size, data, bytes,
+						   mode == SHMHT_STORE_REPLACE ? SHMHT_STORE_SET
+						   : mode);
+	if (noreply)
+		return;
+	if (ret > 0)
+		reply (c, "STORED\r\n");
+	else if (ret == 0)
+		reply (c, "NOT_STORED\r\n");
+	else
+		reply (c, "SERVER_ERROR out of memory storing object\r\n");
+}
+
+static void
+stats (struct conn *c)
+{
+	struct shmht_stats s, total;
+	unsigned long items = 0;
+	int t;
+
+	memset (&total, 0, sizeof (total));
+	for (t = 0; t < ntables; t++) {
+		if (shmht_stats (tables[t].h, &s) < 0)
+			continue;
+		items += shmht_count (tables[t].h);
+		total.hits += s.hits;
+		total.misses += s.misses;
+		total.inserts += s.inserts;
+		total.removes += s.removes;
+		total.evictions += s.evictions;
+	}
+	buffer_printf (&c->out, "STAT pid %d\r\nSTAT threads %d\r\n"
+				   "STAT curr_items %lu\r\nSTAT get_hits %lu\r\n"
+				   "STAT get_misses %lu\r\nSTAT cmd_set %lu\r\n"
+				   "STAT delete_hits %lu\r\nSTAT evictions %lu\r\nEND\r\n",
+				   getpid (), conf.workers, items, total.hits, total.misses,
+				   total.inserts, total.removes, total.evictions);
+}
+
+/*****************************************************************************/
+//Processes one command of the input from pos. Returns the bytes used, 0 if
+//the command is not complete.
+static size_t
+command (struct conn *c, size_t pos, unsigned int *gets)
+{
+	char *line = c->in.data + pos;
+	char *eol = memchr (line, '\n', c->in.len - pos);
+	char *tokens[MAX_BATCH + 2];
+	int n, i;
+
+	if (eol == NULL) {
+		if (c->in.len - pos > MAX_LINE) {
+			reply (c, "CLIENT_ERROR line too long\r\n");
+			c->closing = 1;
+		}
+		return 0;
+	}
+	size_t used = eol + 1 - line;
+	if (eol > line && eol[-1] == '\r')
+		eol--;
+	*eol = '\0';
+	n = tokenize (line, tokens, MAX_BATCH + 2);
+	if (n == 0) {
+		reply (c, "ERROR\r\n");
+		return used;
+	}
+
+	//The gets are searched together with the next ones.
+	if (!strcmp (tokens[0], "get") || !strcmp (tokens[0], "gets")) {
+		if (batch.n + n - 1 > MAX_BATCH && *gets > 0) {
+			batch_run (c, *gets);
+			*gets = 0;
+		}
+		if (n < 2 || batch.n + n - 1 > MAX_BATCH) {
+			reply (c, "CLIENT_ERROR bad command line format\r\n");
+			return used;
+		}
+		for (i = 1; i < n; i++) {
+			unsigned int k = batch.n++;
+			char *table_key;
+			batch.keys[k] = tokens[i];
+			batch.table[k] = table_of (tokens[i], &table_key);
+			batch.table_keys[k] = table_key;
+			batch.key_sizes[k] = strlen (table_key);
+			batch.command[k] = *gets;
+			batch.cas[k] = tokens[0][3] == 's';
+		}
+		(*gets)++;
+		return used;
+	}
+	//The other commands go after the replies of the gets before them.
+	if (*gets > 0) {
+		batch_run (c, *gets);
+		*gets = 0;
+	}
+
+	if (!strcmp (tokens[0], "set") || !strcmp (tokens[0], "add")
+		|| !strcmp (tokens[0], "replace")) {
+		char *end;
+		if (n < 5 || strlen (tokens[1]) > MAX_KEY) {
+			reply (c, "CLIENT_ERROR bad command line format\r\n");
+			return used;
+		}
+		unsigned long flags = strtoul (tokens[2], NULL, 10);
+		errno = 0;
+		unsigned long bytes = strtoul (tokens[4], &end, 10);
+		int noreply = n > 5 && !strcmp (tokens[5], "noreply");
+		//strtoul takes "-1" as ULONG_MAX.
+		if (*end != '\0' || errno != 0 || tokens[4][0] == '-'
+			|| bytes > INT_MAX - 2) {
+			reply (c, "CLIENT_ERROR bad command line format\r\n");
+			return used;
+		}
+		//The data block of a value too large is discarded as it arrives.
+		if (bytes > conf.value_size) {
+			reply (c, "SERVER_ERROR object too large for cache\r\n");
+			c->swallow = bytes + 2;
+			return used;
+		}
+		//The data block and its "\r\n".
+		if (c->in.len - pos < used + bytes + 2) {
+			//Not yet, the line will be read again.
+			*eol = '\r';
+			for (i = 1; i < n; i++)
+				tokens[i][-1] = ' ';
+			return 0;
+		}
+		store (c, tokens[0], tokens[1], flags, line + used, bytes, noreply);
+		return used + bytes + 2;
+	}
+	if (!strcmp (tokens[0], "delete") && n >= 2) {
+		char *table_key;
+		struct shmht *h = tables[table_of (tokens[1], &table_key)].h;
+		int ret = shmht_remove (h, table_key, strlen (table_key));
+		if (strcmp (tokens[n - 1], "noreply"))
+			buffer_printf (&c->out, ret > 0 ? "DELETED\r\n"
+						   : "NOT_FOUND\r\n");
+		return used;
+	}
+	if (!strcmp (tokens[0], "flush_all")) {
+		for (i = 0; i < ntables; i++)
+			shmht_flush (tables[i].h);
+		if (strcmp (tokens[n - 1], "noreply"))
+			reply (c, "OK\r\n");
+		return used;
+	}
+	if (!strcmp (tokens[0], "stats"))
+		stats (c);
+	else if (!strcmp (tokens[0], "version"))
+		reply (c, "VERSION shmht\r\n");
+	else if (!strcmp (tokens[0], "verbosity"))
+		reply (c, "OK\r\n");
+	else if (!strcmp (tokens[0], "quit"))
+		c->closing = 1;
+	else
+		reply (c, "ERROR\r\n");
+	return used;
+}
+
+//Processes all the complete commands of the input.
+static void
+process (struct conn *c)
+{
+	size_t pos = 0, used;
+	unsigned int gets = 0;
+
+	while (!c->closing && pos < c->in.len) {
+		if (c->swallow > 0) {
+			used = c->in.len - pos < c->swallow ? c->in.len - pos
+				: c->swallow;
+			c->swallow -= used;
+		}
+		else if ((used = command (c, pos, &gets)) == 0)
+			break;
+		pos += used;
+	}
+	if (gets > 0)
+		batch_run (c, gets);
+	memmove (c->in.data, c->in.data + pos, c->in.len - pos);
+	c->in.len -= pos;
+}
+
+/*****************************************************************************/
+static void
+conn_close (int epfd, struct conn *c)
+{
+	epoll_ctl (epfd, EPOLL_CTL_DEL, c->fd, NULL);
+	close (c->fd);
+	free (c->in.data);
+	free (c->out.data);
+	free (c);
+}
+
+//Writes the replies. Returns <0 if the connection must be closed.
+static int
+conn_flush (int epfd, struct conn *c)
+{
+	while (c->sent < c->out.len) {
+		ssize_t n = write (c->fd, c->out.data + c->sent,
+						   c->out.len - c->sent);
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n <= 0)
+			return -1;
+		c->sent += n;
+	}
+	if (c->sent == c->out.len) {
+		c->sent = c->out.len = 0;
+		if (c->closing)
+			return -1;
+	}
+	//Wait for the socket only while the replies don't fit in it.
+	int writing = c->out.len > 0;
+	if (writing == c->writing)
+		return 0;
+	struct epoll_event ev = { writing ? EPOLLOUT : EPOLLIN | EPOLLRDHUP, {c} };
+	c->writing = writing;
+	return epoll_ctl (epfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static int
+conn_read (struct conn *c)
+{
+	for (;;) {
+		if (buffer_reserve (&c->in, READ_SIZE) < 0)
+			return -1;
+		ssize_t n = read (c->fd, c->in.data + c->in.len, READ_SIZE);
+		if (n < 0 && errno == EAGAIN)
+			return 0;
+		if (n <= 0)
+			return -1;
+		c->in.len += n;
+	}
+}
+
+static void
+worker (int listen_fd)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct epoll_event ev = { EPOLLIN | EPOLLEXCLUSIVE, {NULL} };
+	int epfd = epoll_create1 (0);
+	int i, n;
+
+	for (i = 0; i < ntables; i++) {
+		tables[i].h = create_shmht (tables[i].file, conf.entries,
+									conf.value_size + sizeof (unsigned int),
+									shmht_string_hash, shmht_string_eq);
+		if (tables[i].h == NULL)
+			exit (1);
+	}
+	if (epfd < 0 || epoll_ctl (epfd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+		exit (1);
+
+	for (;;) {
+		n = epoll_wait (epfd, events, MAX_EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			struct conn *c = events[i].data.ptr;
+			if (c == NULL) {
+				int fd;
+				while ((fd = accept4 (listen_fd, NULL, NULL,
+									  SOCK_NONBLOCK)) >= 0) {
+					c = calloc (1, sizeof (struct conn));
+					if (c == NULL) {
+						close (fd);
+						continue;
+					}
+					c->fd = fd;
+					ev.events = EPOLLIN | EPOLLRDHUP;
+					ev.data.ptr = c;
+					epoll_ctl (epfd, EPOLL_CTL_ADD, fd, &ev);
+				}
+				continue;
+			}
+			//The commands before the end of the input are processed.
+			int eof = (events[i].events & EPOLLIN) && conn_read (c) < 0;
+			process (c);
+			if (eof)
+				c->closing = 1;
+			if (conn_flush (epfd, c) < 0
+				|| (events[i].events & (EPOLLERR | EPOLLHUP)))
+				conn_close (epfd, c);
+		}
+	}
+}
+
+/*****************************************************************************/
+static volatile sig_atomic_t stop;
+
+static void
+on_signal (int sig)
+{
+	stop = 1;
+}
+
+static void
+usage (char *argv0)
+{
+	fprintf (stderr,
+			 "Usage: %s [options] table...\n"
+			 "  -s socket      path of the Unix socket (/tmp/shmht.sock)\n"
+			 "  -w workers     worker processes (one for each core)\n"
+			 "  -n entries     entries of the new tables (100000)\n"
+			 "  -v value_size  max size of the values (1024)\n"
+			 "  -e percent     evicted when a table is full (10)\n"
+			 "  -f             store the flags in the values\n", argv0);
+	exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct sockaddr_un addr;
+	pid_t pids[MAX_WORKERS];
+	int opt, i;
+
+	while ((opt = getopt (argc, argv, "s:w:n:v:e:f")) != -1) {
+		switch (opt) {
+		case 's':
+			conf.socket = optarg;
+			break;
+		case 'w':
+			conf.workers = atoi (optarg);
+			break;
+		case 'n':
+			conf.entries = atol (optarg);
+			break;
+		case 'v':
+			conf.value_size = atol (optarg);
+			break;
+		case 'e':
+			conf.evict_pct = atoi (optarg);
+			break;
+		case 'f':
+			conf.flags = 1;
+			break;
+		default:
+			usage (argv[0]);
+		}
+	}
+	if (optind == argc || argc - optind > MAX_TABLES
+		|| strlen (conf.socket) >= sizeof (addr.sun_path))
+		usage (argv[0]);
+	if (conf.workers <= 0)
+		conf.workers = sysconf (_SC_NPROCESSORS_ONLN);
+	if (conf.workers > MAX_WORKERS)
+		conf.workers = MAX_WORKERS;
+	for (i = optind; i < argc; i++, ntables++) {
+		char *slash = strrchr (argv[i], '/');
+		tables[ntables].file = argv[i];
+		tables[ntables].name = slash ? slash + 1 : argv[i];
+		//The file must exist for ftok.
+		FILE *f = fopen (argv[i], "a");
+		if (f == NULL) {
+			perror (argv[i]);
+			return 1;
+		}
+		fclose (f);
+	}
+
+	int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	memset (&addr, 0, sizeof (addr));
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, conf.socket);
+	unlink (conf.socket);
+	if (fd < 0 || bind (fd, (struct sockaddr *) &addr, sizeof (addr)) < 0
+		|| listen (fd, 1024) < 0) {
+		perror ("socket: ");
+		return 1;
+	}
+
+	signal (SIGPIPE, SIG_IGN);
+	for (i = 0; i < conf.workers; i++)
+		if ((pids[i] = fork ()) == 0)
+			worker (fd);
+
+	//Without SA_RESTART, so the signals interrupt the wait.
+	struct sigaction sa;
+	memset (&sa, 0, sizeof (sa));
+	sa.sa_handler = on_signal;
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	while (!stop && wait (NULL) > 0);
+	for (i = 0; i < conf.workers; i++)
+		kill (pids[i], SIGTERM);
+	unlink (conf.socket);
+	return 0;
+}
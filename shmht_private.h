@@ -2,10 +2,85 @@
 #define __HASHTABLE_PRIVATE_CWC22_H__
 
 #include "shmht.h"
+#include <sys/types.h>
 
 
 //Max size of a key = > By default 512 bytes.
 #define MAX_KEY_SIZE 512
+
+//The values are stored in a slab allocator: the chunks of a size class grow
+//by SLAB_GROWTH_FACTOR from SLAB_MIN_CHUNK to the registry_max_size, and the
+//pool is given to the classes in pages, when their free lists are empty.
+#define SLAB_MIN_CHUNK 48
+#define SLAB_GROWTH_FACTOR 1.25
+#define SLAB_MAX_CLASSES 128
+#define SLAB_PAGE_SIZE (1024 * 1024)
+//Small pools are splitted at least in this number of pages.
+#define SLAB_MIN_PAGES 256
+//Offset used as NULL in the free lists.
+#define SLAB_NONE ((unsigned long) -1)
+
+//Number of entries of the hash table that shmht_compact processes in each
+//lock hold.
+#define COMPACT_STRIPE 1024
+//Number of entries that shmht_invalidate_tag removes in each lock hold.
+#define TAG_STRIPE 256
+//Bits of the fraction of the cost per byte of SHMHT_EVICT_GDS.
+#define GDS_SHIFT 20
+//Max threads of the maintenance operations (see shmht_maintenance_threads),
+//and entries ahead that their scans prefetch.
+#define MAINTENANCE_MAX_THREADS 64
+#define SCAN_PREFETCH 4
+
+//Slots of stats counters, each process updates the slot of its pid.
+#define STATS_SLOTS 32
+#define CACHE_LINE 64
+#define CACHE_LINE_ALIGN(x) (((x) + CACHE_LINE - 1) & ~(CACHE_LINE - 1))
+
+//Negative lookup filter: counters of each key, size of the blocks, and the
+//value of the counters that are not decremented any more.
+#define FILTER_HASHES 4
+#define FILTER_BLOCK CACHE_LINE
+#define FILTER_MAX 255
+
+//Stripes of keys of the versions for the near caches.
+#define NEAR_STRIPES 4096
+
+//NUMA nodes of the node masks of mbind, and the policy of numaif.h (so the
+//library does not need libnuma).
+#define NUMA_MAX_NODES 1024
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+//Shards of a shmht_set, each one has its own ftok project id (from 2, the
+//ids from 128 give negative keys).
+#define SET_MAX_SHARDS 120
+//Containers of tables (shmht_container_create), with their ftok project id.
+#define CONTAINER_PROJ 127
+#define CONTAINER_MAGIC 0x53485443
+#define CONTAINER_MAX_TABLES 64
+#define CONTAINER_NAME_SIZE 32
+//The other key of a table (ftok project id), where shmht_bulk_begin builds
+//the next generation when the current one is in the key of create_shmht.
+#define BULK_PROJ 126
+
+//Records of the changelog: the padding at the end of the ring, and the value
+//was too big for the changelog.
+#define CHANGELOG_PAD 255
+#define CHANGELOG_NO_VALUE 0x100
+//The records are aligned to its header, so the padding always fits.
+#define CHANGELOG_ALIGN(x) \
+	(((x) + sizeof (struct changelog_record) - 1) & \
+	 ~(sizeof (struct changelog_record) - 1))
+
+//Flags of the entries.
+//The value is stored compressed, bucket_stored_size is the compressed size.
+#define ENTRY_COMPRESSED 1
+//The entry is a lease of shmht_get_or_lock: it has not value, and its bucket
+//is when it expires (milliseconds of CLOCK_MONOTONIC).
+#define ENTRY_LEASE 2
+//There are processes waiting for the lease.
+#define ENTRY_LEASE_WAITERS 4
 /*****************************************************************************/
 
 struct entry
@@ -22,36 +97,244 @@ struct entry
 	unsigned int h;
 	//Offset of the next. (Must be in collisions)
 	unsigned int next;
-	//offset of the bucket where the entry is stored on.
-	int bucket;
+	//offset in the bucket market of the bucket where the entry is stored on.
+	unsigned long bucket;
 	//The size of the stored in the bucket. (This is to allow storing variable size
 	//items, maximun, the size of the bucket). We only copy to the destiny, the
 	//stored size, not all the bucket. [optimization]
 	int bucket_stored_size;
+	//Size of the value (before compression).
+	int value_size;
+	//ENTRY_* flags.
+	unsigned int flags;
 	//Position where the entry is stored on. In the entries and in the colisions.
 	int position;
 	//Seconds from epoch. This is the creation time.
 	//We use this value for deleting the older values, we use seconds, beacause
 	//is an aproximate cleaning (designed for cache pourposes).
 	long sec;
+	//Generation of the table when the entry was stored. If it's not the
+	//current one, the entry was flushed and the slot is free.
+	unsigned int generation;
+	//Tag of shmht_insert_tagged, 0 if it has not. The entries with the tags
+	//of the same head of the tag index are linked, by their ids (see
+	//entry_id), 0 is the end of the list.
+	unsigned int tag;
+	unsigned int tag_prev;
+	unsigned int tag_next;
+	//SHMHT_EVICT_GDS: priority of the entry in the eviction heap, its cost
+	//per byte (in GDS_SHIFT fixed point), the clock of the table when it was
+	//last found (0 if it has not been found since it was placed in the heap)
+	//and its position in the heap.
+	unsigned long priority;
+	unsigned long credit;
+	unsigned long touched;
+	unsigned int heap_pos;
+};
+
+//Head of the list of the entries of the tags of a slot of the tag index. It
+//is empty if it's not of the current generation.
+struct tag_head
+{
+	unsigned int generation;
+	unsigned int first;
 };
 
-//Struct only with the flag of used / not.
+//Header of the chunks of the slab allocator.
 struct bucket
 {
 	int used;
+	//Size class of the chunk.
+	int slab_class;
+	//Offset of the next free chunk of the class, when it's not used.
+	unsigned long next;
+};
+
+struct slab_class
+{
+	//Size of the chunks, including the bucket header.
+	unsigned int chunk_size;
+	//Offset of the first free chunk, SLAB_NONE if there is not.
+	unsigned long free;
+	//Number of chunks in use.
+	unsigned long used;
+};
+
+struct slab_pool
+{
+	//Size of the bucket market (the memory for the chunks).
+	unsigned long size;
+	//Size of the pages given to the classes.
+	unsigned long page_size;
+	//Offset of the first page not given to any class.
+	unsigned long next_page;
+	unsigned int nclasses;
+	struct slab_class classes[SLAB_MAX_CLASSES];
 };
 
 
 
+//Counters of one slot of stats (see struct shmht_stats). They are updated
+//with relaxed atomics, and each slot is in its own cache lines.
+struct stats_slot
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long insert_full;
+	unsigned long insert_nomem;
+	unsigned long insert_invalid;
+	unsigned long removes;
+	unsigned long evictions;
+	unsigned long filter_negatives;
+	unsigned long near_hits;
+	unsigned long max_chain;
+	unsigned long free_scans;
+	unsigned long free_scan_length;
+	unsigned long max_free_scan;
+	unsigned long recoveries;
+} __attribute__ ((aligned (CACHE_LINE)));
+
+//Histograms of the wait and hold times of the lock for each operation.
+struct lock_profile
+{
+	struct shmht_lock_histogram wait[SHMHT_OPS];
+	struct shmht_lock_histogram hold[SHMHT_OPS];
+};
+
+//Copy of a value in the near cache of a process.
+struct near_slot
+{
+	int used;
+	unsigned int hash;
+	size_t key_size;
+	size_t value_size;
+	//Version of the stripe of the key when the value was copied.
+	unsigned int version;
+	//The key and the value, of size bytes.
+	char *data;
+	size_t size;
+};
+
+//Near cache of a process: a direct mapped cache of copies of the values.
+struct near_cache
+{
+	unsigned long nslots;
+	size_t max_value_size;
+	struct near_slot *slots;
+	unsigned long hits;
+	unsigned long misses;
+};
+
+//The changelog: a ring of records, written by the process that holds the
+//write lock and read without locks. The positions only grow, the record of
+//a position is at position % size of the ring.
+struct changelog
+{
+	//Bytes of the ring, after this header.
+	unsigned long size;
+	//Sequence number of the last record.
+	unsigned long seq;
+	//Position of the oldest record.
+	unsigned long tail;
+	//End of the record that is being written, the records before
+	//reserved - size could be overwritten.
+	unsigned long reserved;
+	//End of the last complete record.
+	unsigned long committed;
+};
+
+struct changelog_record
+{
+	unsigned long seq;
+	unsigned int op;
+	//ENTRY_COMPRESSED and CHANGELOG_NO_VALUE.
+	unsigned int flags;
+	unsigned int key_size;
+	unsigned int value_size;
+	//Bytes of the value in the record, after the key.
+	unsigned int stored_size;
+	//Bytes of all the record, a multiple of the header.
+	unsigned int length;
+};
+
+//Mark of an initialized hashtable (and version of the layout).
+#define SHMHT_MAGIC 0x53485413
+
+//Operations of the write intent.
+enum intent_op
+{
+	INTENT_NONE,
+	INTENT_INSERT,
+	INTENT_REMOVE,
+	INTENT_FLUSH,
+	INTENT_COMPACT
+};
+
+//What the holder of the write lock is changing. If the process dies with
+//the lock, SEM_UNDO releases the semaphore, and the next process that takes
+//it finds the write_seq odd, and rolls back or completes the operation of
+//the intent (see recover).
+struct write_intent
+{
+	//Process with the write lock, 0 if there is not.
+	pid_t owner;
+	unsigned int op;
+	//Slot of the chain of the key, and the id (see entry_id) of the entry
+	//inserted or removed, 0 until it's known.
+	unsigned int slot;
+	unsigned int target;
+	//Remove: the id of the previous entry of the chain, 0 for the slot, and
+	//the colision that is moved to the slot, -1 if there is not.
+	unsigned int previous;
+	int moved;
+	//Insert: the entry has been linked in the chain.
+	int linked;
+	//Bucket of the value stored or freed, and tag of the entry.
+	unsigned long bucket;
+	unsigned int tag;
+	unsigned int hash;
+	unsigned int entrycount;
+	//Flush: the generation that is flushed.
+	unsigned int generation;
+};
+
 struct internal_hashtable
 {
+	unsigned int magic;
+	//Size of all the shared memory of the hashtable.
+	unsigned long layout_size;
 	unsigned int tablelength;
 	unsigned int registry_max_size;
 	unsigned int semaphore;
 	unsigned int shmid;
 	unsigned int entrycount;
 	unsigned int primeindex;
+	//Current generation, shmht_flush only increments it.
+	unsigned int generation;
+	//Values of this size or bigger are compressed, 0 if it's disabled.
+	unsigned int compress_threshold;
+	//Bytes of the negative lookup filter, 0 if it's disabled.
+	unsigned long filter_size;
+	//Number of leases of shmht_get_or_lock in the entries.
+	unsigned int leases;
+	//Bytes of the ring of the changelog, 0 if it's disabled.
+	unsigned long changelog_size;
+	//Sequence of the writes, odd while a process has the write lock. The
+	//readers of shmht_attach_ro search without lock, and check it after.
+	unsigned long write_seq;
+	//Key of the shared memory (the one of create_shmht or the bulk key).
+	key_t key;
+	//Set by shmht_bulk_publish when successor (the id of the shared memory
+	//of the next generation) replaces this table.
+	int replaced;
+	int successor;
+	struct write_intent intent;
+	//enum shmht_eviction, and for SHMHT_EVICT_GDS the number of entries of
+	//the heap and the clock (the priority of the last evicted entry).
+	unsigned int eviction;
+	unsigned int heap_size;
+	unsigned long gds_clock;
 };
 
 
@@ -62,7 +345,39 @@ struct shmht
 	void *internal_ht;
 	void *entrypoint;
 	void *collisionentries;
+	void *stats;
+	void *lock_profile;
+	void *versions;
+	//Heads of the tag index, one for each entry.
+	struct tag_head *tags;
+	//Heap of the ids of the entries by their priority, for SHMHT_EVICT_GDS.
+	unsigned int *heap;
+	void *filter;
+	//NULL if there is not changelog.
+	struct changelog *changelog;
+	void *slab;
 	void *bucketmarket;
+	//Slot of stats of this process (a private one for the read only
+	//handles).
+	struct stats_slot *stats_slot;
+	//Attached with shmht_attach_ro: the memory is read only.
+	int readonly;
+	//Keys of the generations of the table, to find the current one. The
+	//bulk_key is -1 for the tables of the sets and the containers.
+	key_t key;
+	key_t bulk_key;
+	//The lock held by the process: the operation, if it's the write lock and
+	//when it was acquired (only with SHMHT_LOCK_PROFILE).
+	int lock_op;
+	int lock_write;
+	unsigned long lock_acquired;
+	//Near cache of the process, NULL if it's not used.
+	struct near_cache *near;
+	//Threads of the maintenance operations of the process.
+	unsigned int threads;
+	//Semaphore of the pool of the container of the table (the tables of a
+	//container share it), -1 if the pool is of the table.
+	int pool_semaphore;
 
 	// Functions related to the data type stored.
 	unsigned int (*hashfn) (void *k);
@@ -70,8 +385,104 @@ struct shmht
 
 };
 
+//A table of a container, its layout is at offset of the container.
+struct container_table
+{
+	char name[CONTAINER_NAME_SIZE];
+	unsigned long offset;
+	unsigned int number;
+	unsigned long filter_size;
+};
+
+//The shared memory of a container:
+//---------------------------------------------------------
+//| container_header | tables ... | slab pool | buckets |
+//---------------------------------------------------------
+//The tables have all the layout of a hashtable but the pool.
+struct container_header
+{
+	unsigned int magic;
+	unsigned int shmid;
+	//Semaphore of the directory of tables and of the pool.
+	unsigned int semaphore;
+	unsigned int ntables;
+	//Offsets of the first free byte for the tables and of the pool.
+	unsigned long tables_used;
+	unsigned long tables_end;
+	unsigned int max_value_size;
+	struct container_table tables[CONTAINER_MAX_TABLES];
+};
+
+struct shmht_container
+{
+	struct container_header *header;
+	void *slab;
+	void *bucketmarket;
+};
+
+//An entry of a bulk load, its value is already in the pool of the new
+//generation. The key follows it, and the next one is aligned.
+struct bulk_record
+{
+	unsigned int hash;
+	unsigned int flags;
+	unsigned long bucket;
+	int stored_size;
+	int value_size;
+	unsigned int key_size;
+	char k[];
+};
+
+//Slot of the table of a record, to place them in the order of the slots.
+struct bulk_item
+{
+	unsigned int index;
+	unsigned long offset;
+};
+
+struct shmht_bulk
+{
+	//The current generation, and the new one (not published yet).
+	struct shmht *table;
+	struct shmht *h;
+	//The records, and their slots.
+	char *records;
+	size_t records_used;
+	size_t records_size;
+	struct bulk_item *items;
+	unsigned long nitems;
+	unsigned long items_size;
+};
+
 /*****************************************************************************/
-static unsigned int hash (struct shmht *h, void *k);
+/*!
+ * @name        __shmht_create__
+ * @param proj  project id of ftok for the key of the shared memory and the
+ *              semaphores, create_shmht uses 1.
+ * @param node  NUMA node where the memory of a new table is bound, -1 for
+ *              the default policy.
+ *
+ * Same as create_shmht_ext, for the shards of the shmht_set, that share the
+ * file of the name.
+ */
+struct shmht *__shmht_create__ (char *name, int proj, int node,
+				unsigned int number, size_t size,
+				unsigned int (*hashfunction) (void *),
+				int (*key_eq_fn) (void *, void *),
+				const struct shmht_options *opts);
+
+/*****************************************************************************/
+/*!
+ * @name        __shmht_attach__
+ * @param name  Name of the existing HashTable.
+ * @param shmflg flags for shmat (SHM_RDONLY to map it read only).
+ * @return      the hashtable, NULL if it does not exist or it's not valid.
+ *
+ * Attaches to an existing hashtable, with the layout stored in it, so it
+ * does not need the sizes. It has not hash functions, it's for the tools that
+ * inspect the hashtable.
+ */
+struct shmht *__shmht_attach__ (char *name, int shmflg);
 
 /*****************************************************************************/
 /* indexFor */
@@ -81,6 +492,34 @@ indexFor (unsigned int tablelength, unsigned int hashvalue)
 	return (hashvalue % tablelength);
 };
 
+/*****************************************************************************/
+/* stats counters of the process */
+#define stat_add(h, name, n) \
+	__atomic_fetch_add (&(h)->stats_slot->name, (n), __ATOMIC_RELAXED)
+
+/* keeps the max value seen, it's approximated under concurrency */
+#define stat_max(h, name, n) \
+	do { \
+		unsigned long *__max = &(h)->stats_slot->name; \
+		if (__atomic_load_n (__max, __ATOMIC_RELAXED) < (n)) \
+			__atomic_store_n (__max, (n), __ATOMIC_RELAXED); \
+	} while (0)
+
+/*****************************************************************************/
+/* entry_in_use: used and not flushed */
+static inline int
+entry_in_use (struct internal_hashtable *iht, struct entry *e)
+{
+	return e->used && e->generation == iht->generation;
+};
+
+/* bucket_at: bucket header from its offset */
+static inline struct bucket *
+bucket_at (struct shmht *h, unsigned long offset)
+{
+	return (struct bucket *) (h->bucketmarket + offset);
+};
+
 
 /*****************************************************************************/
 
@@ -0,0 +1,47 @@
+/*
+ * USDT probes (SystemTap and bpftrace compatible) of the hashtable.
+ *
+ * They are only built with -DSHMHT_USDT, that needs the sys/sdt.h of
+ * systemtap. Each probe is then a nop instruction that the tracers patch when
+ * they are attached, otherwise they are not built at all.
+ *
+ * Provider "shmht", the names with "__" are listed with "-":
+ *  search__entry (key, key_size)           shmht_search and shmht_search_copy
+ *  search__return (key, key_size, ret)
+ *  lookup (hash, chain, found)             chain walked by the searches
+ *  insert__entry (key, key_size, value_size)
+ *  insert__slot (hash, chain, colision)    entry taken, colision is -1 if it
+ *                                          is the primary entry
+ *  insert__return (key, key_size, ret)
+ *  remove__entry (key, key_size)           __shmht_remove__
+ *  remove__return (hash, chain, ret)
+ *  flush__entry ()
+ *  flush__return (generation, ret)
+ *  evict__entry (percent)                  shmht_remove_older_entries
+ *  evict__return (percent, removed)
+ *  lock__entry (op, write)                 op is a SHMHT_OP_*
+ *  lock__return (op, write, ret)
+ *  unlock (op, write)
+ *  free__scan__entry ()                    locate_free_colision_entry
+ *  free__scan__return (length, index)
+ *
+ * Example: bpftrace -e 'usdt:./libshmht.so:shmht:lock__return { ... }'
+ */
+
+#ifndef __HASHTABLE_PROBES__
+#define __HASHTABLE_PROBES__
+
+#ifdef SHMHT_USDT
+#include <sys/sdt.h>
+#define shmht_probe0(name) DTRACE_PROBE (shmht, name)
+#define shmht_probe1(name, a) DTRACE_PROBE1 (shmht, name, a)
+#define shmht_probe2(name, a, b) DTRACE_PROBE2 (shmht, name, a, b)
+#define shmht_probe3(name, a, b, c) DTRACE_PROBE3 (shmht, name, a, b, c)
+#else
+#define shmht_probe0(name)
+#define shmht_probe1(name, a)
+#define shmht_probe2(name, a, b)
+#define shmht_probe3(name, a, b, c)
+#endif
+
+#endif //__HASHTABLE_PROBES__
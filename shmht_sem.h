@@ -1,6 +1,7 @@
 /*
  * This is a R/W lock implementation using the SYS semaphores.
  * Based on http://www.experts-exchange.com/Programming/Languages/C/Q_23939132.html
+ * The timed locks use semtimedop, so it must be included with _GNU_SOURCE.
  */
 
 
@@ -10,25 +11,28 @@
 #include <sys/types.h>
 #include <sys/ipc.h>
 #include <sys/sem.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
 
 #define SEM_READER 0
 #define SEM_WRITER 1
 
-struct sembuf read_start[] =
+static struct sembuf read_start[] =
 	{ {SEM_READER, 1, SEM_UNDO}, {SEM_WRITER, 0, SEM_UNDO} };
-struct sembuf read_end[] = { {SEM_READER, -1, SEM_UNDO} };
+static struct sembuf read_end[] = { {SEM_READER, -1, SEM_UNDO} };
 
-struct sembuf write_start1[] = { {SEM_WRITER, 1, SEM_UNDO} };
-struct sembuf write_start2[] =
+static struct sembuf write_start1[] = { {SEM_WRITER, 1, SEM_UNDO} };
+static struct sembuf write_start2[] =
 	{ {SEM_READER, 0, SEM_UNDO}, {SEM_READER, 1, SEM_UNDO} };
-struct sembuf write_fail_end[] = { {SEM_WRITER, -1, SEM_UNDO} };
-struct sembuf write_end[] =
+static struct sembuf write_fail_end[] = { {SEM_WRITER, -1, SEM_UNDO} };
+static struct sembuf write_end[] =
 	{ {SEM_READER, -1, SEM_UNDO}, {SEM_WRITER, -1, SEM_UNDO} };
 
 #define SEMOP(semid,tbl,exc) { if(0>semop (semid, tbl, sizeof(tbl)/sizeof(struct sembuf) )){perror("semop: ");return exc;}}
 
 //Necessary stuff for locking.
-int
+static inline int
 write_end_proc (int semid)
 {
 	SEMOP (semid, write_fail_end, 0);
@@ -46,21 +50,21 @@ write_end_proc (int semid)
 
 #define WRITE_UNLOCK(semid) SEMOP(semid,write_end, -1)
 
-int
+static inline int
 read_lock (int semid)
 {
 	READ_LOCK (semid);
 	return 0;
 }
 
-int
+static inline int
 read_unlock (int semid)
 {
 	READ_UNLOCK (semid);
 	return 0;
 }
 
-int
+static inline int
 write_lock (int semid)
 {
 	WRITE_LOCK_READERS (semid);
@@ -68,11 +72,70 @@ write_lock (int semid)
 	return 0;
 }
 
-int
+static inline int
 write_unlock (int semid)
 {
 	WRITE_UNLOCK (semid);
 	return 0;
 }
 
+//The same locks, waiting for the timeout at most (relative, and a zeroed one
+//does not wait at all). They return -1 with errno EAGAIN if the lock is not
+//acquired in time, without printing the error.
+static inline int
+sem_timed (int semid, struct sembuf *tbl, size_t n,
+		   const struct timespec *timeout)
+{
+	struct sembuf ops[2];
+	size_t i;
+	for (i = 0; i < n; i++) {
+		ops[i] = tbl[i];
+		if (timeout->tv_sec == 0 && timeout->tv_nsec == 0)
+			ops[i].sem_flg |= IPC_NOWAIT;
+	}
+	return semtimedop (semid, ops, n, timeout);
+}
+
+#define SEMOP_TIMED(semid,tbl,timeout) \
+	sem_timed (semid, tbl, sizeof (tbl) / sizeof (struct sembuf), timeout)
+
+static inline int
+read_lock_timed (int semid, const struct timespec *timeout)
+{
+	return SEMOP_TIMED (semid, read_start, timeout) < 0 ? -1 : 0;
+}
+
+static inline int
+write_lock_timed (int semid, const struct timespec *timeout)
+{
+	//The first step never waits, only the second one can time out, and then
+	//the first one must be undone.
+	if (SEMOP_TIMED (semid, write_start1, timeout) < 0)
+		return -1;
+	if (SEMOP_TIMED (semid, write_start2, timeout) < 0) {
+		int error = errno;
+		write_end_proc (semid);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+//A mutex with the semaphore num of the set (0 is unlocked).
+static inline int
+mutex_lock (int semid, unsigned short num)
+{
+	struct sembuf lock[] = { {num, 0, 0}, {num, 1, SEM_UNDO} };
+	SEMOP (semid, lock, -1);
+	return 0;
+}
+
+static inline int
+mutex_unlock (int semid, unsigned short num)
+{
+	struct sembuf unlock[] = { {num, -1, SEM_UNDO} };
+	SEMOP (semid, unlock, -1);
+	return 0;
+}
+
 #endif // __HASHTABLE_SEM__
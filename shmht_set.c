@@ -0,0 +1,243 @@
+/*
+ * Sets of hashtables sharded by the hash of the keys, each shard in the
+ * memory of a NUMA node (see shmht_set_create).
+ */
+#define _GNU_SOURCE
+#include "shmht.h"
+#include "shmht_private.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+struct shmht_set
+{
+	unsigned int nshards;
+	int replicate;
+	//Copy of the node of the process, with replicate.
+	unsigned int local;
+	unsigned int (*hashfn) (void *k);
+	struct shmht *shards[];
+};
+
+/*****************************************************************************/
+//Number of NUMA nodes of the system (the last online node + 1), 1 if the
+//system has not NUMA.
+static unsigned int
+numa_nodes (void)
+{
+	char buf[256];
+	int last = 0;
+	FILE *f = fopen ("/sys/devices/system/node/online", "r");
+
+	if (f == NULL)
+		return 1;
+	if (fgets (buf, sizeof (buf), f) != NULL) {
+		//As "0", "0-3" or "0,2-3".
+		char *p = buf + strcspn (buf, "\n");
+		while (p > buf && p[-1] >= '0' && p[-1] <= '9')
+			p--;
+		last = atoi (p);
+	}
+	fclose (f);
+	return last >= 0 && last < NUMA_MAX_NODES ? last + 1 : 1;
+}								// numa_nodes
+
+//The node of the cpu where the process is running now.
+static unsigned int
+local_node (void)
+{
+	unsigned int cpu, node;
+	if (syscall (SYS_getcpu, &cpu, &node, NULL) < 0)
+		return 0;
+	return node;
+}								// local_node
+
+/*****************************************************************************/
+static inline struct shmht *
+shard_of (struct shmht_set *s, unsigned int hashvalue)
+{
+	if (s->replicate)
+		return s->shards[s->local];
+	//The high bits of a multiplicative hash, as the tables use the modulo of
+	//the hash.
+	return s->shards[((unsigned long) (hashvalue * 0x9e3779b1u) *
+					  s->nshards) >> 32];
+}								// shard_of
+
+/*****************************************************************************/
+struct shmht_set *
+shmht_set_create (char *name, unsigned int number, size_t size,
+				  unsigned int (*hashf) (void *), int (*eqf) (void *, void *),
+				  const struct shmht_set_options *opts)
+{
+	unsigned int nodes = numa_nodes ();
+	unsigned int nshards = opts && opts->shards ? opts->shards : nodes;
+	int replicate = opts ? opts->replicate : 0;
+	unsigned int i;
+
+	if (replicate)
+		nshards = nodes;
+	if (nshards > SET_MAX_SHARDS)
+		return NULL;
+
+	struct shmht_set *s = malloc (sizeof (struct shmht_set) +
+								  nshards * sizeof (struct shmht *));
+	if (s == NULL)
+		return NULL;
+	s->nshards = nshards;
+	s->replicate = replicate;
+	s->local = local_node () % nshards;
+	s->hashfn = hashf;
+
+	if (!replicate)
+		number = (number + nshards - 1) / nshards;
+	for (i = 0; i < nshards; i++) {
+		//The project id 1 is the one of create_shmht.
+		s->shards[i] = __shmht_create__ (name, i + 2, nodes > 1 ?
+										 (int) (i % nodes) : -1, number,
+										 size, hashf, eqf,
+										 opts ? opts->table : NULL);
+		if (s->shards[i] == NULL) {
+			s->nshards = i;
+			shmht_set_close (s);
+			return NULL;
+		}
+	}
+	return s;
+}								// shmht_set_create
+
+/*****************************************************************************/
+struct shmht *
+shmht_set_shard (struct shmht_set *s, void *k, size_t key_size)
+{
+	//The hash functions only take the key.
+	(void) key_size;
+	return shard_of (s, s->hashfn (k));
+}								// shmht_set_shard
+
+/*****************************************************************************/
+int
+shmht_set_insert (struct shmht_set *s, void *k, size_t key_size, void *v,
+				  size_t value_size)
+{
+	unsigned int hashvalue = s->hashfn (k);
+	unsigned int i, j;
+	int ret = 0;
+
+	if (!s->replicate)
+		return shmht_insert_hashed (shard_of (s, hashvalue), hashvalue, k,
+									key_size, v, value_size);
+
+	for (i = 0; i < s->nshards; i++) {
+		ret = shmht_insert_hashed (s->shards[i], hashvalue, k, key_size, v,
+								   value_size);
+		if (ret <= 0) {
+			//All the copies must have the same keys.
+			for (j = 0; j < i; j++)
+				shmht_remove_hashed (s->shards[j], hashvalue, k, key_size);
+			return ret;
+		}
+	}
+	return ret;
+}								// shmht_set_insert
+
+/*****************************************************************************/
+void *
+shmht_set_search (struct shmht_set *s, void *k, size_t key_size,
+				  size_t * returned_size)
+{
+	unsigned int hashvalue = s->hashfn (k);
+	return shmht_search_hashed (shard_of (s, hashvalue), hashvalue, k,
+								key_size, returned_size);
+}								// shmht_set_search
+
+/*****************************************************************************/
+int
+shmht_set_search_copy (struct shmht_set *s, void *k, size_t key_size,
+					   void *v, size_t * value_size)
+{
+	unsigned int hashvalue = s->hashfn (k);
+	return shmht_search_copy_hashed (shard_of (s, hashvalue), hashvalue, k,
+									 key_size, v, value_size);
+}								// shmht_set_search_copy
+
+/*****************************************************************************/
+int
+shmht_set_remove (struct shmht_set *s, void *k, size_t key_size)
+{
+	unsigned int hashvalue = s->hashfn (k);
+	unsigned int i;
+	int ret, local = 0;
+
+	if (!s->replicate)
+		return shmht_remove_hashed (shard_of (s, hashvalue), hashvalue, k,
+									key_size);
+
+	for (i = 0; i < s->nshards; i++) {
+		ret = shmht_remove_hashed (s->shards[i], hashvalue, k, key_size);
+		if (ret < 0)
+			return ret;
+		if (i == s->local)
+			local = ret;
+	}
+	return local;
+}								// shmht_set_remove
+
+/*****************************************************************************/
+int
+shmht_set_count (struct shmht_set *s)
+{
+	unsigned int i;
+	int ret, count = 0;
+
+	if (s->replicate)
+		return shmht_count (s->shards[s->local]);
+	for (i = 0; i < s->nshards; i++) {
+		ret = shmht_count (s->shards[i]);
+		if (ret < 0)
+			return ret;
+		count += ret;
+	}
+	return count;
+}								// shmht_set_count
+
+/*****************************************************************************/
+int
+shmht_set_flush (struct shmht_set *s)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < s->nshards; i++) {
+		ret = shmht_flush (s->shards[i]);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}								// shmht_set_flush
+
+/*****************************************************************************/
+void
+shmht_set_close (struct shmht_set *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->nshards; i++)
+		free (s->shards[i]);
+	free (s);
+}								// shmht_set_close
+
+/*****************************************************************************/
+int
+shmht_set_destroy (struct shmht_set *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->nshards; i++)
+		shmht_destroy (s->shards[i]);
+	shmht_set_close (s);
+	return 0;
+}								// shmht_set_destroy
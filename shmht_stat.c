@@ -0,0 +1,240 @@
+/*
+ * shmht-stat: inspects a live hashtable.
+ *
+ * It attaches the shared memory read only, and reads the entries with the
+ * read lock, a stripe of entries each time, so it can be used with the
+ * production caches.
+ *
+ * Usage: shmht-stat [-r seconds] name
+ *  -r  refreshes the report each number of seconds, as top.
+ */
+//For semtimedop.
+#define _GNU_SOURCE
+#include "shmht.h"
+#include "shmht_private.h"
+#include "shmht_sem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <time.h>
+#include <unistd.h>
+
+//Number of entries of the hashtable read in each lock hold.
+#define STAT_STRIPE 4096
+//Chains of this length or longer are counted together.
+#define STAT_MAX_CHAIN 8
+#define STAT_FILL_BUCKETS 10
+
+static const long age_limits[] = { 1, 10, 60, 600, 3600, 86400 };
+static const char *age_names[] =
+	{ "<1s", "<10s", "<1m", "<10m", "<1h", "<1d", ">=1d" };
+#define STAT_AGES (sizeof (age_names) / sizeof (age_names[0]))
+
+struct report
+{
+	unsigned long entries;
+	unsigned long primary_used;
+	unsigned long colision_used;
+	unsigned long chains[STAT_MAX_CHAIN + 1];
+	//Fill of the values against the registry_max_size, the last one are
+	//the chained values.
+	unsigned long fill[STAT_FILL_BUCKETS + 1];
+	unsigned long ages[STAT_AGES];
+	unsigned long compressed;
+	unsigned long value_bytes;
+	unsigned long stored_bytes;
+	unsigned long key_padding;
+	unsigned long value_padding;
+};
+
+//Accounts an entry. The caller holds the read lock.
+static void
+account_entry (struct shmht *h, struct entry *e, long now, struct report *r)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct slab_pool *pool = h->slab;
+	//The leases have not value.
+	unsigned long offset = (e->flags & ENTRY_LEASE) ? SLAB_NONE : e->bucket;
+	unsigned long allocated = 0;
+	long age = now - e->sec;
+	int i;
+
+	r->entries++;
+	r->key_padding += MAX_KEY_SIZE - e->key_size;
+	r->value_bytes += e->value_size;
+	r->stored_bytes += e->bucket_stored_size;
+	if (e->flags & ENTRY_COMPRESSED)
+		r->compressed++;
+
+	//The memory of all the buckets of the value.
+	while (offset != SLAB_NONE && offset < pool->size) {
+		struct bucket *b = bucket_at (h, offset);
+		if (b->slab_class < 0 || b->slab_class >= pool->nclasses)
+			break;
+		allocated += pool->classes[b->slab_class].chunk_size -
+			sizeof (struct bucket);
+		offset = b->next;
+	}
+	if (allocated > e->bucket_stored_size)
+		r->value_padding += allocated - e->bucket_stored_size;
+
+	if (e->bucket_stored_size > iht->registry_max_size)
+		r->fill[STAT_FILL_BUCKETS]++;
+	else if (iht->registry_max_size > 0) {
+		i = (unsigned long) e->bucket_stored_size * STAT_FILL_BUCKETS /
+			iht->registry_max_size;
+		r->fill[i < STAT_FILL_BUCKETS ? i : STAT_FILL_BUCKETS - 1]++;
+	}
+
+	for (i = 0; i < STAT_AGES - 1 && age >= age_limits[i]; i++);
+	r->ages[i]++;
+}
+
+//Reads all the hashtable, locking it for each stripe.
+static int
+collect (struct shmht *h, struct report *r)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	unsigned int first, i;
+
+	memset (r, 0, sizeof (struct report));
+	for (first = 0; first < iht->tablelength; first += STAT_STRIPE) {
+		long now = time (NULL);
+		if (read_lock (iht->semaphore) < 0)
+			return -1;
+		for (i = first; i < first + STAT_STRIPE && i < iht->tablelength; i++) {
+			struct entry *e = h->entrypoint + (i * sizeof (struct entry));
+			unsigned int chain = 0;
+			if (!entry_in_use (iht, e)) {
+				r->chains[0]++;
+				continue;
+			}
+			r->primary_used++;
+			while (e != NULL && entry_in_use (iht, e)) {
+				account_entry (h, e, now, r);
+				chain++;
+				//A broken chain must not loop forever.
+				e = (e->next != -1 && e->next < iht->tablelength
+					 && chain <= iht->tablelength) ?
+					h->collisionentries + (e->next * sizeof (struct entry))
+					: NULL;
+			}
+			r->colision_used += chain - 1;
+			r->chains[chain < STAT_MAX_CHAIN ? chain : STAT_MAX_CHAIN]++;
+		}
+		read_unlock (iht->semaphore);
+	}
+	return 0;
+}
+
+static double
+percent (unsigned long a, unsigned long b)
+{
+	return b ? 100.0 * a / b : 0.0;
+}
+
+static void
+print_report (char *name, struct shmht *h, struct report *r)
+{
+	struct internal_hashtable *iht = h->internal_ht;
+	struct slab_pool *pool = h->slab;
+	struct shmht_stats stats;
+	unsigned int i;
+
+	printf ("hashtable %s: %u entries of %u bytes max, %lu bytes of memory\n",
+			name, iht->tablelength, iht->registry_max_size,
+			iht->layout_size);
+	printf ("entries: %lu (load factor %.1f%%)\n", r->entries,
+			percent (r->entries, iht->tablelength));
+	printf ("primary used: %lu (%.1f%%)  colision used: %lu (%.1f%%)\n",
+			r->primary_used, percent (r->primary_used, iht->tablelength),
+			r->colision_used, percent (r->colision_used, iht->tablelength));
+
+	printf ("chain length:");
+	for (i = 0; i <= STAT_MAX_CHAIN; i++)
+		printf (" %s%u:%lu", i == STAT_MAX_CHAIN ? ">=" : "", i,
+				r->chains[i]);
+	printf ("\n");
+
+	printf ("bucket fill (stored size / max size):");
+	for (i = 0; i < STAT_FILL_BUCKETS; i++)
+		printf (" <%u%%:%lu", (i + 1) * 100 / STAT_FILL_BUCKETS, r->fill[i]);
+	printf (" chained:%lu\n", r->fill[STAT_FILL_BUCKETS]);
+
+	printf ("entry age:");
+	for (i = 0; i < STAT_AGES; i++)
+		printf (" %s:%lu", age_names[i], r->ages[i]);
+	printf ("\n");
+
+	printf ("values: %lu bytes, %lu stored (%lu compressed values)\n",
+			r->value_bytes, r->stored_bytes, r->compressed);
+	printf ("padding: keys %lu bytes, values %lu bytes\n",
+			r->key_padding, r->value_padding);
+
+	printf ("slab: %lu of %lu bytes in pages of %lu\n", pool->next_page,
+			pool->size, pool->page_size);
+	for (i = 0; i < pool->nclasses; i++)
+		if (pool->classes[i].used)
+			printf ("  class %2u: chunks of %6u bytes, %lu used\n", i,
+					pool->classes[i].chunk_size, pool->classes[i].used);
+
+	if (h->changelog != NULL)
+		printf ("changelog: %lu bytes, %lu changes\n", iht->changelog_size,
+				h->changelog->seq);
+
+	if (shmht_stats (h, &stats) == 0)
+		printf ("ops: hits %lu misses %lu inserts %lu (failed: full %lu, "
+				"memory %lu, invalid %lu) removes %lu evictions %lu\n"
+				"filter: %lu bytes, %lu misses without lock\n"
+				"max chain %lu, free colision scans %lu (avg %.1f, "
+				"max %lu)\nrecoveries %lu\n",
+				stats.hits, stats.misses, stats.inserts, stats.insert_full,
+				stats.insert_nomem, stats.insert_invalid, stats.removes,
+				stats.evictions, iht->filter_size, stats.filter_negatives,
+				stats.max_chain, stats.free_scans,
+				stats.free_scans ? (double) stats.free_scan_length /
+				stats.free_scans : 0.0, stats.max_free_scan, stats.recoveries);
+}
+
+static void
+usage (char *argv0)
+{
+	fprintf (stderr, "Usage: %s [-r seconds] name\n", argv0);
+	exit (2);
+}
+
+int
+main (int argc, char *argv[])
+{
+	int refresh = 0;
+	int opt;
+	struct report r;
+
+	while ((opt = getopt (argc, argv, "r:")) != -1) {
+		if (opt == 'r')
+			refresh = atoi (optarg);
+		else
+			usage (argv[0]);
+	}
+	if (optind != argc - 1)
+		usage (argv[0]);
+
+	struct shmht *h = __shmht_attach__ (argv[optind], SHM_RDONLY);
+	if (h == NULL) {
+		fprintf (stderr, "%s: not a hashtable\n", argv[optind]);
+		return 1;
+	}
+
+	do {
+		if (collect (h, &r) < 0)
+			return 1;
+		if (refresh > 0)
+			//Clear the screen.
+			printf ("\033[H\033[2J");
+		print_report (argv[optind], h, &r);
+		fflush (stdout);
+	} while (refresh > 0 && sleep (refresh) == 0);
+
+	return 0;
+}
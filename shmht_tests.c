@@ -5,6 +5,16 @@
 #include <stdio.h>
 #include <cgreen/cgreen.h>
 #include <math.h>
+#include <errno.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+//Same as MAX_KEY_SIZE of shmht_private.h
+#define MAX_KEY_SIZE_FOR_TEST 512
 
 /*dbj2 hash function:*/
 unsigned int
@@ -281,6 +291,1727 @@ test_check_flush ()
 
 }								// test_check_flush
 
+/*
+ * \test-name check_insert_after_flush
+ * \test-function test_check_insert_after_flush
+ */
+void
+test_check_insert_after_flush ()
+{
+	char *key = "Key_for_test_insert_after_flush";
+	char *other_key = "Other_key_for_test_insert_after_flush";
+	char *stored_value = "This is the stored Value!";
+	size_t key_size = 100;
+	size_t ret_size;
+	int i;
+
+	//Create a shmht.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+
+	//Insert a value until all is over.
+	for (i = 0; i < 100; i++) {
+		int shmht_insert_ret = shmht_insert (h, key, strlen (key)
+											 , stored_value,
+											 strlen (stored_value) + 1);
+		if (shmht_insert_ret < 0) {
+			//Insert until there is no more space.
+			break;
+		}
+	}
+
+	assert_true (shmht_flush (h) == 0);
+
+	//The flushed entries are not found any more.
+	assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+
+	//And all the space is available again.
+	for (i = 0; i < 100; i++) {
+		int shmht_insert_ret = shmht_insert (h, other_key, strlen (other_key)
+											 , stored_value,
+											 strlen (stored_value) + 1);
+		if (shmht_insert_ret < 0) {
+			//Insert until there is no more space.
+			break;
+		}
+	}
+	assert_true (i > 16);
+	assert_equal (shmht_count (h), i);
+	assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	assert_not_equal (shmht_search (h, other_key, strlen (other_key),
+									&ret_size), NULL);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_insert_after_flush
+
+/*
+ * \test-name check_small_values_in_pool
+ * \test-function test_check_small_values_in_pool
+ */
+void
+test_check_small_values_in_pool ()
+{
+	char key[32];
+	char stored_value[40];
+	char big_value[4000];
+	struct shmht_options opts;
+	size_t ret_size;
+	int i;
+
+	//A pool of 64KB for a table of 1000 entries of up to 4KB.
+	memset (&opts, 0, sizeof (opts));
+	opts.pool_size = 64 * 1024;
+	struct shmht *h = create_shmht_ext ("run_tests", 1000, 4096,
+										dbj2_hash, str_compar, &opts);
+	assert_not_equal (h, NULL);
+
+	//The small values only take a small chunk of the pool.
+	memset (stored_value, 'v', sizeof (stored_value));
+	for (i = 0; i < 500; i++) {
+		sprintf (key, "small_key_%d", i);
+		assert_true (shmht_insert (h, key, strlen (key), stored_value,
+								   sizeof (stored_value)) > 0);
+	}
+	assert_equal (shmht_count (h), 500);
+
+	sprintf (key, "small_key_%d", 123);
+	assert_not_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	assert_equal (ret_size, sizeof (stored_value));
+
+	//The big ones fill the rest of the pool.
+	memset (big_value, 'b', sizeof (big_value));
+	for (i = 0; i < 100; i++) {
+		sprintf (key, "big_key_%d", i);
+		if (shmht_insert (h, key, strlen (key), big_value,
+						  sizeof (big_value)) < 0)
+			break;
+	}
+	assert_true (i > 0);
+	assert_true (i < 16);
+
+	//Values bigger than the max size are not allowed.
+	char too_big[4097];
+	assert_true (shmht_insert (h, "too_big", 7, too_big,
+							   sizeof (too_big)) < 0);
+
+	//Removing a small value makes space only for small values.
+	sprintf (key, "small_key_%d", 0);
+	assert_equal (shmht_remove (h, key, strlen (key)), 1);
+	assert_true (shmht_insert (h, "small_again", 11, stored_value,
+							   sizeof (stored_value)) > 0);
+
+	//Other process with other max size uses the one of the table.
+	struct shmht *h2 = create_shmht ("run_tests", 10, 64, dbj2_hash,
+									 str_compar);
+	assert_not_equal (h2, NULL);
+	sprintf (key, "big_key_%d", 0);
+	assert_not_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	assert_equal (ret_size, sizeof (big_value));
+	assert_not_equal (shmht_search (h2, key, strlen (key), &ret_size), NULL);
+	free (h2);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_small_values_in_pool
+
+/*
+ * \test-name check_values_bigger_than_buckets
+ * \test-function test_check_values_bigger_than_buckets
+ */
+void
+test_check_values_bigger_than_buckets ()
+{
+	char *key = "Key_for_test_bigger_values";
+	char big_value[10000];
+	char ret_value[10000];
+	size_t key_size = 100;
+	size_t ret_size;
+	int i;
+
+	//Create a shmht.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+
+	for (i = 0; i < sizeof (big_value); i++)
+		big_value[i] = i % 251;
+
+	//Too big for the whole table.
+	assert_true (shmht_insert (h, key, strlen (key), big_value,
+							   sizeof (big_value)) < 0);
+
+	//Fits in a chain of buckets.
+	assert_true (shmht_insert (h, key, strlen (key), big_value, 1000) > 0);
+
+	//Only can be copied, the search returns its size.
+	assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	assert_equal (ret_size, 1000);
+	assert_equal (shmht_search (h, "other", 5, &ret_size), NULL);
+	assert_equal (ret_size, 0);
+
+	ret_size = 999;
+	assert_equal (shmht_search_copy (h, key, strlen (key), ret_value,
+									 &ret_size), -ENOSPC);
+	assert_equal (ret_size, 1000);
+
+	ret_size = sizeof (ret_value);
+	assert_equal (shmht_search_copy (h, key, strlen (key), ret_value,
+									 &ret_size), 1);
+	assert_equal (ret_size, 1000);
+	assert_true (!memcmp (ret_value, big_value, 1000));
+
+	//The removal frees all the chain, so it can be inserted again.
+	assert_equal (shmht_remove (h, key, strlen (key)), 1);
+	for (i = 0; i < 3; i++) {
+		assert_true (shmht_insert (h, key, strlen (key), big_value,
+								   1000) > 0);
+		assert_equal (shmht_remove (h, key, strlen (key)), 1);
+	}
+	assert_equal (shmht_count (h), 0);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_values_bigger_than_buckets
+
+/*
+ * \test-name check_compressed_values
+ * \test-function test_check_compressed_values
+ */
+void
+test_check_compressed_values ()
+{
+	char *key = "Key_for_test_compressed";
+	char *raw_key = "Key_for_test_not_compressed";
+	char json_value[2000];
+	char random_value[300];
+	char ret_value[2000];
+	struct shmht_options opts;
+	size_t ret_size;
+	int i;
+
+	memset (&opts, 0, sizeof (opts));
+	opts.compress_threshold = 64;
+	struct shmht *h = create_shmht_ext ("run_tests", 16, 512,
+										dbj2_hash, str_compar, &opts);
+	assert_not_equal (h, NULL);
+
+	for (i = 0; i < sizeof (json_value); i++)
+		json_value[i] = "{\"id\": 1234, \"name\": \"value\"}, "[i % 32];
+	for (i = 0; i < sizeof (random_value); i++)
+		random_value[i] = random ();
+
+	//Compressed, it fits in one bucket.
+	assert_true (shmht_insert (h, key, strlen (key), json_value,
+							   sizeof (json_value)) > 0);
+	assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	assert_equal (ret_size, sizeof (json_value));
+	ret_size = sizeof (ret_value);
+	assert_equal (shmht_search_copy (h, key, strlen (key), ret_value,
+									 &ret_size), 1);
+	assert_equal (ret_size, sizeof (json_value));
+	assert_true (!memcmp (ret_value, json_value, sizeof (json_value)));
+
+	//The size needed is the uncompressed one.
+	ret_size = 100;
+	assert_equal (shmht_search_copy (h, key, strlen (key), ret_value,
+									 &ret_size), -ENOSPC);
+	assert_equal (ret_size, sizeof (json_value));
+
+	//Not compressible, stored as it is.
+	assert_true (shmht_insert (h, raw_key, strlen (raw_key), random_value,
+							   sizeof (random_value)) > 0);
+	void *ret = shmht_search (h, raw_key, strlen (raw_key), &ret_size);
+	assert_not_equal (ret, NULL);
+	assert_equal (ret_size, sizeof (random_value));
+	assert_true (!memcmp (ret, random_value, sizeof (random_value)));
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_compressed_values
+
+/*
+ * \test-name check_compact
+ * \test-function test_check_compact
+ */
+void
+test_check_compact ()
+{
+	char key[32];
+	char stored_value[32];
+	char ret_value[32];
+	size_t key_size = 100;
+	size_t ret_size;
+	int i, inserted;
+
+	//Create a shmht.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+
+	//Fill the table.
+	for (inserted = 0; inserted < 100; inserted++) {
+		sprintf (key, "compact_key_%d", inserted);
+		sprintf (stored_value, "value_%d", inserted);
+		if (shmht_insert (h, key, strlen (key) + 1, stored_value,
+						  strlen (stored_value) + 1) < 0)
+			break;
+	}
+
+	//Remove the half of them, leaving holes everywhere.
+	for (i = 0; i < inserted; i += 2) {
+		sprintf (key, "compact_key_%d", i);
+		assert_equal (shmht_remove (h, key, strlen (key) + 1), 1);
+	}
+
+	assert_true (shmht_compact (h) > 0);
+
+	//All the others are still there, with their values.
+	assert_equal (shmht_count (h), inserted / 2);
+	for (i = 1; i < inserted; i += 2) {
+		sprintf (key, "compact_key_%d", i);
+		sprintf (stored_value, "value_%d", i);
+		ret_size = sizeof (ret_value);
+		assert_equal (shmht_search_copy (h, key, strlen (key) + 1,
+										 ret_value, &ret_size), 1);
+		assert_true (!strcmp (ret_value, stored_value));
+	}
+
+	//A second compaction has nothing to move.
+	assert_equal (shmht_compact (h), 0);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_compact
+
+/*
+ * \test-name check_hashed_variants
+ * \test-function test_check_hashed_variants
+ */
+void
+test_check_hashed_variants ()
+{
+	char *key = "Key_for_test_hashed_variants";
+	char *stored_value = "This is the stored Value!";
+	char copy[100];
+	size_t key_size = 100;
+	size_t ret_size = sizeof (copy);
+
+	//Create a shmht.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+
+	//With the hash of the hash function, they are the same entries.
+	assert_true (shmht_insert_hashed (h, dbj2_hash (key), key, strlen (key),
+									  stored_value,
+									  strlen (stored_value) + 1) > 0);
+	assert_true (!strcmp (shmht_search (h, key, strlen (key), &ret_size),
+						  stored_value));
+	assert_true (!strcmp (shmht_search_hashed (h, dbj2_hash (key), key,
+											   strlen (key), &ret_size),
+						  stored_value));
+	ret_size = sizeof (copy);
+	assert_equal (shmht_search_copy_hashed (h, dbj2_hash (key), key,
+											strlen (key), copy, &ret_size), 1);
+	assert_true (!strcmp (copy, stored_value));
+	//Another hash does not find it.
+	assert_equal (shmht_search_hashed (h, dbj2_hash (key) + 1, key,
+									   strlen (key), &ret_size), NULL);
+	assert_equal (shmht_remove_hashed (h, dbj2_hash (key), key, strlen (key)),
+				  1);
+	assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_hashed_variants
+
+/*
+ * \test-name check_try_variants
+ * \test-function test_check_try_variants
+ */
+void
+test_check_try_variants ()
+{
+	char *key = "Key_for_test_try_variants";
+	char *stored_value = "This is the stored Value!";
+	char copy[100];
+	size_t key_size = 100;
+	size_t ret_size = sizeof (copy);
+	struct timespec start, deadline, end;
+	//The write lock of other process (as in shmht_sem.h, without undo).
+	struct sembuf write_start[] = { {1, 1, 0}, {0, 1, 0} };
+	struct sembuf write_end[] = { {0, -1, 0}, {1, -1, 0} };
+
+	//Create a shmht.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+	int semaphore = semget (ftok ("run_tests", 1), 2, 0666);
+	assert_true (semaphore >= 0);
+
+	assert_equal (shmht_try_insert (h, key, strlen (key), stored_value,
+									strlen (stored_value) + 1), 1);
+	assert_equal (shmht_try_search (h, key, strlen (key), copy, &ret_size),
+				  1);
+
+	//Other process holds the lock.
+	assert_equal (semop (semaphore, write_start, 2), 0);
+	assert_equal (shmht_try_search (h, key, strlen (key), copy, &ret_size),
+				  -EAGAIN);
+	assert_equal (shmht_try_insert (h, "Other", 5, stored_value,
+									strlen (stored_value) + 1), -EAGAIN);
+	assert_equal (shmht_try_remove (h, key, strlen (key)), -EAGAIN);
+	clock_gettime (CLOCK_MONOTONIC, &start);
+	deadline = start;
+	deadline.tv_nsec += 50000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	assert_equal (shmht_timed_search (h, key, strlen (key), copy, &ret_size,
+									  &deadline), -EAGAIN);
+	assert_equal (shmht_timed_remove (h, key, strlen (key), &deadline),
+				  -EAGAIN);
+	clock_gettime (CLOCK_MONOTONIC, &end);
+	//It has waited until the deadline.
+	assert_true ((end.tv_sec - start.tv_sec) * 1000 +
+				 (end.tv_nsec - start.tv_nsec) / 1000000 >= 40);
+	assert_equal (semop (semaphore, write_end, 2), 0);
+
+	//The failed writers have not left the lock taken.
+	ret_size = sizeof (copy);
+	assert_equal (shmht_try_search (h, key, strlen (key), copy, &ret_size),
+				  1);
+	assert_true (!strcmp (copy, stored_value));
+	assert_equal (shmht_timed_remove (h, key, strlen (key), &deadline), 1);
+	assert_equal (shmht_count (h), 0);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_try_variants
+
+/*
+ * \test-name check_filter
+ * \test-function test_check_filter
+ */
+void
+test_check_filter ()
+{
+	char key[32];
+	char *stored_value = "This is the stored Value!";
+	size_t key_size = 100;
+	size_t ret_size;
+	struct shmht_options opts;
+	struct shmht_stats stats;
+	int i;
+
+	//Create a shmht with the filter.
+	memset (&opts, 0, sizeof (opts));
+	opts.filter_size = 8 * 1000;
+	struct shmht *h = create_shmht_ext ("run_tests", 1000, key_size,
+										dbj2_hash, str_compar, &opts);
+	assert_not_equal (h, NULL);
+
+	for (i = 0; i < 500; i++) {
+		sprintf (key, "filter_key_%d", i);
+		assert_true (shmht_insert (h, key, strlen (key), stored_value,
+								   strlen (stored_value) + 1) > 0);
+	}
+	//The filter never hides a stored key.
+	for (i = 0; i < 500; i++) {
+		sprintf (key, "filter_key_%d", i);
+		assert_not_equal (shmht_search (h, key, strlen (key), &ret_size),
+						  NULL);
+	}
+	assert_equal (shmht_stats (h, &stats), 0);
+	assert_equal (stats.filter_negatives, 0);
+
+	//Most of the misses are answered by the filter.
+	for (i = 0; i < 1000; i++) {
+		sprintf (key, "missing_key_%d", i);
+		assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	}
+	assert_equal (shmht_stats (h, &stats), 0);
+	assert_true (stats.filter_negatives > 900);
+	assert_equal (stats.misses, 1000);
+
+	//The removed keys are taken out of the filter.
+	for (i = 0; i < 250; i++) {
+		sprintf (key, "filter_key_%d", i);
+		assert_equal (shmht_remove (h, key, strlen (key)), 1);
+	}
+	unsigned long negatives = stats.filter_negatives;
+	for (i = 0; i < 250; i++) {
+		sprintf (key, "filter_key_%d", i);
+		assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	}
+	assert_equal (shmht_stats (h, &stats), 0);
+	assert_true (stats.filter_negatives - negatives > 225);
+
+	//And the flushed and evicted ones.
+	assert_true (shmht_remove_older_entries (h, 100) > 0);
+	assert_equal (shmht_count (h), 0);
+	sprintf (key, "filter_key_%d", 400);
+	assert_true (shmht_insert (h, key, strlen (key), stored_value,
+							   strlen (stored_value) + 1) > 0);
+	assert_equal (shmht_flush (h), 0);
+	negatives = stats.filter_negatives;
+	for (i = 0; i < 500; i++) {
+		sprintf (key, "filter_key_%d", i);
+		assert_equal (shmht_search (h, key, strlen (key), &ret_size), NULL);
+	}
+	assert_equal (shmht_stats (h, &stats), 0);
+	assert_equal (stats.filter_negatives - negatives, 500);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_filter
+
+/*
+ * \test-name check_near_cache
+ * \test-function test_check_near_cache
+ */
+void
+test_check_near_cache ()
+{
+	char *key = "Key_for_test_near_cache";
+	char *stored_value = "This is the stored Value!";
+	char *new_value = "This is the new Value!";
+	char copy[100];
+	size_t key_size = 100;
+	size_t ret_size;
+	unsigned long hits, misses;
+	struct shmht_stats stats;
+	int i;
+
+	//Create a shmht, the other handle is as other process.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+	struct shmht *h2 =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h2, NULL);
+	assert_equal (shmht_near_stats (h2, &hits, &misses), -EINVAL);
+	assert_equal (shmht_near_cache (h2, 64, 100), 0);
+
+	assert_true (shmht_insert (h, key, strlen (key), stored_value,
+							   strlen (stored_value) + 1) > 0);
+	for (i = 0; i < 10; i++) {
+		char *ret_value = shmht_search (h2, key, strlen (key), &ret_size);
+		assert_true (ret_value != NULL && !strcmp (ret_value, stored_value));
+	}
+	assert_equal (shmht_near_stats (h2, &hits, &misses), 0);
+	assert_equal (hits, 9);
+	assert_equal (misses, 1);
+
+	//The changes of the other process are seen at once.
+	assert_equal (shmht_remove (h, key, strlen (key)), 1);
+	assert_equal (shmht_search (h2, key, strlen (key), &ret_size), NULL);
+	assert_true (shmht_insert (h, key, strlen (key), new_value,
+							   strlen (new_value) + 1) > 0);
+	for (i = 0; i < 2; i++) {
+		ret_size = sizeof (copy);
+		assert_equal (shmht_search_copy (h2, key, strlen (key), copy,
+										 &ret_size), 1);
+		assert_true (!strcmp (copy, new_value));
+	}
+	assert_equal (shmht_flush (h), 0);
+	ret_size = sizeof (copy);
+	assert_equal (shmht_search_copy (h2, key, strlen (key), copy, &ret_size),
+				  0);
+	assert_equal (shmht_near_stats (h2, &hits, &misses), 0);
+	assert_equal (hits, 10);
+	assert_equal (shmht_stats (h, &stats), 0);
+	assert_equal (stats.near_hits, 10);
+
+	assert_equal (shmht_near_cache (h2, 0, 0), 0);
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+	free (h2);
+
+}								// test_check_near_cache
+
+/*
+ * \test-name check_get_or_lock
+ * \test-function test_check_get_or_lock
+ */
+void
+test_check_get_or_lock ()
+{
+	char *key = "Key_for_test_get_or_lock";
+	char *stored_value = "This is the stored Value!";
+	char copy[100];
+	size_t key_size = 100;
+	size_t ret_size;
+	int status;
+	pid_t pid;
+
+	//Create a shmht, the other handle is as other process.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+	struct shmht *h2 =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h2, NULL);
+
+	//The first one gets the lease, the searches don't see it.
+	ret_size = sizeof (copy);
+	assert_equal (shmht_get_or_lock (h, key, strlen (key), copy, &ret_size,
+									 5000, 0), 0);
+	assert_equal (shmht_count (h), 1);
+	assert_equal (shmht_search (h2, key, strlen (key), &ret_size), NULL);
+	ret_size = sizeof (copy);
+	assert_equal (shmht_get_or_lock (h2, key, strlen (key), copy, &ret_size,
+									 5000, 0), -EAGAIN);
+
+	//Other process waits for the value.
+	pid = fork ();
+	if (pid == 0) {
+		ret_size = sizeof (copy);
+		int ret = shmht_get_or_lock (h2, key, strlen (key), copy, &ret_size,
+									 5000, 5000);
+		_exit (ret == 1 && !strcmp (copy, stored_value) ? 0 : 1);
+	}
+	assert_true (pid > 0);
+	usleep (100000);
+	assert_true (shmht_insert (h, key, strlen (key), stored_value,
+							   strlen (stored_value) + 1) > 0);
+	assert_equal (waitpid (pid, &status, 0), pid);
+	assert_true (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+	assert_equal (shmht_count (h), 1);
+
+	//The expired leases are taken by the next one, and removed to give
+	//them up.
+	assert_equal (shmht_remove (h, key, strlen (key)), 1);
+	ret_size = sizeof (copy);
+	assert_equal (shmht_get_or_lock (h, key, strlen (key), copy, &ret_size,
+									 1, 0), 0);
+	usleep (10000);
+	ret_size = sizeof (copy);
+	assert_equal (shmht_get_or_lock (h2, key, strlen (key), copy, &ret_size,
+									 5000, 0), 0);
+	assert_equal (shmht_remove (h2, key, strlen (key)), 1);
+	assert_equal (shmht_count (h), 0);
+
+	//The leases are evicted by their age as the other entries: the older
+	//value goes first.
+	struct shmht_stats stats;
+	assert_equal (shmht_stats (h, &stats), 0);
+	int p = (100 + stats.tablelength - 1) / stats.tablelength;
+	assert_true (shmht_insert (h, "older", 6, "1", 2) > 0);
+	sleep (1);
+	ret_size = sizeof (copy);
+	assert_equal (shmht_get_or_lock (h, key, strlen (key), copy, &ret_size,
+									 5000, 0), 0);
+	assert_equal (shmht_remove_older_entries (h, p), 1);
+	assert_equal (shmht_search (h, "older", 6, &ret_size), NULL);
+	assert_equal (shmht_count (h), 1);
+	assert_equal (shmht_remove (h, key, strlen (key)), 1);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+	free (h2);
+
+}								// test_check_get_or_lock
+
+/*
+ * \test-name check_set
+ * \test-function test_check_set
+ */
+void
+test_check_set ()
+{
+	char key[32];
+	char copy[100];
+	size_t ret_size;
+	struct shmht_set_options opts = { 4, 0, NULL };
+	int i;
+
+	//Create a set of 4 shards.
+	struct shmht_set *s =
+		shmht_set_create ("run_tests", 400, 100, dbj2_hash, str_compar, &opts);
+	assert_not_equal (s, NULL);
+	for (i = 0; i < 200; i++) {
+		sprintf (key, "set_key_%d", i);
+		assert_true (shmht_set_insert (s, key, strlen (key), key,
+									   strlen (key) + 1) > 0);
+	}
+	assert_equal (shmht_set_count (s), 200);
+	//The shards are tables as the others.
+	for (i = 0; i < 200; i++) {
+		sprintf (key, "set_key_%d", i);
+		char *ret_value = shmht_set_search (s, key, strlen (key), &ret_size);
+		assert_true (ret_value != NULL && !strcmp (ret_value, key));
+		struct shmht *shard = shmht_set_shard (s, key, strlen (key));
+		assert_true (shmht_search (shard, key, strlen (key), &ret_size)
+					 != NULL);
+	}
+	sprintf (key, "set_key_%d", 7);
+	assert_equal (shmht_set_remove (s, key, strlen (key)), 1);
+	ret_size = sizeof (copy);
+	assert_equal (shmht_set_search_copy (s, key, strlen (key), copy,
+										 &ret_size), 0);
+	assert_equal (shmht_set_count (s), 199);
+	assert_equal (shmht_set_flush (s), 0);
+	assert_equal (shmht_set_count (s), 0);
+	assert_equal (shmht_set_destroy (s), 0);
+
+	//A copy for each NUMA node.
+	opts.replicate = 1;
+	s = shmht_set_create ("run_tests", 100, 100, dbj2_hash, str_compar,
+						  &opts);
+	assert_not_equal (s, NULL);
+	assert_true (shmht_set_insert (s, key, strlen (key), key,
+								   strlen (key) + 1) > 0);
+	ret_size = sizeof (copy);
+	assert_equal (shmht_set_search_copy (s, key, strlen (key), copy,
+										 &ret_size), 1);
+	assert_true (!strcmp (copy, key));
+	assert_equal (shmht_set_count (s), 1);
+	assert_equal (shmht_set_remove (s, key, strlen (key)), 1);
+	assert_equal (shmht_set_count (s), 0);
+	assert_equal (shmht_set_destroy (s), 0);
+
+}								// test_check_set
+
+/*
+ * \test-name check_container
+ * \test-function test_check_container
+ */
+void
+test_check_container ()
+{
+	char key[32];
+	char *value1 = "Value of the table 1";
+	char *value2 = "Value of the table 2";
+	char value[100];
+	size_t ret_size;
+	int i, n;
+
+	memset (value, 'v', sizeof (value));
+	//Two tables that can store 100 keys, but a pool for 60 values.
+	struct shmht_container *c =
+		shmht_container_create ("run_tests", 2 * shmht_table_size (100, NULL),
+								60 * 128, 100);
+	assert_not_equal (c, NULL);
+	struct shmht *t1 =
+		shmht_container_table (c, "first", 100, dbj2_hash, str_compar, NULL);
+	struct shmht *t2 =
+		shmht_container_table (c, "second", 100, dbj2_hash, str_compar, NULL);
+	assert_true (t1 != NULL && t2 != NULL);
+	//There is not space for other table.
+	assert_equal (shmht_container_table (c, "third", 100, dbj2_hash,
+										 str_compar, NULL), NULL);
+	//The same table for other process.
+	struct shmht *t1b =
+		shmht_container_table (c, "first", 0, dbj2_hash, str_compar, NULL);
+	assert_not_equal (t1b, NULL);
+
+	//The keys of each table are its own.
+	assert_true (shmht_insert (t1, "key", 3, value1, strlen (value1) + 1) > 0);
+	assert_true (shmht_insert (t2, "key", 3, value2, strlen (value2) + 1) > 0);
+	char *ret_value = shmht_search (t1b, "key", 3, &ret_size);
+	assert_true (ret_value != NULL && !strcmp (ret_value, value1));
+	ret_value = shmht_search (t2, "key", 3, &ret_size);
+	assert_true (ret_value != NULL && !strcmp (ret_value, value2));
+	assert_equal (shmht_remove (t1, "key", 3), 1);
+	assert_equal (shmht_remove (t2, "key", 3), 1);
+
+	//The first table takes all the pool.
+	for (n = 0; n < 100; n++) {
+		sprintf (key, "key_%d", n);
+		if (shmht_insert (t1, key, strlen (key), value, sizeof (value)) <= 0)
+			break;
+	}
+	assert_true (n > 0 && n < 100);
+	assert_true (shmht_insert (t2, "key", 3, value, sizeof (value)) <= 0);
+	//The memory moves to the other table.
+	assert_equal (shmht_flush (t1), 0);
+	for (i = 0; i < n; i++) {
+		sprintf (key, "key_%d", i);
+		assert_true (shmht_insert (t2, key, strlen (key), value,
+								   sizeof (value)) > 0);
+	}
+	assert_equal (shmht_count (t1), 0);
+	assert_equal (shmht_count (t2), n);
+	assert_equal (shmht_destroy (t1), -EINVAL);
+
+	assert_equal (shmht_container_destroy (c), 0);
+	free (t1);
+	free (t1b);
+	free (t2);
+
+}								// test_check_container
+
+/*
+ * \test-name check_changelog
+ * \test-function test_check_changelog
+ */
+void
+test_check_changelog ()
+{
+	char key[32];
+	char value[100];
+	char big_value[2000];
+	char buf[2600];
+	struct shmht_options opts = { 0, 64, 0, 4096 };
+	struct shmht_change change;
+	unsigned long cursor = 0, seq;
+	int i, ret;
+
+	memset (value, 'v', sizeof (value));
+	//A big value that can not be compressed.
+	srand (1);
+	for (i = 0; i < sizeof (big_value); i++)
+		big_value[i] = rand ();
+	struct shmht *h = create_shmht_ext ("run_tests", 16, 2048, dbj2_hash,
+										str_compar, &opts);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 0);
+
+	//The changes, in order.
+	assert_true (shmht_insert (h, "key1", 4, "value1", 7) > 0);
+	assert_true (shmht_insert (h, "key2", 4, value, sizeof (value)) > 0);
+	assert_true (shmht_insert (h, "key3", 4, big_value,
+							   sizeof (big_value)) > 0);
+	assert_equal (shmht_remove (h, "key1", 4), 1);
+	assert_equal (shmht_remove (h, "key1", 4), 0);
+	assert_equal (shmht_remove_older_entries (h, 100), 2);
+	assert_equal (shmht_flush (h), 0);
+
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 1);
+	assert_equal (change.seq, 1);
+	assert_equal (change.op, SHMHT_CHANGE_INSERT);
+	assert_true (change.key_size == 4 && !memcmp (change.key, "key1", 4));
+	assert_true (change.value_size == 7 && !strcmp (change.value, "value1"));
+	//The compressed value is decompressed.
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 1);
+	assert_true (change.value_size == sizeof (value)
+				 && !memcmp (change.value, value, sizeof (value)));
+	//The buffer must fit the key and the value, but the big values are not
+	//in the changelog.
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf, 2),
+				  -ENOSPC);
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 1);
+	assert_true (change.value == NULL
+				 && change.value_size == sizeof (big_value));
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 1);
+	assert_true (change.op == SHMHT_CHANGE_REMOVE && change.seq == 4);
+	for (i = 0; i < 2; i++) {
+		assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+											sizeof (buf)), 1);
+		assert_equal (change.op, SHMHT_CHANGE_EVICT);
+	}
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 1);
+	assert_true (change.op == SHMHT_CHANGE_FLUSH && change.seq == 7);
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 0);
+	assert_equal (cursor, shmht_changelog_cursor (h));
+
+	//A reader that is too late loses the older changes.
+	for (i = 0; i < 100; i++) {
+		sprintf (key, "key_%d", i);
+		assert_true (shmht_insert (h, key, strlen (key), "v", 2) > 0);
+		assert_equal (shmht_remove (h, key, strlen (key)), 1);
+	}
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), -EOVERFLOW);
+	seq = 0;
+	while ((ret = shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf))) == 1) {
+		assert_true (seq == 0 || change.seq == seq + 1);
+		seq = change.seq;
+	}
+	assert_equal (ret, 0);
+	assert_equal (seq, 207);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_changelog
+
+struct batch_found
+{
+	unsigned int calls;
+	size_t sizes[4];
+	char first[4];
+};
+
+static void
+batch_found (void *arg, unsigned int i, void *value, size_t value_size)
+{
+	struct batch_found *f = arg;
+	f->calls++;
+	f->sizes[i] = value_size;
+	f->first[i] = *(char *) value;
+}
+
+/*
+ * \test-name check_search_batch
+ * \test-function test_check_search_batch
+ */
+void
+test_check_search_batch ()
+{
+	char *keys[4] = { "one", "two", "missing", "big" };
+	size_t key_sizes[4];
+	char big_value[300];
+	struct batch_found f;
+	int i;
+
+	//Random bytes, so the big value is chained and not compressed.
+	srand (2);
+	for (i = 0; i < sizeof (big_value); i++)
+		big_value[i] = rand ();
+	big_value[0] = 'b';
+	for (i = 0; i < 4; i++)
+		key_sizes[i] = strlen (keys[i]);
+	assert_equal (shmht_string_hash ("one"), shmht_string_hash ("one"));
+	assert_true (shmht_string_hash ("one") != shmht_string_hash ("two"));
+	assert_true (shmht_string_eq ("one", "one"));
+	assert_false (shmht_string_eq ("one", "two"));
+
+	struct shmht *h = create_shmht ("run_tests", 16, 64, shmht_string_hash,
+									shmht_string_eq);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_insert (h, "one", 3, "1111", 4), 1);
+	assert_equal (shmht_insert (h, "two", 3, "22", 2), 1);
+	assert_equal (shmht_insert (h, "big", 3, big_value, sizeof (big_value)),
+				  1);
+
+	memset (&f, 0, sizeof (f));
+	assert_equal (shmht_search_batch
+				  (h, 4, (void **) keys, key_sizes, batch_found, &f), 3);
+	assert_equal (f.calls, 3);
+	assert_equal (f.sizes[0], 4);
+	assert_equal (f.first[0], '1');
+	assert_equal (f.sizes[1], 2);
+	assert_equal (f.first[1], '2');
+	assert_equal (f.sizes[2], 0);
+	assert_equal (f.sizes[3], sizeof (big_value));
+	assert_equal (f.first[3], 'b');
+
+	//The NULL keys are skipped.
+	keys[0] = NULL;
+	memset (&f, 0, sizeof (f));
+	assert_equal (shmht_search_batch
+				  (h, 4, (void **) keys, key_sizes, batch_found, &f), 2);
+	assert_equal (f.sizes[0], 0);
+	shmht_destroy (h);
+	free (h);
+
+	//The misses of the filter don't change the keys.
+	struct shmht_options opts = { 0, 0, 1024, 0 };
+	h = create_shmht_ext ("run_tests", 16, 64, shmht_string_hash,
+						  shmht_string_eq, &opts);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_insert (h, "two", 3, "22", 2), 1);
+	keys[0] = "one";
+	memset (&f, 0, sizeof (f));
+	assert_equal (shmht_search_batch
+				  (h, 4, (void **) keys, key_sizes, batch_found, &f), 1);
+	assert_equal (f.sizes[1], 2);
+	for (i = 0; i < 4; i++)
+		assert_not_equal (keys[i], NULL);
+	assert_true (!strcmp (keys[2], "missing"));
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_search_batch
+
+/*
+ * \test-name check_attach_ro
+ * \test-function test_check_attach_ro
+ */
+void
+test_check_attach_ro ()
+{
+	char value[100];
+	char big_value[300];
+	char text[2000];
+	char buf[2000];
+	size_t size;
+	struct shmht_options opts = { 0, 1000, 0, 0 };
+	struct batch_found f;
+	char *keys[2] = { "small", "text" };
+	size_t key_sizes[2] = { 5, 4 };
+	int i, status;
+	pid_t pid;
+
+	memset (value, 'v', sizeof (value));
+	srand (3);
+	for (i = 0; i < sizeof (big_value); i++)
+		big_value[i] = rand ();
+	//A value that is compressed.
+	for (i = 0; i < sizeof (text); i++)
+		text[i] = 'a' + i % 7;
+	assert_equal (shmht_attach_ro ("run_tests", dbj2_hash, str_compar), NULL);
+	struct shmht *h = create_shmht_ext ("run_tests", 16, 64, dbj2_hash,
+										str_compar, &opts);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_insert (h, "small", 5, value, 50), 1);
+	assert_equal (shmht_insert (h, "big", 3, big_value, sizeof (big_value)),
+				  1);
+	assert_equal (shmht_insert (h, "text", 4, text, sizeof (text)), 1);
+
+	struct shmht *ro = shmht_attach_ro ("run_tests", dbj2_hash, str_compar);
+	assert_not_equal (ro, NULL);
+	assert_equal (shmht_count (ro), 3);
+	assert_not_equal (shmht_search (ro, "small", 5, &size), NULL);
+	assert_equal (size, 50);
+	assert_equal (shmht_search (ro, "big", 3, &size), NULL);
+	size = sizeof (buf);
+	assert_equal (shmht_search_copy (ro, "big", 3, buf, &size), 1);
+	assert_equal (size, sizeof (big_value));
+	assert_true (!memcmp (buf, big_value, size));
+	size = sizeof (buf);
+	assert_equal (shmht_search_copy (ro, "text", 4, buf, &size), 1);
+	assert_equal (size, sizeof (text));
+	assert_true (!memcmp (buf, text, size));
+	size = 10;
+	assert_equal (shmht_search_copy (ro, "small", 5, buf, &size), -ENOSPC);
+	assert_equal (size, 50);
+	size = sizeof (buf);
+	assert_equal (shmht_search_copy (ro, "none", 4, buf, &size), 0);
+	memset (&f, 0, sizeof (f));
+	assert_equal (shmht_search_batch (ro, 2, (void **) keys, key_sizes,
+									  batch_found, &f), 2);
+	assert_equal (f.sizes[0], 50);
+	assert_equal (f.first[0], 'v');
+	assert_equal (f.sizes[1], sizeof (text));
+	assert_equal (f.first[1], 'a');
+
+	//The writes fail.
+	assert_equal (shmht_insert (ro, "other", 5, value, 10), -EROFS);
+	assert_equal (shmht_remove (ro, "small", 5), -EROFS);
+	assert_equal (shmht_count (h), 3);
+	assert_true (shmht_destroy (ro) < 0);
+
+	//The reader sees the changes of the writers.
+	assert_equal (shmht_remove (h, "small", 5), 1);
+	assert_equal (shmht_search (ro, "small", 5, &size), NULL);
+	assert_equal (shmht_count (ro), 2);
+
+	//A writer changes the value while the reader reads it: the reader
+	//never sees a mix of two values.
+	pid = fork ();
+	if (pid == 0) {
+		for (i = 0; i < 20000; i++) {
+			memset (value, 'a' + i % 26, sizeof (value));
+			shmht_remove (h, "key", 3);
+			shmht_insert (h, "key", 3, value, sizeof (value));
+		}
+		_exit (0);
+	}
+	int torn = 0;
+	while (waitpid (pid, &status, WNOHANG) == 0) {
+		size = sizeof (buf);
+		if (shmht_search_copy (ro, "key", 3, buf, &size) != 1)
+			continue;
+		for (i = 1; i < sizeof (value); i++)
+			torn += buf[i] != buf[0];
+	}
+	assert_equal (torn, 0);
+	assert_equal (WEXITSTATUS (status), 0);
+	free (ro);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_attach_ro
+
+/*
+ * \test-name check_bulk_load
+ * \test-function test_check_bulk_load
+ */
+void
+test_check_bulk_load ()
+{
+	char key[32];
+	char value[100];
+	char buf[100];
+	size_t size;
+	struct shmht_options opts = { 0, 0, 1024, 4096 };
+	struct shmht_change change;
+	unsigned long cursor;
+	int i;
+
+	memset (value, 'v', sizeof (value));
+	struct shmht *h = create_shmht_ext ("run_tests", 16, 100, dbj2_hash,
+										str_compar, &opts);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_insert (h, "old", 4, value, 10), 1);
+	cursor = shmht_changelog_cursor (h);
+	struct shmht *ro = shmht_attach_ro ("run_tests", dbj2_hash, str_compar);
+	assert_not_equal (ro, NULL);
+
+	//The new generation is bigger, and it's not seen until it's published.
+	struct shmht_bulk *b = shmht_bulk_begin ("run_tests", 100, 100,
+											 dbj2_hash, str_compar, &opts);
+	assert_not_equal (b, NULL);
+	for (i = 0; i < 80; i++) {
+		sprintf (key, "key%d", i);
+		value[0] = i;
+		assert_equal (shmht_bulk_add (b, key, strlen (key) + 1, value,
+									  sizeof (value)), 1);
+	}
+	assert_equal (shmht_count (h), 1);
+	assert_equal (shmht_search (h, "key1", 5, &size), NULL);
+	assert_equal (shmht_bulk_publish (b), 0);
+
+	//All the handles take the new generation.
+	assert_equal (shmht_count (h), 80);
+	assert_equal (shmht_search (h, "old", 4, &size), NULL);
+	assert_equal (shmht_count (ro), 80);
+	for (i = 0; i < 80; i++) {
+		sprintf (key, "key%d", i);
+		size = sizeof (buf);
+		assert_equal (shmht_search_copy (ro, key, strlen (key) + 1, buf,
+										 &size), 1);
+		assert_equal (size, sizeof (value));
+		assert_equal (buf[0], i);
+	}
+	struct shmht *h2 = create_shmht ("run_tests", 16, 100, dbj2_hash,
+									 str_compar);
+	assert_not_equal (h2, NULL);
+	assert_equal (shmht_count (h2), 80);
+	assert_equal (shmht_insert (h, "new", 4, value, 10), 1);
+	assert_not_equal (shmht_search (ro, "new", 4, &size), NULL);
+
+	//The readers of the changelog see the flush.
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 1);
+	assert_equal (change.op, SHMHT_CHANGE_FLUSH);
+	assert_equal (shmht_changelog_read (h, &cursor, &change, buf,
+										sizeof (buf)), 1);
+	assert_equal (change.op, SHMHT_CHANGE_INSERT);
+
+	//The next generation is in the first key again, and an aborted one
+	//changes nothing.
+	b = shmht_bulk_begin ("run_tests", 16, 100, dbj2_hash, str_compar, NULL);
+	assert_not_equal (b, NULL);
+	assert_equal (shmht_bulk_add (b, "one", 4, value, 10), 1);
+	shmht_bulk_abort (b);
+	assert_equal (shmht_count (h), 81);
+	b = shmht_bulk_begin ("run_tests", 16, 100, dbj2_hash, str_compar, NULL);
+	assert_not_equal (b, NULL);
+	assert_equal (shmht_bulk_add (b, "one", 4, value, 10), 1);
+	assert_equal (shmht_bulk_add (b, "two", 4, value, 20), 1);
+	assert_equal (shmht_bulk_publish (b), 0);
+	assert_equal (shmht_count (h2), 2);
+	assert_equal (shmht_count (ro), 2);
+	size = sizeof (buf);
+	assert_equal (shmht_search_copy (h, "two", 4, buf, &size), 1);
+	assert_equal (size, 20);
+	free (ro);
+	free (h2);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_bulk_load
+
+/*
+ * \test-name check_bulk_publish_blocked_writer
+ * \test-function test_check_bulk_publish_blocked_writer
+ */
+void
+test_check_bulk_publish_blocked_writer ()
+{
+	char buf[100];
+	size_t size;
+	int status;
+	pid_t publisher, writer;
+	//The write lock of other process (as in shmht_sem.h, without undo).
+	struct sembuf write_start[] = { {1, 1, 0}, {0, 1, 0} };
+	struct sembuf write_end[] = { {0, -1, 0}, {1, -1, 0} };
+
+	struct shmht *h = create_shmht ("run_tests", 16, 100, dbj2_hash,
+									str_compar);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_insert (h, "old", 4, "old", 4), 1);
+	int semaphore = semget (ftok ("run_tests", 1), 2, 0666);
+	assert_true (semaphore >= 0);
+	struct shmht_bulk *b = shmht_bulk_begin ("run_tests", 16, 100,
+											 dbj2_hash, str_compar, NULL);
+	assert_not_equal (b, NULL);
+	assert_equal (shmht_bulk_add (b, "bulk", 5, "bulk", 5), 1);
+
+	//With the lock held, the publish waits for it, and then a writer that
+	//has already taken the current generation. The publish gets the lock
+	//first (the waiters are woken in order).
+	assert_equal (semop (semaphore, write_start, 2), 0);
+	publisher = fork ();
+	if (publisher == 0)
+		_exit (shmht_bulk_publish (b) == 0 ? 0 : 1);
+	assert_true (publisher > 0);
+	usleep (100000);
+	writer = fork ();
+	if (writer == 0)
+		_exit (shmht_insert (h, "late", 5, "late", 5) == 1 ? 0 : 1);
+	assert_true (writer > 0);
+	usleep (100000);
+	assert_equal (semop (semaphore, write_end, 2), 0);
+	assert_equal (waitpid (publisher, &status, 0), publisher);
+	assert_true (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+	assert_equal (waitpid (writer, &status, 0), writer);
+	assert_true (WIFEXITED (status) && WEXITSTATUS (status) == 0);
+
+	//The write is in the new generation.
+	assert_equal (shmht_count (h), 2);
+	size = sizeof (buf);
+	assert_equal (shmht_search_copy (h, "late", 5, buf, &size), 1);
+	assert_true (!strcmp (buf, "late"));
+	assert_equal (shmht_search (h, "old", 4, &size), NULL);
+	//The bulk of this process has been published by the other one: its
+	//memory is left, aborting it would remove the new generation.
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_bulk_publish_blocked_writer
+
+/*
+ * \test-name check_tag_invalidation
+ * \test-function test_check_tag_invalidation
+ */
+void
+test_check_tag_invalidation ()
+{
+	char key[32];
+	size_t size;
+	int i;
+
+	struct shmht *h = create_shmht ("run_tests", 16, 100, dbj2_hash,
+									str_compar);
+	assert_not_equal (h, NULL);
+	//The tags 1 and 17 are in the same slot of the index, and the colisions
+	//are moved by the removes.
+	for (i = 0; i < 12; i++) {
+		sprintf (key, "key%d", i);
+		assert_equal (shmht_insert_tagged (h, key, strlen (key) + 1, key,
+										   strlen (key) + 1,
+										   i % 3 == 0 ? 1 : i % 3 == 1 ?
+										   17 : 0), 1);
+	}
+	assert_equal (shmht_remove (h, "key0", 5), 1);
+	assert_equal (shmht_remove (h, "key3", 5), 1);
+	assert_equal (shmht_insert_tagged (h, "key3", 5, "x", 2, 2), 1);
+	assert_equal (shmht_invalidate_tag (h, 0), -EINVAL);
+	assert_equal (shmht_invalidate_tag (h, 1), 2);
+	assert_equal (shmht_count (h), 9);
+	assert_equal (shmht_search (h, "key6", 5, &size), NULL);
+	assert_equal (shmht_search (h, "key9", 5, &size), NULL);
+	assert_not_equal (shmht_search (h, "key3", 5, &size), NULL);
+	assert_equal (shmht_invalidate_tag (h, 1), 0);
+	//The compaction moves the colisions of the index.
+	assert_true (shmht_compact (h) >= 0);
+	assert_equal (shmht_invalidate_tag (h, 17), 4);
+	assert_equal (shmht_invalidate_tag (h, 2), 1);
+	assert_equal (shmht_count (h), 4);
+	for (i = 2; i < 12; i += 3) {
+		sprintf (key, "key%d", i);
+		assert_not_equal (shmht_search (h, key, strlen (key) + 1, &size),
+						  NULL);
+	}
+
+	//After a flush the old entries are not in the index.
+	assert_equal (shmht_insert_tagged (h, "key1", 5, "x", 2, 3), 1);
+	assert_equal (shmht_flush (h), 0);
+	assert_equal (shmht_insert_tagged (h, "key4", 5, "x", 2, 3), 1);
+	assert_equal (shmht_invalidate_tag (h, 3), 1);
+	assert_equal (shmht_count (h), 0);
+	shmht_destroy (h);
+	free (h);
+
+	//A group bigger than a stripe of the lock.
+	h = create_shmht ("run_tests", 1024, 100, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+	for (i = 0; i < 1000; i++) {
+		sprintf (key, "key%d", i);
+		assert_equal (shmht_insert_tagged (h, key, strlen (key) + 1, key,
+										   strlen (key) + 1, 7), 1);
+	}
+	assert_equal (shmht_invalidate_tag (h, 7), 1000);
+	assert_equal (shmht_count (h), 0);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_tag_invalidation
+
+/*
+ * \test-name check_crash_recovery
+ * \test-function test_check_crash_recovery
+ */
+void
+test_check_crash_recovery ()
+{
+	struct shmht_stats stats;
+	char key[32];
+	char buf[32];
+	size_t size;
+	int i, round, status, found, tagged[4];
+	pid_t pid;
+
+	struct shmht *h = create_shmht ("run_tests", 64, 32, dbj2_hash,
+									str_compar);
+	assert_not_equal (h, NULL);
+
+	//A writer is killed in the middle of its operations, many times, and
+	//the table must be consistent after each one.
+	for (round = 0; round < 200; round++) {
+		pid = fork ();
+		if (pid == 0) {
+			for (i = 0;; i++) {
+				sprintf (key, "key%d", i % 48);
+				shmht_remove (h, key, strlen (key) + 1);
+				shmht_insert_tagged (h, key, strlen (key) + 1, key,
+									 strlen (key) + 1, 1 + i % 48 % 4);
+				sprintf (key, "key%d", i * 7 % 48);
+				shmht_remove (h, key, strlen (key) + 1);
+				if (i % 500 == 0)
+					shmht_compact (h);
+			}
+		}
+		assert_true (pid > 0);
+		usleep (200 + round * 37 % 2000);
+		kill (pid, SIGKILL);
+		assert_equal (waitpid (pid, &status, 0), pid);
+
+		found = 0;
+		for (i = 0; i < 48; i++) {
+			sprintf (key, "key%d", i);
+			size = sizeof (buf);
+			if (shmht_search_copy (h, key, strlen (key) + 1, buf,
+								   &size) != 1)
+				continue;
+			found++;
+			assert_true (!strcmp (buf, key));
+		}
+		assert_equal (shmht_count (h), found);
+	}
+	assert_equal (shmht_stats (h, &stats), 0);
+	assert_true (stats.recoveries > 0);
+
+	//The tag index is consistent too.
+	memset (tagged, 0, sizeof (tagged));
+	for (i = 0; i < 48; i++) {
+		sprintf (key, "key%d", i);
+		size = sizeof (buf);
+		if (shmht_search_copy (h, key, strlen (key) + 1, buf, &size) == 1)
+			tagged[i % 4]++;
+	}
+	for (i = 0; i < 4; i++)
+		assert_equal (shmht_invalidate_tag (h, 1 + i), tagged[i]);
+	assert_equal (shmht_count (h), 0);
+
+	//And the entries are free again.
+	for (i = 0; i < 64; i++) {
+		sprintf (key, "key%d", i);
+		assert_equal (shmht_insert (h, key, strlen (key) + 1, key,
+									strlen (key) + 1), 1);
+	}
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_crash_recovery
+
+/*
+ * \test-name check_gds_crash_recovery
+ * \test-function test_check_gds_crash_recovery
+ */
+void
+test_check_gds_crash_recovery ()
+{
+	struct shmht_options opts = { 0, 0, 0, 0, SHMHT_EVICT_GDS };
+	struct shmht_stats stats;
+	char key[32];
+	char buf[32];
+	size_t size;
+	int i, round, status, found, evict;
+	pid_t pid;
+
+	struct shmht *h = create_shmht_ext ("run_tests", 64, 32, dbj2_hash,
+										str_compar, &opts);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_stats (h, &stats), 0);
+	evict = stats.tablelength * 5 / 100;
+
+	//The writer is killed while it inserts, removes, evicts and refreshes
+	//the priorities: the eviction heap is rebuilt, so each eviction takes
+	//as many entries as it must, and all of them at the end.
+	for (round = 0; round < 200; round++) {
+		pid = fork ();
+		if (pid == 0) {
+			for (i = 0;; i++) {
+				sprintf (key, "key%d", i % 48);
+				shmht_remove (h, key, strlen (key) + 1);
+				shmht_insert_cost (h, key, strlen (key) + 1, key,
+								   strlen (key) + 1, 1 + i % 7);
+				sprintf (key, "key%d", i * 7 % 48);
+				shmht_search (h, key, strlen (key) + 1, &size);
+				if (i % 5 == 0)
+					shmht_remove (h, key, strlen (key) + 1);
+				if (i % 50 == 0)
+					shmht_remove_older_entries (h, 5);
+			}
+		}
+		assert_true (pid > 0);
+		usleep (200 + round * 37 % 2000);
+		kill (pid, SIGKILL);
+		assert_equal (waitpid (pid, &status, 0), pid);
+
+		found = 0;
+		for (i = 0; i < 48; i++) {
+			sprintf (key, "key%d", i);
+			size = sizeof (buf);
+			if (shmht_search_copy (h, key, strlen (key) + 1, buf,
+								   &size) != 1)
+				continue;
+			found++;
+			assert_true (!strcmp (buf, key));
+		}
+		assert_equal (shmht_count (h), found);
+		assert_equal (shmht_remove_older_entries (h, 5),
+					  found < evict ? found : evict);
+	}
+	assert_equal (shmht_stats (h, &stats), 0);
+	assert_true (stats.recoveries > 0);
+	found = shmht_count (h);
+	assert_equal (shmht_remove_older_entries (h, 100), found);
+	assert_equal (shmht_count (h), 0);
+
+	//And the heap has all the entries again.
+	for (i = 0; i < 64; i++) {
+		sprintf (key, "key%d", i);
+		assert_equal (shmht_insert (h, key, strlen (key) + 1, key,
+									strlen (key) + 1), 1);
+	}
+	assert_equal (shmht_remove_older_entries (h, 100), 64);
+	assert_equal (shmht_count (h), 0);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_gds_crash_recovery
+
+/*
+ * \test-name check_gds_eviction
+ * \test-function test_check_gds_eviction
+ */
+void
+test_check_gds_eviction ()
+{
+	struct shmht_options opts = { 0, 0, 0, 0, SHMHT_EVICT_GDS };
+	char key[32];
+	char big[800];
+	char touched[32] = "";
+	size_t size;
+	int i;
+
+	memset (big, 'b', sizeof (big));
+	//53 entries, each 1% evicts 0.53 of them.
+	struct shmht *h = create_shmht_ext ("run_tests", 16, 1000, dbj2_hash,
+										str_compar, &opts);
+	assert_not_equal (h, NULL);
+
+	//The big and cheap values go before the small and expensive ones.
+	for (i = 0; i < 10; i++) {
+		sprintf (key, "big%d", i);
+		assert_equal (shmht_insert_cost (h, key, strlen (key) + 1, big,
+										 sizeof (big), 1), 1);
+		sprintf (key, "small%d", i);
+		assert_equal (shmht_insert_cost (h, key, strlen (key) + 1, key,
+										 strlen (key) + 1, 100), 1);
+	}
+	assert_equal (shmht_remove_older_entries (h, 10), 5);
+	assert_equal (shmht_count (h), 15);
+	for (i = 0; i < 10; i++) {
+		sprintf (key, "small%d", i);
+		assert_not_equal (shmht_search (h, key, strlen (key) + 1, &size),
+						  NULL);
+		sprintf (key, "big%d", i);
+		if (touched[0] == 0
+			&& shmht_search (h, key, strlen (key) + 1, &size) != NULL)
+			strcpy (touched, key);
+	}
+
+	//The clock is the priority of the last evicted one: the new entries and
+	//the ones found after it stay over the rest.
+	assert_true (touched[0] != 0);
+	assert_equal (shmht_insert_cost (h, "newbig", 7, big, sizeof (big), 1),
+				  1);
+	assert_equal (shmht_remove_older_entries (h, 8), 4);
+	assert_equal (shmht_count (h), 12);
+	assert_not_equal (shmht_search (h, touched, strlen (touched) + 1, &size),
+					  NULL);
+	assert_not_equal (shmht_search (h, "newbig", 7, &size), NULL);
+
+	//The removes and the flush take the entries out of the heap.
+	assert_equal (shmht_remove (h, "newbig", 7), 1);
+	assert_equal (shmht_remove_older_entries (h, 100), 11);
+	assert_equal (shmht_count (h), 0);
+	assert_equal (shmht_insert (h, "one", 4, "1", 2), 1);
+	assert_equal (shmht_flush (h), 0);
+	assert_equal (shmht_insert (h, "two", 4, "2", 2), 1);
+	assert_equal (shmht_remove_older_entries (h, 100), 1);
+	assert_equal (shmht_count (h), 0);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_gds_eviction
+
+/*
+ * \test-name check_maintenance_threads
+ * \test-function test_check_maintenance_threads
+ */
+void
+test_check_maintenance_threads ()
+{
+	struct shmht_stats stats;
+	char key[32];
+	char value[100];
+	size_t ret_size;
+	int i, n, old;
+
+	memset (value, 'v', sizeof (value));
+	struct shmht *h = create_shmht ("run_tests", 100, 100, dbj2_hash,
+									str_compar);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_maintenance_threads (h, 0), -EINVAL);
+	assert_equal (shmht_maintenance_threads (h, 65), -EINVAL);
+	assert_equal (shmht_maintenance_threads (h, 4), 0);
+
+	//The half of the entries a second older than the rest: the eviction of
+	//the 50% takes them from all the threads.
+	assert_equal (shmht_stats (h, &stats), 0);
+	old = stats.tablelength / 2;
+	for (i = 0; i < old; i++) {
+		sprintf (key, "old_%d", i);
+		assert_true (shmht_insert (h, key, strlen (key) + 1, "1", 2) > 0);
+	}
+	sleep (1);
+	for (i = 0; i < 10; i++) {
+		sprintf (key, "new_%d", i);
+		assert_true (shmht_insert (h, key, strlen (key) + 1, "2", 2) > 0);
+	}
+	assert_equal (shmht_remove_older_entries (h, 50), old);
+	assert_equal (shmht_count (h), 10);
+	for (i = 0; i < 10; i++) {
+		sprintf (key, "new_%d", i);
+		assert_not_equal (shmht_search (h, key, strlen (key) + 1, &ret_size),
+						  NULL);
+	}
+	assert_equal (shmht_remove_older_entries (h, 100), 10);
+	assert_equal (shmht_count (h), 0);
+	shmht_destroy (h);
+	free (h);
+
+	//The flush of a table of a container returns all its values.
+	struct shmht_container *c =
+		shmht_container_create ("run_tests", shmht_table_size (200, NULL),
+								60 * 128, 100);
+	assert_not_equal (c, NULL);
+	h = shmht_container_table (c, "table", 200, dbj2_hash, str_compar, NULL);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_maintenance_threads (h, 3), 0);
+	for (n = 0; n < 200; n++) {
+		sprintf (key, "key_%d", n);
+		if (shmht_insert (h, key, strlen (key), value, sizeof (value)) <= 0)
+			break;
+	}
+	assert_true (n > 0 && n < 200);
+	assert_equal (shmht_flush (h), 0);
+	for (i = 0; i < n; i++) {
+		sprintf (key, "key_%d", i);
+		assert_true (shmht_insert (h, key, strlen (key), value,
+								   sizeof (value)) > 0);
+	}
+	assert_true (shmht_insert (h, "other", 5, value, sizeof (value)) <= 0);
+
+	assert_equal (shmht_container_destroy (c), 0);
+	free (h);
+
+}								// test_check_maintenance_threads
+
+/*
+ * \test-name check_store
+ * \test-function test_check_store
+ */
+void
+test_check_store ()
+{
+	char value[32];
+	size_t ret_size;
+	int i, status, stored = 0;
+
+	struct shmht *h = create_shmht ("run_tests", 16, 32, dbj2_hash,
+									str_compar);
+	assert_not_equal (h, NULL);
+	assert_equal (shmht_store (h, "key", 4, "v1", 3, 0), -EINVAL);
+	assert_equal (shmht_store (h, "key", 4, "v1", 3, SHMHT_STORE_REPLACE),
+				  0);
+	assert_equal (shmht_store (h, "key", 4, "v1", 3, SHMHT_STORE_ADD), 1);
+	assert_equal (shmht_store (h, "key", 4, "v2", 3, SHMHT_STORE_ADD), 0);
+	assert_equal (shmht_store (h, "key", 4, "v3", 3, SHMHT_STORE_REPLACE),
+				  1);
+	//The set replaces all the copies of the plain inserts.
+	assert_equal (shmht_insert (h, "key", 4, "v4", 3), 1);
+	assert_equal (shmht_count (h), 2);
+	assert_equal (shmht_store (h, "key", 4, "v5", 3, SHMHT_STORE_SET), 1);
+	assert_equal (shmht_count (h), 1);
+	ret_size = sizeof (value);
+	assert_equal (shmht_search_copy (h, "key", 4, value, &ret_size), 1);
+	assert_true (!strcmp (value, "v5"));
+
+	//Only one of the processes that add a key at once stores it.
+	for (i = 0; i < 8; i++)
+		if (fork () == 0)
+			_exit (shmht_store (h, "race", 5, "r", 2, SHMHT_STORE_ADD));
+	for (i = 0; i < 8; i++) {
+		wait (&status);
+		stored += WIFEXITED (status) && WEXITSTATUS (status) == 1;
+	}
+	assert_equal (stored, 1);
+	assert_equal (shmht_count (h), 2);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_store
+
+/*
+ * \test-name check_stats
+ * \test-function test_check_stats
+ */
+void
+test_check_stats ()
+{
+	char *key = "Key_for_test_check_stats";
+	char *stored_value = "This is the stored Value!";
+	size_t key_size = 100;
+	size_t ret_size;
+	struct shmht_stats stats;
+
+	//Create a shmht.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+	struct shmht *h2 =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h2, NULL);
+
+	assert_true (shmht_insert (h, key, strlen (key), stored_value,
+							   strlen (stored_value) + 1) > 0);
+	assert_true (shmht_insert (h, key, MAX_KEY_SIZE_FOR_TEST + 1,
+							   stored_value, strlen (stored_value) + 1) < 0);
+	assert_not_equal (shmht_search (h2, key, strlen (key), &ret_size), NULL);
+	assert_equal (shmht_search (h2, "Other", 5, &ret_size), NULL);
+	assert_equal (shmht_search (h2, "Another", 7, &ret_size), NULL);
+	assert_equal (shmht_remove (h, key, strlen (key)), 1);
+
+	//The stats are the same from any process.
+	assert_equal (shmht_stats (h2, &stats), 0);
+	assert_equal (stats.inserts, 1);
+	assert_equal (stats.insert_invalid, 1);
+	assert_equal (stats.hits, 1);
+	assert_equal (stats.misses, 2);
+	assert_equal (stats.removes, 1);
+	assert_equal (stats.entries, 0);
+	assert_true (stats.max_chain >= 1);
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+	free (h2);
+
+}								// test_check_stats
+
+/*
+ * \test-name check_lock_profile
+ * \test-function test_check_lock_profile
+ */
+void
+test_check_lock_profile ()
+{
+	char *key = "Key_for_test_lock_profile";
+	char *stored_value = "This is the stored Value!";
+	size_t key_size = 100;
+	size_t ret_size;
+	struct shmht_lock_histogram wait, hold;
+	int i;
+
+	//Create a shmht.
+	struct shmht *h =
+		create_shmht ("run_tests", 16, key_size, dbj2_hash, str_compar);
+	assert_not_equal (h, NULL);
+
+	assert_true (shmht_insert (h, key, strlen (key), stored_value,
+							   strlen (stored_value) + 1) > 0);
+	for (i = 0; i < 10; i++)
+		shmht_search (h, key, strlen (key), &ret_size);
+
+	int ret = shmht_lock_profile (h, SHMHT_OP_SEARCH, &wait, &hold);
+	if (ret != -ENOSYS) {
+		//Built with SHMHT_LOCK_PROFILE.
+		assert_equal (ret, 0);
+		assert_equal (wait.count, 10);
+		assert_equal (hold.count, 10);
+		unsigned long in_buckets = 0;
+		for (i = 0; i < SHMHT_LOCK_HIST_BUCKETS; i++)
+			in_buckets += hold.buckets[i];
+		assert_equal (in_buckets, 10);
+		assert_equal (shmht_lock_profile (h, SHMHT_OP_INSERT, &wait, &hold),
+					  0);
+		assert_equal (wait.count, 1);
+	}
+
+	//Destroy the global shmht
+	shmht_destroy (h);
+	free (h);
+
+}								// test_check_lock_profile
+
 /*
  * \test-name check_remove_older_entries
  * \test-function test_check_remove_older_entries
@@ -411,7 +2142,7 @@ test_check_create_huge_number_ht ()
 	assert_equal (shmht_count (h[900]), 1);
 
 
-	int ret_size;
+	size_t ret_size;
 	assert_true (strncmp
 				 ((char *)
 				  shmht_search (h[333], key, strlen (key), &ret_size),
@@ -441,6 +2172,31 @@ int main (int argc, char * argv [])
 	add_test (suite, test_check_count);
 	add_test (suite, test_check_long_insertions);
 	add_test (suite, test_check_flush);
+	add_test (suite, test_check_insert_after_flush);
+	add_test (suite, test_check_small_values_in_pool);
+	add_test (suite, test_check_values_bigger_than_buckets);
+	add_test (suite, test_check_compressed_values);
+	add_test (suite, test_check_compact);
+	add_test (suite, test_check_hashed_variants);
+	add_test (suite, test_check_try_variants);
+	add_test (suite, test_check_filter);
+	add_test (suite, test_check_near_cache);
+	add_test (suite, test_check_get_or_lock);
+	add_test (suite, test_check_set);
+	add_test (suite, test_check_container);
+	add_test (suite, test_check_changelog);
+	add_test (suite, test_check_search_batch);
+	add_test (suite, test_check_attach_ro);
+	add_test (suite, test_check_bulk_load);
+	add_test (suite, test_check_bulk_publish_blocked_writer);
+	add_test (suite, test_check_tag_invalidation);
+	add_test (suite, test_check_crash_recovery);
+	add_test (suite, test_check_gds_eviction);
+	add_test (suite, test_check_gds_crash_recovery);
+	add_test (suite, test_check_maintenance_threads);
+	add_test (suite, test_check_store);
+	add_test (suite, test_check_stats);
+	add_test (suite, test_check_lock_profile);
 	add_test (suite, test_check_remove_older_entries);
 	add_test (suite, test_check_number_of_removed_with_remove_older);
 	add_test (suite, test_check_create_huge_number_ht);